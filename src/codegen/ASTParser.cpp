@@ -1,5 +1,14 @@
 #include "ASTParser.h"
-#include "CommandLine.h"
+#include "CodeGenOptions.h"
+#include "CostHistory.h"
+#include "PCHGenerator.h"
+#include "PCHSynthesizer.h"
+#include "PreprocessorProbe.h"
+#include "ResultCache.h"
+#include "WorkerPool.h"
+#include "../util/FsHelper.h"
+#include "../util/HashUtil.h"
+#include "../util/LogUtil.h"
 #include "../util/StringUtil.h"
 
 #include <clang/AST/Mangle.h>
@@ -8,10 +17,25 @@
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/MapVector.h>
 #include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/ThreadPool.h>
 #include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 using namespace clang;
 using namespace clang::tooling;
@@ -85,17 +109,156 @@ namespace {
 
 namespace sapphire::codegen {
 
-    static ExportMap  gExports;
-    static std::mutex gExportsMutex;
-    static std::mutex gLogMutex;
+    // Export maps owned by the threads that fill them, so that committing entries takes no shared
+    // lock. Each thread finds its shard through a thread-local cache that is tagged with the
+    // generation of the shard set, which keeps it valid across runs. Every shard holds all
+    // versions from the start, so merging a finished version never changes the structure of a
+    // shard that its thread is still filling.
+    class ExportShards {
+    public:
+        explicit ExportShards(const std::vector<uint64_t> &versions) :
+            mGeneration(++gGeneration),
+            mVersions(versions) {}
+
+        ExportMap &local() {
+            thread_local uint64_t   tGeneration = 0;
+            thread_local ExportMap *tShard = nullptr;
+            if (tGeneration != mGeneration) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                tShard = &mShards[std::this_thread::get_id()];
+                for (auto version : mVersions)
+                    tShard->try_emplace(version, version);
+                tGeneration = mGeneration;
+            }
+            return *tShard;
+        }
+
+        // Moves the entries of a version from every shard into sigDatabase and sorts them. No
+        // task may commit entries of the version afterwards.
+        void mergeVersion(uint64_t version, SigDatabase &sigDatabase) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (auto &&[threadId, shard] : mShards)
+                sigDatabase.merge(std::move(shard.at(version)));
+            sigDatabase.sortEntries();
+        }
+
+    private:
+        static inline std::atomic<uint64_t> gGeneration{0};
+
+        const uint64_t                       mGeneration;
+        const std::vector<uint64_t>          mVersions;
+        std::mutex                           mMutex;
+        std::map<std::thread::id, ExportMap> mShards;
+    };
+
+    // A version to generate signatures for, with the PCH built for it.
+    struct VersionTarget {
+        std::string mVersion;
+        std::string mPchPath;
+        bool                  mPchUsesMCVersion = true;
+        uint64_t              mPchHash = 0;
+        // Real paths of the files the PCH was built from.
+        std::set<std::string> mPchInputFiles;
+    };
+
+    // Admits parses while the sum of their predicted memory fits the budget. A parse is always
+    // admitted when no other parse runs, so a header larger than the budget still gets parsed.
+    class MemoryAdmission {
+    public:
+        explicit MemoryAdmission(uint64_t budget) : mBudget(budget) {}
+
+        void acquire(uint64_t bytes) {
+            if (!mBudget) return;
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [&] { return mInUse == 0 || mInUse + bytes <= mBudget; });
+            mInUse += bytes;
+            mPeak = std::max(mPeak, mInUse);
+        }
+
+        void release(uint64_t bytes) {
+            if (!mBudget) return;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mInUse -= bytes;
+            }
+            mCondition.notify_all();
+        }
+
+        uint64_t peak() const { return mPeak; }
+
+    private:
+        const uint64_t          mBudget;
+        std::mutex              mMutex;
+        std::condition_variable mCondition;
+        uint64_t                mInUse = 0;
+        uint64_t                mPeak = 0;
+    };
+
+    // Holds tasks back until the work they depend on has finished, then submits them to the pool.
+    // Held tasks are submitted in the order of their priority, highest first.
+    class TaskGate {
+    public:
+        explicit TaskGate(llvm::ThreadPoolInterface &pool) : mPool(pool) {}
+
+        void defer(std::function<void()> task, uint64_t priority = 0) {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (!mOpen) {
+                    mPending.emplace_back(priority, std::move(task));
+                    return;
+                }
+            }
+            mPool.async(std::move(task));
+        }
+
+        void open() {
+            std::vector<std::pair<uint64_t, std::function<void()>>> pending;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mOpen = true;
+                pending.swap(mPending);
+            }
+            std::stable_sort(pending.begin(), pending.end(), [](auto &&lhs, auto &&rhs) {
+                return lhs.first > rhs.first;
+            });
+            for (auto &&[priority, task] : pending)
+                mPool.async(std::move(task));
+        }
+
+    private:
+        llvm::ThreadPoolInterface                              &mPool;
+        std::mutex                                              mMutex;
+        bool                                                    mOpen = false;
+        std::vector<std::pair<uint64_t, std::function<void()>>> mPending;
+    };
+
+    // Headers parsed together in one translation unit.
+    using ParseJob = std::vector<std::string>;
+
+    // Signature entries collected for one header, keyed by MC version.
+    struct ParseResult {
+        std::map<uint64_t, std::vector<SigDatabase::SigEntry>> mEntries;
+        bool                                                   mUsesMCVersion = false;
+        FileStampMap                                           mIncludedFiles;
+        // Bytes held by the AST, source manager and preprocessor at the end of the TU. Only set
+        // on the first result of a TU.
+        uint64_t                                               mMemoryBytes = 0;
+        // Sorted offsets of SPHR_DECL_API in the header. If set, namespaces and classes that
+        // contain none of them are not visited.
+        const std::vector<uint32_t>                           *mDeclOffsets = nullptr;
+    };
 
     class SapphireASTVisitor : public RecursiveASTVisitor<SapphireASTVisitor> {
     public:
-        explicit SapphireASTVisitor(uint64_t mcVer, ASTContext &Context) : mTargetMCVersion(mcVer), mContext(Context) {
+        explicit SapphireASTVisitor(const std::vector<uint64_t> &mcVers, ASTContext &Context) :
+            mTargetMCVersions(mcVers), mContext(Context) {
             // MSVC ABI
             mMangleCtx.reset(MicrosoftMangleContext::create(mContext, mContext.getDiagnostics()));
         }
 
+        // Sets the result that entries of the following declarations are attributed to.
+        void setResult(ParseResult &result) { mResult = &result; }
+
         static SigDatabase::SigOp consumeSigOp(llvm::StringRef &opTypeStr) {
             opTypeStr = opTypeStr.trim(' ');
             if (opTypeStr.empty() || opTypeStr == "none") {
@@ -159,46 +322,61 @@ namespace sapphire::codegen {
             return result.size();
         }
 
+        // Parses the version list of a sapphire::bind annotation. Returns false if it is invalid.
+        static bool readSupportVersions(const AnnotateAttr *ann, std::set<uint64_t> &supportVersion) {
+            if (ann->args_size()) {
+                if (auto *versionListLiteral = getStringFromExpr(ann->args_begin()[0])) {
+                    auto versStr = versionListLiteral->getString();
+                    if (!util::parseMCVersions(supportVersion, versStr)) {
+                        llvm::errs() << llvm::formatv("[Warning] Invalid version string: \"{0}\"\n", versStr);
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // Reads the sig and ops of a sapphire::bind annotation. Returns false on an invalid arg count.
+        static bool readBindArgs(const AnnotateAttr *ann, SigDatabase::SigEntry &sigEntry) {
+            auto argCount = ann->args_size();
+            auto args = ann->args_begin();
+            if (argCount == 2) { // SPHR_DECL_API("Versions", "Sig")
+                if (auto *SigLiteral = getStringFromExpr(args[1])) {
+                    sigEntry.mSig = SigLiteral->getString().str();
+                }
+            } else if (argCount == 3) { // SPHR_DECL_API("Versions", "Ops", "Sig")
+                if (auto *OpsLiteral = getStringFromExpr(args[1])) {
+                    readSigOps(sigEntry.mOperations, OpsLiteral->getString());
+                }
+                if (auto *SigLiteral = getStringFromExpr(args[2])) {
+                    sigEntry.mSig = SigLiteral->getString().str();
+                }
+            } else {
+                return false;
+            }
+            return true;
+        }
+
         bool VisitDataDecl(VarDecl *Val) {
             if (!Val->hasExternalFormalLinkage() || !Val->hasAttrs()) return true;
+            std::string symbol;
             for (const auto *attr : Val->getAttrs()) {
                 const auto *ann = dyn_cast<AnnotateAttr>(attr);
                 if (!ann) continue;
                 llvm::StringRef annotation = ann->getAnnotation();
                 if (annotation != "sapphire::bind") continue;
 
-                std::set<uint64_t>    supportVersion;
+                std::set<uint64_t> supportVersion;
+                if (!readSupportVersions(ann, supportVersion))
+                    continue;
+                auto versions = matchTargetVersions(supportVersion);
+                if (versions.empty())
+                    continue;
+
                 SigDatabase::SigEntry sigEntry;
                 sigEntry.mType = SigDatabase::SigEntry::Type::Data;
-
-                auto argCount = ann->args_size();
-                if (argCount) {
-                    if (auto *versionListLiteral = getStringFromExpr(ann->args_begin()[0])) {
-                        auto versStr = versionListLiteral->getString();
-                        if (!util::parseMCVersions(supportVersion, versStr)) {
-                            llvm::errs() << llvm::formatv("[Warning] Invalid version string: \"{0}\"\n", versStr);
-                            continue;
-                        }
-                    }
-                }
-                if (!supportVersion.count(mTargetMCVersion))
-                    continue;
-                if (argCount == 2) { // SPHR_DECL_API("Versions", "Sig")
-                    auto args = ann->args_begin();
-                    if (auto *SigLiteral = getStringFromExpr(args[1])) {
-                        sigEntry.mSig = SigLiteral->getString().str();
-                    }
-                } else if (argCount == 3) { // SPHR_DECL_API("Versions", "Ops", "Sig")
-                    auto args = ann->args_begin();
-                    if (auto *OpsLiteral = getStringFromExpr(args[1])) {
-                        readSigOps(sigEntry.mOperations, OpsLiteral->getString());
-                    }
-                    if (auto *SigLiteral = getStringFromExpr(args[2])) {
-                        sigEntry.mSig = SigLiteral->getString().str();
-                    }
-                } else {
+                if (!readBindArgs(ann, sigEntry))
                     continue;
-                }
 
                 if (sigEntry.mSig.empty()) {
                     llvm::errs() << llvm::formatv(
@@ -208,20 +386,18 @@ namespace sapphire::codegen {
                     continue;
                 }
 
-                llvm::raw_string_ostream Out(sigEntry.mSymbol);
-                if (mMangleCtx->shouldMangleDeclName(Val)) {
-                    mMangleCtx->mangleName(Val, Out);
-                } else {
-                    Out << Val->getQualifiedNameAsString();
+                if (symbol.empty()) {
+                    llvm::raw_string_ostream Out(symbol);
+                    if (mMangleCtx->shouldMangleDeclName(Val)) {
+                        mMangleCtx->mangleName(Val, Out);
+                    } else {
+                        Out << Val->getQualifiedNameAsString();
+                    }
                 }
 
-                if (!sigEntry.mSymbol.empty()) {
-                    std::lock_guard<std::mutex> lk(gExportsMutex);
-                    auto                        found = gExports.find(mTargetMCVersion);
-                    if (found == gExports.end()) {
-                        found = gExports.try_emplace(mTargetMCVersion, mTargetMCVersion).first;
-                    }
-                    found->second.addSigEntry(std::move(sigEntry));
+                if (!symbol.empty()) {
+                    sigEntry.mSymbol = symbol;
+                    addSigEntry(versions, std::move(sigEntry));
                 }
             }
             return true;
@@ -229,8 +405,9 @@ namespace sapphire::codegen {
 
         bool VisitFunctionDecl(FunctionDecl *Func) {
             if (!Func->hasAttrs()) return true;
-            const clang::AnnotateAttr *bindApi = nullptr;
-            const clang::AnnotateAttr *aliasApi = nullptr;
+            // The last matching sapphire::bind wins for each target version.
+            std::map<uint64_t, const clang::AnnotateAttr *> bindApis;
+            const clang::AnnotateAttr                      *aliasApi = nullptr;
             for (const auto *attr : Func->getAttrs()) {
                 const auto *ann = dyn_cast<AnnotateAttr>(attr);
                 if (!ann) continue;
@@ -238,68 +415,85 @@ namespace sapphire::codegen {
 
                 if (annotation == "sapphire::bind") {
                     std::set<uint64_t> supportVersion;
-                    if (ann->args_size()) {
-                        if (auto *versionListLiteral = getStringFromExpr(ann->args_begin()[0])) {
-                            auto versStr = versionListLiteral->getString();
-                            if (!util::parseMCVersions(supportVersion, versStr)) {
-                                llvm::errs() << llvm::formatv("[Warning] Invalid version string: \"{0}\"\n", versStr);
-                                continue;
-                            }
-                        }
-                    }
-                    if (!supportVersion.count(mTargetMCVersion))
+                    if (!readSupportVersions(ann, supportVersion))
                         continue;
-                    bindApi = ann;
+                    for (auto ver : matchTargetVersions(supportVersion))
+                        bindApis[ver] = ann;
                 } else if (annotation == "sapphire::alias")
                     aliasApi = ann;
             }
-            if (!bindApi) return true;
+            if (bindApis.empty()) return true;
 
-            std::set<uint64_t>    supportVersion;
-            SigDatabase::SigEntry sigEntry;
-            sigEntry.mType = SigDatabase::SigEntry::Type::Function;
+            llvm::MapVector<const clang::AnnotateAttr *, std::vector<uint64_t>> versionsByApi;
+            for (auto &&[ver, bindApi] : bindApis)
+                versionsByApi[bindApi].push_back(ver);
 
-            auto argCount = bindApi->args_size();
-            if (argCount) {
-                if (auto *versionListLiteral = getStringFromExpr(bindApi->args_begin()[0])) {
-                    auto versStr = versionListLiteral->getString();
-                    if (!util::parseMCVersions(supportVersion, versStr)) {
-                        llvm::errs() << llvm::formatv("[Warning] Invalid version string: \"{0}\"\n", versStr);
-                        return true;
-                    }
-                }
-            }
-            if (!supportVersion.count(mTargetMCVersion))
-                return true;
-            if (argCount == 2) { // SPHR_DECL_API("Versions", "Sig")
-                auto args = bindApi->args_begin();
-                if (auto *SigLiteral = getStringFromExpr(args[1])) {
-                    sigEntry.mSig = SigLiteral->getString().str();
-                }
-            } else if (argCount == 3) { // SPHR_DECL_API("Versions", "Ops", "Sig")
-                auto args = bindApi->args_begin();
-                if (auto *OpsLiteral = getStringFromExpr(args[1])) {
-                    readSigOps(sigEntry.mOperations, OpsLiteral->getString());
+            std::vector<std::pair<SigDatabase::SigEntry, const std::vector<uint64_t> *>> sigEntries;
+            for (auto &&[bindApi, versions] : versionsByApi) {
+                SigDatabase::SigEntry sigEntry;
+                if (!readBindArgs(bindApi, sigEntry)) {
+                    llvm::errs() << llvm::formatv(
+                        "[Warning] Invalid sapphire::bind annotation args: {0}\n",
+                        Func->getNameInfo().getName().getAsString()
+                    );
+                    continue;
                 }
-                if (auto *SigLiteral = getStringFromExpr(args[2])) {
-                    sigEntry.mSig = SigLiteral->getString().str();
+                if (sigEntry.mSig.empty()) {
+                    llvm::errs() << llvm::formatv(
+                        "[Warning] Empty signature detected for function: {0}\n",
+                        Func->getNameInfo().getName().getAsString()
+                    );
+                    continue;
                 }
-            } else {
-                llvm::errs() << llvm::formatv(
-                    "[Warning] Invalid sapphire::bind annotation args: {0}\n",
-                    Func->getNameInfo().getName().getAsString()
-                );
-                return true;
+                sigEntries.emplace_back(std::move(sigEntry), &versions);
             }
+            if (sigEntries.empty()) return true;
 
-            if (sigEntry.mSig.empty()) {
-                llvm::errs() << llvm::formatv(
-                    "[Warning] Empty signature detected for function: {0}\n",
-                    Func->getNameInfo().getName().getAsString()
-                );
+            SigDatabase::SigEntry symbolEntry;
+            symbolEntry.mType = SigDatabase::SigEntry::Type::Function;
+            if (!mangleFunction(Func, aliasApi, symbolEntry) || symbolEntry.mSymbol.empty())
                 return true;
+
+            for (auto &&[sigEntry, versions] : sigEntries) {
+                sigEntry.mType = symbolEntry.mType;
+                sigEntry.mSymbol = symbolEntry.mSymbol;
+                sigEntry.mExtraSymbol = symbolEntry.mExtraSymbol;
+                addSigEntry(*versions, std::move(sigEntry));
+            }
+            return true;
+        }
+
+        static const clang::StringLiteral *getStringFromExpr(const Expr *E) {
+            if (!E) return nullptr;
+            const Expr *Unwrapped = E->IgnoreParenImpCasts();
+            return dyn_cast<clang::StringLiteral>(Unwrapped);
+        }
+
+        static const clang::IntegerLiteral *getIntegerFromExpr(const Expr *E) {
+            if (!E) return nullptr;
+            const Expr *Unwrapped = E->IgnoreParenImpCasts();
+            return dyn_cast<clang::IntegerLiteral>(Unwrapped);
+        }
+
+    private:
+        std::vector<uint64_t> matchTargetVersions(const std::set<uint64_t> &supportVersion) const {
+            std::vector<uint64_t> result;
+            for (auto ver : mTargetMCVersions) {
+                if (supportVersion.count(ver))
+                    result.push_back(ver);
             }
+            return result;
+        }
 
+        void addSigEntry(const std::vector<uint64_t> &versions, SigDatabase::SigEntry &&sigEntry) {
+            for (size_t i = 0; i + 1 < versions.size(); ++i)
+                mResult->mEntries[versions[i]].push_back(sigEntry);
+            mResult->mEntries[versions.back()].push_back(std::move(sigEntry));
+        }
+
+        // Fills the type, symbol and extra symbol of a function entry. Returns false if the
+        // sapphire::alias annotation is invalid.
+        bool mangleFunction(FunctionDecl *Func, const AnnotateAttr *aliasApi, SigDatabase::SigEntry &sigEntry) {
             llvm::raw_string_ostream Out(sigEntry.mSymbol);
             if (mMangleCtx->shouldMangleDeclName(Func)) {
                 const CXXMethodDecl *MD = dyn_cast<CXXMethodDecl>(Func);
@@ -309,14 +503,14 @@ namespace sapphire::codegen {
                             "[Warning] Invalid sapphire::alias annotation args size. {0}\n",
                             Func->getNameInfo().getName().getAsString()
                         );
-                        return true;
+                        return false;
                     }
                     if (MD->isVirtual() && MD->isInstance()) {
                         llvm::errs() << llvm::formatv(
                             "[Warning] Api with sapphire::alias annotation cannot be virtual. {0}\n",
                             Func->getNameInfo().getName().getAsString()
                         );
-                        return true;
+                        return false;
                     }
                     auto  args = aliasApi->args_begin();
                     auto *aliasTypeExpr = getIntegerFromExpr(args[0]);
@@ -325,7 +519,7 @@ namespace sapphire::codegen {
                             "[Warning] sapphire::alias annotation args must be alias type id. {0}\n",
                             Func->getNameInfo().getName().getAsString()
                         );
-                        return true;
+                        return false;
                     }
                     auto aliasTypeId = aliasTypeExpr->getValue();
                     if (aliasTypeId == 0) {
@@ -360,7 +554,7 @@ namespace sapphire::codegen {
                             aliasTypeId,
                             Func->getNameInfo().getName().getAsString()
                         );
-                        return true;
+                        return false;
                     }
 
                 } else if (MD && MD->isVirtual() && MD->isInstance()) {
@@ -374,45 +568,32 @@ namespace sapphire::codegen {
             } else {
                 Out << Func->getNameInfo().getName().getAsString();
             }
-
-            if (!sigEntry.mSymbol.empty()) {
-                std::lock_guard<std::mutex> lk(gExportsMutex);
-                auto                        found = gExports.find(mTargetMCVersion);
-                if (found == gExports.end()) {
-                    found = gExports.try_emplace(mTargetMCVersion, mTargetMCVersion).first;
-                }
-                found->second.addSigEntry(std::move(sigEntry));
-            }
-
             return true;
         }
 
-        static const clang::StringLiteral *getStringFromExpr(const Expr *E) {
-            if (!E) return nullptr;
-            const Expr *Unwrapped = E->IgnoreParenImpCasts();
-            return dyn_cast<clang::StringLiteral>(Unwrapped);
-        }
-
-        static const clang::IntegerLiteral *getIntegerFromExpr(const Expr *E) {
-            if (!E) return nullptr;
-            const Expr *Unwrapped = E->IgnoreParenImpCasts();
-            return dyn_cast<clang::IntegerLiteral>(Unwrapped);
-        }
-
-    private:
-        uint64_t                                mTargetMCVersion;
+        const std::vector<uint64_t>            &mTargetMCVersions;
         ASTContext                             &mContext;
+        ParseResult                            *mResult = nullptr;
         std::unique_ptr<MicrosoftMangleContext> mMangleCtx;
     };
 
     class SapphireASTConsumer : public ASTConsumer {
     public:
-        explicit SapphireASTConsumer(uint64_t mcVer, ASTContext &Context) :
-            mVisitor(mcVer, Context), mSM(Context.getSourceManager()) {}
+        // Without owners, declarations written in the main file are attributed to results[0].
+        // Otherwise each declaration is attributed to the result of the owner file it is written in.
+        SapphireASTConsumer(
+            const std::vector<uint64_t>                             &mcVers,
+            ASTContext                                              &Context,
+            std::vector<ParseResult>                                &results,
+            llvm::DenseMap<const clang::FileEntry *, ParseResult *> &&owners
+        ) :
+            mVisitor(mcVers, Context), mSM(Context.getSourceManager()), mResults(results), mOwners(std::move(owners)) {}
 
         void visitDeclContext(DeclContext *DC) {
             if (!DC) return;
             for (auto *D : DC->decls()) {
+                if (isa<NamespaceDecl, TagDecl>(D) && !mayContainAnnotation(D))
+                    continue;
                 if (isa<NamespaceDecl>(D))
                     visitDeclContext(cast<NamespaceDecl>(D));
                 else if (isa<TagDecl>(D))
@@ -426,52 +607,149 @@ namespace sapphire::codegen {
 
         bool HandleTopLevelDecl(DeclGroupRef DG) override {
             for (auto *D : DG) {
-                clang::SourceLocation Loc = D->getLocation();
-                if (mSM.isWrittenInMainFile(Loc)) {
-                    if (isa<NamespaceDecl>(D))
-                        visitDeclContext(cast<NamespaceDecl>(D));
-                    else if (isa<TagDecl>(D))
-                        visitDeclContext(cast<TagDecl>(D));
-                    else if (FunctionDecl *FD = D->getAsFunction())
-                        mVisitor.VisitFunctionDecl(FD);
-                    else if (isa<VarDecl>(D))
-                        mVisitor.VisitDataDecl(cast<VarDecl>(D));
-                }
+                ParseResult *owner = findOwner(D->getLocation());
+                if (!owner) continue;
+                mVisitor.setResult(*owner);
+                mDeclOffsets = owner->mDeclOffsets;
+                if (isa<NamespaceDecl, TagDecl>(D) && !mayContainAnnotation(D))
+                    continue;
+                if (isa<NamespaceDecl>(D))
+                    visitDeclContext(cast<NamespaceDecl>(D));
+                else if (isa<TagDecl>(D))
+                    visitDeclContext(cast<TagDecl>(D));
+                else if (FunctionDecl *FD = D->getAsFunction())
+                    mVisitor.VisitFunctionDecl(FD);
+                else if (isa<VarDecl>(D))
+                    mVisitor.VisitDataDecl(cast<VarDecl>(D));
             }
             return true;
         }
 
     private:
-        clang::SourceManager &mSM;
-        SapphireASTVisitor    mVisitor;
+        // Whether the source range of the declaration covers one of the owner's SPHR_DECL_API
+        // offsets. Annotations of members are written inside their container, so a container
+        // without one can be skipped.
+        bool mayContainAnnotation(const Decl *D) const {
+            if (!mDeclOffsets) return true;
+            auto [beginFID, begin] = mSM.getDecomposedExpansionLoc(D->getBeginLoc());
+            auto [endFID, end] = mSM.getDecomposedExpansionLoc(D->getEndLoc());
+            if (beginFID != endFID) return true;
+            auto found = std::lower_bound(mDeclOffsets->begin(), mDeclOffsets->end(), begin);
+            return found != mDeclOffsets->end() && *found <= end;
+        }
+
+        ParseResult *findOwner(clang::SourceLocation Loc) {
+            if (mOwners.empty())
+                return mSM.isWrittenInMainFile(Loc) ? &mResults[0] : nullptr;
+            FileID FID = mSM.getFileID(Loc);
+            if (FID == mLastFID)
+                return mLastOwner;
+            ParseResult *owner = nullptr;
+            if (auto FE = mSM.getFileEntryRefForID(FID)) {
+                auto found = mOwners.find(&FE->getFileEntry());
+                if (found != mOwners.end())
+                    owner = found->second;
+            }
+            mLastFID = FID;
+            mLastOwner = owner;
+            return owner;
+        }
+
+        SapphireASTVisitor                                      mVisitor;
+        clang::SourceManager                                   &mSM;
+        std::vector<ParseResult>                               &mResults;
+        llvm::DenseMap<const clang::FileEntry *, ParseResult *> mOwners;
+        FileID                                                  mLastFID;
+        ParseResult                                            *mLastOwner = nullptr;
+        const std::vector<uint32_t>                            *mDeclOffsets = nullptr;
     };
 
     class SapphireGenAction : public ASTFrontendAction {
-        uint64_t mTargetMCVersion;
+        const std::vector<uint64_t>    &mTargetMCVersions;
+        const std::vector<std::string> &mOwnerFiles;
+        std::vector<ParseResult>       &mResults;
 
     public:
-        SapphireGenAction(uint64_t mcVer) : mTargetMCVersion(mcVer) {}
+        SapphireGenAction(
+            const std::vector<uint64_t> &mcVers, const std::vector<std::string> &ownerFiles, std::vector<ParseResult> &results
+        ) :
+            mTargetMCVersions(mcVers), mOwnerFiles(ownerFiles), mResults(results) {}
 
         std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, llvm::StringRef file) override {
-            return std::make_unique<SapphireASTConsumer>(mTargetMCVersion, CI.getASTContext());
+            CI.getPreprocessor().addPPCallbacks(std::make_unique<PreprocessorProbe>(
+                CI.getSourceManager(), mResults[0].mUsesMCVersion, &mResults[0].mIncludedFiles
+            ));
+            llvm::DenseMap<const clang::FileEntry *, ParseResult *> owners;
+            for (size_t i = 0; i < mOwnerFiles.size(); ++i) {
+                if (auto FE = CI.getFileManager().getOptionalFileRef(mOwnerFiles[i]))
+                    owners.try_emplace(&FE->getFileEntry(), &mResults[i]);
+            }
+            return std::make_unique<SapphireASTConsumer>(mTargetMCVersions, CI.getASTContext(), mResults, std::move(owners));
+        }
+
+        void EndSourceFileAction() override {
+            auto &CI = getCompilerInstance();
+            if (!CI.hasASTContext() || !CI.hasSourceManager() || !CI.hasPreprocessor()) return;
+            auto &context = CI.getASTContext();
+            auto &sourceManager = CI.getSourceManager();
+            mResults[0].mMemoryBytes = context.getASTAllocatedMemory() + context.getSideTableAllocatedMemory()
+                                     + sourceManager.getContentCacheSize() + sourceManager.getDataStructureSizes()
+                                     + sourceManager.getMemoryBufferSizes().malloc_bytes
+                                     + CI.getPreprocessor().getTotalMemory();
         }
     };
 
     class SapphireGenActionFactory : public clang::tooling::FrontendActionFactory {
-        uint64_t mTargetMCVersion;
+        const std::vector<uint64_t>    &mTargetMCVersions;
+        const std::vector<std::string> &mOwnerFiles;
+        std::vector<ParseResult>       &mResults;
 
     public:
-        explicit SapphireGenActionFactory(uint64_t mcVer) : mTargetMCVersion(mcVer) {}
+        SapphireGenActionFactory(
+            const std::vector<uint64_t> &mcVers, const std::vector<std::string> &ownerFiles, std::vector<ParseResult> &results
+        ) :
+            mTargetMCVersions(mcVers), mOwnerFiles(ownerFiles), mResults(results) {}
 
         std::unique_ptr<clang::FrontendAction> create() override {
-            return std::make_unique<SapphireGenAction>(mTargetMCVersion);
+            return std::make_unique<SapphireGenAction>(mTargetMCVersions, mOwnerFiles, mResults);
         }
     };
 
+    // Answers the compile command of a synthetic unity TU with the command of its first header.
+    class UnityCompilationDatabase : public CompilationDatabase {
+    public:
+        UnityCompilationDatabase(const CompilationDatabase &base, llvm::StringRef unityFile, std::string firstHeader) :
+            mBase(base), mUnityFile(unityFile), mFirstHeader(std::move(firstHeader)) {
+            llvm::sys::path::native(mUnityFile);
+        }
+
+        std::vector<CompileCommand> getCompileCommands(llvm::StringRef FilePath) const override {
+            llvm::SmallString<256> nativePath(FilePath);
+            llvm::sys::path::native(nativePath);
+            if (nativePath != mUnityFile)
+                return mBase.getCompileCommands(FilePath);
+
+            auto commands = mBase.getCompileCommands(mFirstHeader);
+            for (auto &&command : commands) {
+                for (auto &&arg : command.CommandLine) {
+                    if (arg == command.Filename)
+                        arg = std::string(mUnityFile);
+                }
+                command.Filename = std::string(mUnityFile);
+            }
+            return commands;
+        }
+
+    private:
+        const CompilationDatabase &mBase;
+        llvm::SmallString<256>     mUnityFile;
+        std::string                mFirstHeader;
+    };
+
     static ArgumentsAdjuster getSapphireArgumentsAdjuster(
-        const CommandLine &cmd, const std::string &pchPath, const std::string &targetMCVersion
+        const CodeGenOptions &options, const std::string &pchPath, const std::string &targetMCVersion
     ) {
-        return [&cmd, &pchPath, &targetMCVersion](const CommandLineArguments &Args, llvm::StringRef /*filename*/) {
+        return [&options, &pchPath, &targetMCVersion](const CommandLineArguments &Args, llvm::StringRef /*filename*/) {
             CommandLineArguments newArgs;
 
             newArgs.push_back(Args[0]);
@@ -483,16 +761,29 @@ namespace sapphire::codegen {
             if (!targetMCVersion.empty()) {
                 newArgs.push_back("/DMC_VERSION=" + targetMCVersion);
             }
-            auto clangResourceDir = cmd.getClangResourceDir();
+            auto clangResourceDir = options.mClangResourceDir;
             if (!clangResourceDir.empty()) {
                 newArgs.push_back("-resource-dir");
                 newArgs.push_back(clangResourceDir);
             }
+            if (options.mLeanParse) {
+                // Only declarations are visited, bodies and uninstantiated templates are never needed.
+                newArgs.push_back("-Xclang");
+                newArgs.push_back("-skip-function-bodies");
+                newArgs.push_back("-Xclang");
+                newArgs.push_back("-fdelayed-template-parsing");
+            }
             if (!pchPath.empty()) {
                 newArgs.push_back("-Xclang");
                 newArgs.push_back("-include-pch");
                 newArgs.push_back("-Xclang");
                 newArgs.push_back(pchPath);
+                if (options.mSkipPchValidation) {
+                    // The PCH was just built or verified by its manifest, checking its inputs
+                    // again in every TU only costs stats.
+                    newArgs.push_back("-Xclang");
+                    newArgs.push_back("-fno-validate-pch");
+                }
             }
 
             for (size_t i = 1; i < Args.size(); ++i) {
@@ -516,56 +807,875 @@ namespace sapphire::codegen {
         };
     }
 
+    static std::atomic<uint64_t> gUnityFileCounter{0};
+
+    // Parses the headers of a job in one TU with the target's MC_VERSION and PCH, collecting
+    // entries for every version in `versions` into one result per header. A job of more than
+    // one header is parsed as a synthetic unity TU in unityDir that includes each of them. If
+    // declOffsets is given, containers without an annotation offset of their header are skipped.
+    // Returns the ClangTool exit code.
+    static int parseJob(
+        CompilationDatabase                            &compilations,
+        const CodeGenOptions                           &options,
+        const std::vector<std::string>                 &headers,
+        const VersionTarget                            &target,
+        const std::vector<uint64_t>                    &versions,
+        const std::string                              &unityDir,
+        const TokenOffsetMap                           *declOffsets,
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+        std::vector<ParseResult>                       &results
+    ) {
+        results.assign(headers.size(), ParseResult{});
+        if (declOffsets) {
+            for (size_t i = 0; i < headers.size(); ++i) {
+                auto found = declOffsets->find(headers[i]);
+                if (found != declOffsets->end())
+                    results[i].mDeclOffsets = &found->second;
+            }
+        }
+
+        std::optional<UnityCompilationDatabase> unityCompilations;
+        std::string                             unityFile;
+        std::string                             unityContent;
+        if (headers.size() > 1) {
+            unityFile = (std::filesystem::path(unityDir)
+                         / llvm::formatv("sapphire_unity.{0}.cpp", gUnityFileCounter++).str())
+                            .string();
+            unityContent = "// Synthetic unity TU generated by SapphireCodeGen.\n";
+            for (auto &&header : headers)
+                unityContent += llvm::formatv("#include \"{0}\"\n", header).str();
+            unityCompilations.emplace(compilations, unityFile, headers[0]);
+        }
+
+        ClangTool tool(
+            unityCompilations ? static_cast<CompilationDatabase &>(*unityCompilations) : compilations,
+            unityCompilations ? unityFile : headers[0],
+            std::make_shared<PCHContainerOperations>(),
+            std::move(fs)
+        );
+        if (unityCompilations)
+            tool.mapVirtualFile(unityFile, unityContent);
+
+        tool.appendArgumentsAdjuster(getSapphireArgumentsAdjuster(options, target.mPchPath, target.mVersion));
+
+        std::string              diagOutput;
+        llvm::raw_string_ostream diagStream(diagOutput);
+
+        DiagnosticOptions     diagOpts{};
+        TextDiagnosticPrinter diagnosticPrinter(diagStream, diagOpts);
+
+        tool.setDiagnosticConsumer(&diagnosticPrinter);
+
+        // A single header is its own main file, so no owners are needed.
+        const std::vector<std::string> noOwners;
+        SapphireGenActionFactory       actionFactory(versions, unityCompilations ? headers : noOwners, results);
+        int                            ret = tool.run(&actionFactory);
+
+        // MC_VERSION use and includes are facts about the whole TU.
+        for (size_t i = 1; i < results.size(); ++i) {
+            results[i].mUsesMCVersion = results[0].mUsesMCVersion;
+            results[i].mIncludedFiles = results[0].mIncludedFiles;
+        }
+
+        diagStream.flush();
+        if (!diagOutput.empty()) {
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::errs() << diagOutput;
+        }
+        return ret;
+    }
+
+    // Serializes a parseJob call for a worker process. Offsets are only sent for lean parses.
+    static std::string encodeParseRequest(
+        const ParseJob              &headers,
+        const VersionTarget         &target,
+        const std::vector<uint64_t> &versions,
+        const std::string           &unityDir,
+        const TokenOffsetMap        *declOffsets
+    ) {
+        std::ostringstream out(std::ios::binary);
+        fshelper::write(out, target.mVersion);
+        fshelper::write(out, target.mPchPath);
+        fshelper::write<uint64_t>(out, versions.size());
+        for (auto version : versions)
+            fshelper::write(out, version);
+        fshelper::write(out, unityDir);
+        fshelper::write(out, declOffsets != nullptr);
+        fshelper::write<uint64_t>(out, headers.size());
+        for (auto &&header : headers) {
+            fshelper::write(out, header);
+            if (!declOffsets)
+                continue;
+            auto found = declOffsets->find(header);
+            auto count = found == declOffsets->end() ? 0 : found->second.size();
+            fshelper::write<uint64_t>(out, count);
+            for (size_t i = 0; i < count; ++i)
+                fshelper::write(out, found->second[i]);
+        }
+        return out.str();
+    }
+
+    static std::string encodeParseReply(int ret, const std::vector<ParseResult> &results) {
+        std::ostringstream out(std::ios::binary);
+        fshelper::write<int32_t>(out, ret);
+        fshelper::write<uint64_t>(out, results.size());
+        for (auto &&result : results) {
+            fshelper::write(out, result.mUsesMCVersion);
+            fshelper::write(out, result.mMemoryBytes);
+            fshelper::write<uint64_t>(out, result.mIncludedFiles.size());
+            for (auto &&[file, stamp] : result.mIncludedFiles) {
+                fshelper::write(out, file);
+                fshelper::write(out, stamp.mSize);
+                fshelper::write(out, stamp.mMTime);
+            }
+            fshelper::write<uint64_t>(out, result.mEntries.size());
+            for (auto &&[version, entries] : result.mEntries) {
+                fshelper::write(out, version);
+                fshelper::write<uint64_t>(out, entries.size());
+                for (auto &&entry : entries)
+                    SigDatabase::writeSigEntry(out, entry);
+            }
+        }
+        return out.str();
+    }
+
+    // Returns the parseJob exit code of the reply, or -1 if it is malformed. Every count is checked
+    // against the rest of the reply, so a broken worker cannot make the parent allocate for it.
+    static int decodeParseReply(const std::string &reply, size_t headerCount, std::vector<ParseResult> &results) {
+        fshelper::SpanReader reader(reply);
+        try {
+            results.assign(headerCount, ParseResult{});
+            auto ret = fshelper::read<int32_t>(reader);
+            if (fshelper::read<uint64_t>(reader) != headerCount)
+                return -1;
+            for (auto &&result : results) {
+                result.mUsesMCVersion = fshelper::read<bool>(reader);
+                result.mMemoryBytes = fshelper::read<uint64_t>(reader);
+                auto fileCount = fshelper::read<uint64_t>(reader);
+                // Path length, size and mtime.
+                reader.expect(fileCount, 3 * sizeof(uint64_t));
+                for (uint64_t i = 0; i < fileCount; ++i) {
+                    auto &stamp = result.mIncludedFiles[fshelper::read<std::string>(reader)];
+                    stamp.mSize = fshelper::read<uint64_t>(reader);
+                    stamp.mMTime = fshelper::read<int64_t>(reader);
+                }
+                auto versionCount = fshelper::read<uint64_t>(reader);
+                // Version and entry count.
+                reader.expect(versionCount, 2 * sizeof(uint64_t));
+                for (uint64_t i = 0; i < versionCount; ++i) {
+                    auto &entries = result.mEntries[fshelper::read<uint64_t>(reader)];
+                    auto  entryCount = fshelper::read<uint64_t>(reader);
+                    reader.expect(entryCount, SigDatabase::MIN_SIG_ENTRY_SIZE);
+                    entries.reserve(entries.size() + entryCount);
+                    for (uint64_t j = 0; j < entryCount; ++j)
+                        entries.emplace_back(SigDatabase::readSigEntry(reader));
+                }
+            }
+            return ret;
+        } catch (std::exception &e) {
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::errs() << llvm::formatv("[Worker] Error: Malformed reply: {0}\n", e.what());
+        }
+        results.assign(headerCount, ParseResult{});
+        return -1;
+    }
+
+    // Identifies everything besides file contents that a header's parse result depends on:
+    // the adjusted compile commands and the PCH.
+    static uint64_t computeConfigHash(
+        const CompileCommandIndex &compilations,
+        const CodeGenOptions      &options,
+        const std::string         &header,
+        const VersionTarget       &target
+    ) {
+        util::StableHasher hasher;
+        hasher.add(target.mPchHash);
+        auto adjuster = getSapphireArgumentsAdjuster(options, target.mPchPath, target.mVersion);
+        for (auto &&command : compilations.resolve(header).mCommands) {
+            hasher.add(command.Directory);
+            for (auto &&arg : adjuster(command.CommandLine, header))
+                hasher.add(arg);
+        }
+        return hasher.finish();
+    }
+
+    static void commitEntries(ExportMap &exports, uint64_t version, std::vector<SigDatabase::SigEntry> &&entries) {
+        if (entries.empty()) return;
+        auto found = exports.find(version);
+        if (found == exports.end()) {
+            found = exports.try_emplace(version, version).first;
+        }
+        for (auto &&entry : entries)
+            found->second.addSigEntry(std::move(entry));
+    }
+
+    // Builds the PCH for a version from source into pchPath and loads it into fs, so that every
+    // parse of the version shares one copy. The returned target has an empty PCH path if there is
+    // no source or generation failed.
+    static VersionTarget buildPCH(
+        const CompileCommandIndex                  &compilations,
+        const CodeGenOptions                       &options,
+        const std::optional<PCHSource>             &source,
+        const std::string                          &pchPath,
+        const std::string                          &version,
+        llvm::IntrusiveRefCntPtr<CachingFileSystem> fs
+    ) {
+        VersionTarget target;
+        target.mVersion = version;
+        if (!source)
+            return target;
+        target.mPchPath = pchPath;
+
+        PCHInfo pchInfo;
+        bool    success = PCHGenerator::generate(compilations, options, *source, target.mPchPath, version, fs, pchInfo);
+        auto    pchSize = success ? fs->preload(target.mPchPath) : 0;
+
+        std::lock_guard<std::mutex> lock(util::logMutex());
+        if (!success) {
+            llvm::errs() << "[PCH] Warning: Generation failed. Performance will be impacted.\n";
+            target.mPchPath.clear();
+        } else {
+            llvm::outs() << llvm::formatv(
+                "[PCH] Ready: {0} ({1:F1} MB in memory)\n", target.mPchPath, pchSize / (1024.0 * 1024.0)
+            );
+        }
+        target.mPchUsesMCVersion = pchInfo.mUsesMCVersion;
+        target.mPchHash = pchInfo.mHash;
+        target.mPchInputFiles = std::move(pchInfo.mInputFiles);
+        return target;
+    }
+
+    int ASTParser::serveWorker() {
+        worker::setupStdio();
+        std::string request;
+        while (worker::receiveFromParent(request)) {
+            VersionTarget         target;
+            std::vector<uint64_t> versions;
+            std::string           unityDir;
+            bool                  lean = false;
+            ParseJob              headers;
+            TokenOffsetMap        declOffsets;
+            fshelper::SpanReader  reader(request);
+            try {
+                target.mVersion = fshelper::read<std::string>(reader);
+                target.mPchPath = fshelper::read<std::string>(reader);
+                auto versionCount = fshelper::read<uint64_t>(reader);
+                reader.expect(versionCount, sizeof(uint64_t));
+                versions.resize(versionCount);
+                for (auto &&version : versions)
+                    version = fshelper::read<uint64_t>(reader);
+                unityDir = fshelper::read<std::string>(reader);
+                lean = fshelper::read<bool>(reader);
+                auto headerCount = fshelper::read<uint64_t>(reader);
+                reader.expect(headerCount, sizeof(uint64_t));
+                headers.resize(headerCount);
+                for (auto &&header : headers) {
+                    header = fshelper::read<std::string>(reader);
+                    if (!lean)
+                        continue;
+                    auto &offsets = declOffsets[header];
+                    auto  offsetCount = fshelper::read<uint64_t>(reader);
+                    reader.expect(offsetCount, sizeof(uint32_t));
+                    offsets.resize(offsetCount);
+                    for (auto &&offset : offsets)
+                        offset = fshelper::read<uint32_t>(reader);
+                }
+            } catch (std::exception &e) {
+                llvm::errs() << llvm::formatv("[Worker] Error: Malformed request: {0}\n", e.what());
+                return 1;
+            }
+
+            std::vector<ParseResult> results;
+            int                      ret = parseJob(
+                mCompilations,
+                mOptions,
+                headers,
+                target,
+                versions,
+                unityDir,
+                lean ? &declOffsets : nullptr,
+                mFileSystem,
+                results
+            );
+            if (!worker::sendToParent(encodeParseReply(ret, results)))
+                return 1;
+        }
+        return 0;
+    }
+
     const ExportMap &ASTParser::getExports() const {
-        return gExports;
+        return mExports;
     }
 
     int ASTParser::run(
-        const std::vector<std::string> &sourceFiles, const std::string &pchPath, const std::string &targetMCVersion
+        const SourceProducer           &produceSources,
+        const std::vector<std::string> &targetMCVersions,
+        const std::string              &outputDir
     ) {
-        auto versionNum = util::parseMCVersion(targetMCVersion);
-        if (!versionNum) {
-            llvm::outs() << llvm::formatv("[ASTParser] Invalid target mc version string: {}\n", targetMCVersion);
-            return 1;
+        mExports.clear();
+        mDependencies.clear();
+
+        std::vector<uint64_t> versions;
+        for (auto &&version : targetMCVersions) {
+            auto versionNum = util::parseMCVersion(version);
+            if (!versionNum) {
+                llvm::outs() << llvm::formatv("[ASTParser] Invalid target mc version string: {}\n", version);
+                return 1;
+            }
+            versions.push_back(versionNum);
         }
-        SapphireGenActionFactory actionFactory(versionNum);
 
-        llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency();
+        // With worker processes every thread drives one worker. 0 threads requested means one per
+        // hardware thread.
+        unsigned                 workerCount = mWorkerArgs.empty() ? 0 : mOptions.mWorkerCount;
+        llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(workerCount ? workerCount : mOptions.mJobCount);
         llvm::DefaultThreadPool  pool(strategy);
 
+        // The sources are still produced without versions, so that the caller sees every file.
+        if (versions.empty()) {
+            produceSources(pool, [](auto &&...) {});
+            pool.wait();
+            return 0;
+        }
+
         llvm::outs() << llvm::formatv(
             "[Perf] Running on {0} threads (LLVM ThreadPool)...\n", strategy.compute_thread_count()
         );
 
+        const uint64_t  memoryBudget = static_cast<uint64_t>(mOptions.mMaxMemoryMB) << 20;
+        MemoryAdmission admission(memoryBudget);
+        if (memoryBudget) {
+            llvm::outs() << llvm::formatv("[Perf] Admitting parses within {0} MB.\n", mOptions.mMaxMemoryMB);
+        }
+
+        // PCHs the headers are parsed with: the header force-included by the compile commands, or
+        // else PCHs synthesized for clusters of headers that share includes. Headers outside every
+        // cluster use the first one, which is none with synthesized PCHs.
+        std::vector<std::optional<PCHSource>>   pchSources{PCHGenerator::findForceInclude(mCompilations)};
+        std::unordered_map<std::string, size_t> headerClusters;
+
+        auto clusterOf = [&](const std::string &header) -> size_t {
+            auto found = headerClusters.find(header);
+            return found == headerClusters.end() ? 0 : found->second;
+        };
+
+        // Synthesized PCHs are planned from every source, so headers can only be parsed once all
+        // of them are known. Otherwise each header is dispatched as soon as it is produced.
+        const bool streaming = pchSources[0] || !mOptions.mAutoPchThreshold;
+        if (streaming && !pchSources[0]) {
+            llvm::outs() << "[PCH] No /FI found in ANY compile commands and no shared includes to synthesize a "
+                            "PCH from. Performance will be impacted.\n";
+        }
+
+        // Targets of each cluster and version, assigned before the first PCH build starts.
+        const size_t                            versionCount = versions.size();
+        std::vector<std::vector<VersionTarget>> targets;
+        std::vector<std::unique_ptr<TaskGate>>  pchGates;
+        std::vector<std::atomic<size_t>>        pendingClusterCounts(versionCount);
+        TaskGate                                allPchGate(pool);
+        std::atomic<size_t>                     pendingPchCount{versionCount};
+        for (size_t i = 0; i < versionCount; ++i)
+            pchGates.emplace_back(std::make_unique<TaskGate>(pool));
+
+        // The target a job is parsed with for a version: its cluster's, unless the cluster's PCH
+        // contains one of its headers, which could then not be parsed as a main file. Only valid
+        // once the version's PCHs are ready.
+        auto jobTarget = [&](const ParseJob &job, size_t i) -> const VersionTarget & {
+            auto &target = targets[clusterOf(job[0])][i];
+            for (auto &&header : job) {
+                if (target.mPchInputFiles.count(header))
+                    return targets[0][i];
+            }
+            return target;
+        };
+
+        auto fileSize = [&](const std::string &header) -> uint64_t {
+            auto status = mFileSystem->status(header);
+            return status ? status->getSize() : 0;
+        };
+
+        // Splits the parse time and memory of a job evenly over its headers.
+        std::atomic<uint64_t> peakTUMemory{0};
+
+        auto recordCost = [&](const ParseJob &job, std::chrono::steady_clock::time_point begin, uint64_t memoryBytes) {
+            uint64_t peak = peakTUMemory;
+            while (peak < memoryBytes && !peakTUMemory.compare_exchange_weak(peak, memoryBytes)) {}
+            if (!mCostHistory) return;
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin
+            );
+            for (auto &&header : job)
+                mCostHistory->record(header, fileSize(header), micros.count() / job.size(), memoryBytes / job.size());
+        };
+
+        // The memory a job is expected to need. Headers without any history are assumed to need
+        // DEFAULT_TU_MEMORY each.
+        auto predictMemory = [&](const ParseJob &job) -> uint64_t {
+            constexpr uint64_t DEFAULT_TU_MEMORY = 512ull << 20;
+            uint64_t           bytes = 0;
+            for (auto &&header : job) {
+                uint64_t estimate = mCostHistory ? mCostHistory->estimateMemory(header) : 0;
+                bytes += estimate ? estimate : DEFAULT_TU_MEMORY;
+            }
+            return bytes;
+        };
+
+        // Lean parses only descend into containers that hold an annotation. Offsets arrive with
+        // the sources while parses already run.
+        TokenOffsetMap    declOffsets;
+        std::shared_mutex declOffsetMutex;
+
+        // Entries of each thread, merged in a fixed order once all tasks of a version are done.
+        ExportShards shards(versions);
+        for (auto version : versions)
+            mExports.try_emplace(version, version);
+
+        std::optional<WorkerPool> workers;
+        if (workerCount) {
+            workers.emplace(mWorkerArgs, workerCount);
+            llvm::outs() << llvm::formatv("[Perf] Parsing in {0} worker processes.\n", workerCount);
+        }
+
+        // Runs parseJob in this process, or in a worker process if there are any. A worker that
+        // crashes fails only the job it was parsing.
+        auto runParseJob = [&](const ParseJob              &headers,
+                               const VersionTarget         &target,
+                               const std::vector<uint64_t> &jobVersions,
+                               std::vector<ParseResult>    &results) -> int {
+            TokenOffsetMap jobOffsets;
+            if (mOptions.mLeanParse) {
+                std::shared_lock<std::shared_mutex> lock(declOffsetMutex);
+                for (auto &&header : headers) {
+                    auto found = declOffsets.find(header);
+                    if (found != declOffsets.end())
+                        jobOffsets.emplace(*found);
+                }
+            }
+            const TokenOffsetMap *jobDeclOffsets = mOptions.mLeanParse ? &jobOffsets : nullptr;
+            if (!workers) {
+                return parseJob(
+                    mCompilations,
+                    mOptions,
+                    headers,
+                    target,
+                    jobVersions,
+                    outputDir,
+                    jobDeclOffsets,
+                    mFileSystem,
+                    results
+                );
+            }
+            std::string reply;
+            if (!workers->call(encodeParseRequest(headers, target, jobVersions, outputDir, jobDeclOffsets), reply)) {
+                results.assign(headers.size(), ParseResult{});
+                return -1;
+            }
+            return decodeParseReply(reply, headers.size(), results);
+        };
+
         std::atomic<int> errorCount{0};
-        for (auto &&header : sourceFiles) {
-            pool.async([&]() {
-                ClangTool tool(mCompilations, header, std::make_shared<PCHContainerOperations>());
+        std::atomic<int> fallbackCount{0};
+        std::atomic<int> unityFallbackCount{0};
+
+        // Only needed for a depfile.
+        bool collectDependencies = !mOptions.mDepfile.empty();
+        auto addDependencies = [&](uint64_t version, const std::string &header, const FileStampMap &files) {
+            if (!collectDependencies) return;
+            std::lock_guard<std::mutex> lock(mDependencyMutex);
+            auto                       &dependencies = mDependencies[version];
+            dependencies.insert(header);
+            for (auto &&[file, stamp] : files)
+                dependencies.insert(file);
+        };
 
-                tool.appendArgumentsAdjuster(getSapphireArgumentsAdjuster(mCmd, pchPath, targetMCVersion));
+        // Tasks of each version that have not returned yet, plus one held until every source is
+        // dispatched. The last one to return completes the version.
+        std::vector<std::atomic<size_t>> pendingTaskCounts(versionCount);
+        for (auto &&count : pendingTaskCounts)
+            count = 1;
+        auto releaseVersion = [&](size_t i) {
+            if (--pendingTaskCounts[i] != 0)
+                return;
+            auto &sigDatabase = mExports.at(versions[i]);
+            shards.mergeVersion(versions[i], sigDatabase);
+            if (mVersionCallback && !sigDatabase.getSigEntries().empty())
+                mVersionCallback(versions[i], sigDatabase);
+        };
 
-                std::string              diagOutput;
-                llvm::raw_string_ostream diagStream(diagOutput);
+        // Whether a job is parsed for each version, from the versions its annotations are active for.
+        using VersionMask = std::vector<bool>;
 
-                DiagnosticOptions     diagOpts{};
-                TextDiagnosticPrinter diagnosticPrinter(diagStream, diagOpts);
+        std::function<void(const ParseJob &, size_t)>              parseTask;
+        std::function<void(const ParseJob &, const VersionMask &)> singlePassTask;
 
-                tool.setDiagnosticConsumer(&diagnosticPrinter);
+        // Wraps a task so that its versions stay pending until it returns.
+        auto trackedParseTask = [&](ParseJob job, size_t i) -> std::function<void()> {
+            ++pendingTaskCounts[i];
+            return [&, job = std::move(job), i] {
+                parseTask(job, i);
+                releaseVersion(i);
+            };
+        };
+        auto trackedSinglePassTask = [&](ParseJob job, VersionMask activeVersions) -> std::function<void()> {
+            for (auto &&count : pendingTaskCounts)
+                ++count;
+            return [&, job = std::move(job), activeVersions = std::move(activeVersions)] {
+                singlePassTask(job, activeVersions);
+                for (size_t i = 0; i < versionCount; ++i)
+                    releaseVersion(i);
+            };
+        };
 
-                int ret = tool.run(&actionFactory);
-                if (ret != 0) {
-                    ++errorCount;
+        // Parses a job for a single version. Cached headers are dropped from the job first, and a
+        // failed unity TU is split into single-header jobs.
+        parseTask = [&](const ParseJob &job, size_t i) {
+            const auto           &target = jobTarget(job, i);
+            ParseJob              misses;
+            std::vector<uint64_t> configHashes;
+            for (auto &&header : job) {
+                uint64_t configHash = 0;
+                if (mCache) {
+                    std::vector<SigDatabase::SigEntry> cached;
+                    FileStampMap                       cachedDependencies;
+                    configHash = computeConfigHash(mCompilations, mOptions, header, target);
+                    if (mCache->lookup(
+                            header,
+                            versions[i],
+                            configHash,
+                            cached,
+                            collectDependencies ? &cachedDependencies : nullptr
+                        )) {
+                        addDependencies(versions[i], header, cachedDependencies);
+                        commitEntries(shards.local(), versions[i], std::move(cached));
+                        continue;
+                    }
                 }
+                misses.push_back(header);
+                configHashes.push_back(configHash);
+            }
+            if (misses.empty()) return;
+
+            std::vector<ParseResult>    results;
+            const std::vector<uint64_t> version{versions[i]};
+            auto                        predictedMemory = predictMemory(misses);
+            admission.acquire(predictedMemory);
+            auto beginJob = std::chrono::steady_clock::now();
+            int  ret = runParseJob(misses, target, version, results);
+            admission.release(predictedMemory);
+            if (ret == 0)
+                recordCost(misses, beginJob, results[0].mMemoryBytes);
+            if (ret != 0 && misses.size() > 1) {
+                ++unityFallbackCount;
+                for (auto &&header : misses)
+                    pool.async(trackedParseTask({header}, i));
+                return;
+            }
+            if (ret != 0) {
+                ++errorCount;
+            }
+            for (size_t k = 0; k < misses.size(); ++k) {
+                auto &entries = results[k].mEntries[versions[i]];
+                if (ret == 0 && mCache)
+                    mCache->store(misses[k], versions[i], configHashes[k], results[k].mIncludedFiles, entries);
+                addDependencies(versions[i], misses[k], results[k].mIncludedFiles);
+                commitEntries(shards.local(), versions[i], std::move(entries));
+            }
+        };
 
-                diagStream.flush();
-                if (!diagOutput.empty()) {
-                    std::lock_guard<std::mutex> lock(gLogMutex);
-                    llvm::errs() << diagOutput;
+        // Parses a job once with the first version's MC_VERSION and PCH, collecting entries for
+        // every version. Jobs whose preprocessing references MC_VERSION, or all jobs when the PCH
+        // does, are parsed again for each remaining active version. Runs after every PCH is ready.
+        singlePassTask = [&](const ParseJob &job, const VersionMask &activeVersions) {
+            ParseJob                           misses;
+            std::vector<std::vector<uint64_t>> configHashes;
+            for (auto &&header : job) {
+                std::vector<uint64_t> headerHashes(versionCount);
+                if (mCache) {
+                    std::vector<std::vector<SigDatabase::SigEntry>> cached(versionCount);
+                    std::vector<FileStampMap>                       cachedDependencies(versionCount);
+                    bool                                            allCached = true;
+                    for (size_t i = 0; i < versionCount; ++i) {
+                        headerHashes[i] = computeConfigHash(mCompilations, mOptions, header, jobTarget(job, i));
+                        allCached &= mCache->lookup(
+                            header,
+                            versions[i],
+                            headerHashes[i],
+                            cached[i],
+                            collectDependencies ? &cachedDependencies[i] : nullptr
+                        );
+                    }
+                    if (allCached) {
+                        for (size_t i = 0; i < versionCount; ++i) {
+                            addDependencies(versions[i], header, cachedDependencies[i]);
+                            commitEntries(shards.local(), versions[i], std::move(cached[i]));
+                        }
+                        continue;
+                    }
                 }
-            });
+                misses.push_back(header);
+                configHashes.emplace_back(std::move(headerHashes));
+            }
+            if (misses.empty()) return;
+
+            const auto &primaryTarget = jobTarget(job, 0);
+
+            bool                        pchUsesMCVersion =
+                !primaryTarget.mPchPath.empty() && primaryTarget.mPchUsesMCVersion;
+            const std::vector<uint64_t> primaryVersion{versions[0]};
+
+            std::vector<ParseResult> results;
+            auto                     predictedMemory = predictMemory(misses);
+            admission.acquire(predictedMemory);
+            auto beginJob = std::chrono::steady_clock::now();
+            int  ret = runParseJob(misses, primaryTarget, pchUsesMCVersion ? primaryVersion : versions, results);
+            admission.release(predictedMemory);
+            if (ret == 0)
+                recordCost(misses, beginJob, results[0].mMemoryBytes);
+            if (ret != 0 && misses.size() > 1) {
+                ++unityFallbackCount;
+                for (auto &&header : misses)
+                    pool.async(trackedSinglePassTask({header}, activeVersions));
+                return;
+            }
+            if (ret != 0) {
+                ++errorCount;
+            }
+            if (ret == 0 && !pchUsesMCVersion && !results[0].mUsesMCVersion) {
+                for (size_t k = 0; k < misses.size(); ++k) {
+                    for (size_t i = 0; i < versionCount; ++i) {
+                        auto &entries = results[k].mEntries[versions[i]];
+                        if (mCache)
+                            mCache->store(
+                                misses[k], versions[i], configHashes[k][i], results[k].mIncludedFiles, entries
+                            );
+                        addDependencies(versions[i], misses[k], results[k].mIncludedFiles);
+                        commitEntries(shards.local(), versions[i], std::move(entries));
+                    }
+                }
+                return;
+            }
+
+            // The token stream depends on MC_VERSION, only the primary version's entries are valid.
+            fallbackCount += misses.size();
+            for (size_t k = 0; k < misses.size(); ++k) {
+                auto &entries = results[k].mEntries[versions[0]];
+                if (ret == 0 && mCache)
+                    mCache->store(misses[k], versions[0], configHashes[k][0], results[k].mIncludedFiles, entries);
+                addDependencies(versions[0], misses[k], results[k].mIncludedFiles);
+                commitEntries(shards.local(), versions[0], std::move(entries));
+            }
+            for (size_t i = 1; i < versionCount; ++i) {
+                if (activeVersions[i])
+                    pool.async(trackedParseTask(misses, i));
+            }
+        };
+
+        // Starts every PCH build at once. Parse tasks wait on the gates until their PCHs are ready.
+        std::once_flag pchBuildsStarted;
+
+        auto startPchBuilds = [&] {
+            const size_t clusterCount = pchSources.size();
+            targets.assign(clusterCount, std::vector<VersionTarget>(versionCount));
+            for (auto &&count : pendingClusterCounts)
+                count = clusterCount;
+            for (size_t i = 0; i < versionCount; ++i) {
+                for (size_t c = 0; c < clusterCount; ++c) {
+                    pool.async([&, i, c] {
+                        auto name = c ? llvm::formatv("{0}.auto{1}", targetMCVersions[i], c - 1).str()
+                                      : targetMCVersions[i];
+                        auto pchPath =
+                            (std::filesystem::path(outputDir) / ("sapphire_codegen." + name + ".pch")).string();
+                        auto beginPch = std::chrono::steady_clock::now();
+                        targets[c][i] = buildPCH(
+                            mCompilations, mOptions, pchSources[c], pchPath, targetMCVersions[i], mFileSystem
+                        );
+                        auto endPch = std::chrono::steady_clock::now();
+                        if (pchSources[c]) {
+                            std::lock_guard<std::mutex> lock(util::logMutex());
+                            llvm::outs() << llvm::formatv(
+                                "[PCH] {0} took {1}ms.\n", name, (endPch - beginPch).count() / 1'000'000.0
+                            );
+                        }
+                        if (--pendingClusterCounts[i] != 0)
+                            return;
+                        pchGates[i]->open();
+                        if (--pendingPchCount == 0)
+                            allPchGate.open();
+                    });
+                }
+            }
+        };
+
+        // Longest processing time first: jobs held by a gate are released with the most expensive
+        // first, so the run does not end with a few large headers on idle threads.
+        std::atomic<size_t> jobCount{0};
+
+        auto dispatchJob = [&](ParseJob job, const VersionMask &activeVersions) {
+            uint64_t cost = 0;
+            if (mCostHistory) {
+                for (auto &&header : job)
+                    cost += mCostHistory->estimate(header, fileSize(header));
+            }
+            ++jobCount;
+            if (mOptions.mSinglePass) {
+                allPchGate.defer(trackedSinglePassTask(std::move(job), activeVersions), cost);
+            } else {
+                for (size_t i = 0; i < versionCount; ++i) {
+                    if (activeVersions[i])
+                        pchGates[i]->defer(trackedParseTask(job, i), cost);
+                }
+            }
+        };
+
+        // Headers parsed together in one translation unit. Only headers with identical compile
+        // flags, the same PCH and the same active versions can share a TU, a batch is dispatched
+        // once it is full.
+        using BatchKey = std::tuple<uint64_t, size_t, VersionMask>;
+        auto                         unityBatchSize = mOptions.mUnityBatchSize;
+        std::mutex                   batchMutex;
+        std::map<BatchKey, ParseJob> openBatches;
+
+        auto submitHeader = [&](const std::string &header, const VersionMask &activeVersions) {
+            if (unityBatchSize <= 1) {
+                dispatchJob({header}, activeVersions);
+                return;
+            }
+            BatchKey groupKey{mCompilations.resolve(header).mFlagsKey, clusterOf(header), activeVersions};
+            ParseJob batch;
+            {
+                std::lock_guard<std::mutex> lock(batchMutex);
+                auto                       &openBatch = openBatches[groupKey];
+                openBatch.push_back(header);
+                if (openBatch.size() < unityBatchSize)
+                    return;
+                batch.swap(openBatch);
+            }
+            dispatchJob(std::move(batch), activeVersions);
+        };
+
+        // Resolves the compile commands of each source on the producing thread, so that grouping,
+        // config hashes and parses only look them up in the index. Versions none of a header's
+        // annotations are active for are not parsed.
+        std::vector<std::string>                     sourceFiles;
+        std::unordered_map<std::string, VersionMask> sourceVersions;
+        std::atomic<size_t>                          skippedParseCount{0};
+        std::mutex                                   sourceMutex;
+        auto                                         beginT = std::chrono::steady_clock::now();
+
+        auto sink = [&](const std::string           &header,
+                        const std::vector<uint32_t> &offsets,
+                        const std::vector<uint64_t> &headerVersions) {
+            VersionMask activeVersions(versionCount);
+            for (size_t i = 0; i < versionCount; ++i) {
+                activeVersions[i] =
+                    std::find(headerVersions.begin(), headerVersions.end(), versions[i]) != headerVersions.end();
+                skippedParseCount += !activeVersions[i];
+            }
+            mCompilations.resolve(header);
+            if (mOptions.mLeanParse) {
+                std::unique_lock<std::shared_mutex> lock(declOffsetMutex);
+                declOffsets.insert_or_assign(header, offsets);
+            }
+            {
+                std::lock_guard<std::mutex> lock(sourceMutex);
+                sourceFiles.push_back(header);
+                if (!streaming)
+                    sourceVersions.emplace(header, activeVersions);
+            }
+            if (streaming) {
+                std::call_once(pchBuildsStarted, startPchBuilds);
+                submitHeader(header, activeVersions);
+            }
+        };
+        produceSources(pool, sink);
+
+        if (!streaming && !sourceFiles.empty()) {
+            std::sort(sourceFiles.begin(), sourceFiles.end());
+            for (auto &&cluster : PCHSynthesizer::plan(mCompilations, mOptions, sourceFiles, *mFileSystem, outputDir)) {
+                auto &commands = mCompilations.resolve(cluster.mHeaders[0]).mCommands;
+                if (commands.empty())
+                    continue;
+                for (auto &&header : cluster.mHeaders)
+                    headerClusters[header] = pchSources.size();
+                pchSources.push_back(PCHSource{cluster.mPrefixHeader, commands[0]});
+            }
+            if (pchSources.size() == 1) {
+                llvm::outs() << "[PCH] No /FI found in ANY compile commands and no shared includes to synthesize a "
+                                "PCH from. Performance will be impacted.\n";
+            }
+            // The gates are still closed, so every job is released in cost order.
+            for (auto &&header : sourceFiles)
+                submitHeader(header, sourceVersions.at(header));
+            std::call_once(pchBuildsStarted, startPchBuilds);
+        }
+        for (auto &&[groupKey, batch] : openBatches) {
+            if (!batch.empty())
+                dispatchJob(std::move(batch), std::get<VersionMask>(groupKey));
+        }
+        if (unityBatchSize > 1) {
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::outs() << llvm::formatv(
+                "[ASTParser] Batched {0} headers into {1} unity TUs.\n", sourceFiles.size(), jobCount.load()
+            );
         }
+        for (size_t i = 0; i < versionCount; ++i)
+            releaseVersion(i);
 
         pool.wait();
+        for (auto it = mExports.begin(); it != mExports.end();)
+            it = it->second.getSigEntries().empty() ? mExports.erase(it) : std::next(it);
+        if (collectDependencies) {
+            for (auto &&clusterTargets : targets) {
+                for (size_t i = 0; i < versionCount; ++i) {
+                    auto &inputFiles = clusterTargets[i].mPchInputFiles;
+                    mDependencies[versions[i]].insert(inputFiles.begin(), inputFiles.end());
+                }
+            }
+        }
+        auto endT = std::chrono::steady_clock::now();
+        if (sourceFiles.empty())
+            return 0;
+
+        if (!mOptions.mSinglePass && skippedParseCount) {
+            llvm::outs() << llvm::formatv(
+                "[ASTParser] Skipped {0} / {1} header parses for versions no annotation in the header is active for.\n",
+                skippedParseCount.load(),
+                sourceFiles.size() * versionCount
+            );
+        }
+        if (mOptions.mSinglePass) {
+            llvm::outs() << llvm::formatv(
+                "[ASTParser] Single-pass parsed {0} / {1} headers, {2} fell back to per-version parsing.\n",
+                sourceFiles.size() - fallbackCount,
+                sourceFiles.size(),
+                fallbackCount.load()
+            );
+        }
+        llvm::outs() << llvm::formatv(
+            "[Perf] Largest TU held {0:F1} MB.\n", peakTUMemory.load() / (1024.0 * 1024.0)
+        );
+        if (memoryBudget) {
+            llvm::outs() << llvm::formatv(
+                "[Perf] Peak predicted parse memory: {0:F1} MB.\n", admission.peak() / (1024.0 * 1024.0)
+            );
+        }
+        if (workers && workers->failureCount()) {
+            llvm::outs() << llvm::formatv(
+                "[Perf] {0} worker processes failed and were replaced.\n", workers->failureCount()
+            );
+        }
+        if (unityFallbackCount) {
+            llvm::outs() << llvm::formatv(
+                "[ASTParser] {0} unity TUs failed and were split into single-header parses.\n",
+                unityFallbackCount.load()
+            );
+        }
+        llvm::outs() << llvm::formatv(
+            "[ASTParser] Parsed {0} headers for {1} versions. Time: {2}ms.\n",
+            sourceFiles.size(),
+            versionCount,
+            (endT - beginT).count() / 1'000'000.0
+        );
 
         return errorCount;
     }
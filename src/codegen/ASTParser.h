@@ -1,15 +1,22 @@
 #pragma once
 
+#include <llvm/Support/ThreadPool.h>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
+#include "CachingFileSystem.h"
+#include "CompileCommandIndex.h"
+#include "FileProcessor.h"
 #include "SigDatabase.h"
 
 // Forward declarations
-namespace clang::tooling {
-    class CompilationDatabase;
-}
 namespace sapphire::codegen {
-    class CommandLine;
+    struct CodeGenOptions;
+    class CostHistory;
+    class ResultCache;
 }
 
 namespace sapphire::codegen {
@@ -17,23 +24,76 @@ namespace sapphire::codegen {
     // A map from MC version to its signature database.
     using ExportMap = std::map<uint64_t, SigDatabase>;
 
+    // Receives a source file, the SPHR_DECL_API offsets in it and the target versions any of them
+    // is active for. The file is only parsed for those versions. May be called from any thread.
+    using SourceSink = std::function<void(
+        const std::string &header, const std::vector<uint32_t> &declOffsets, const std::vector<uint64_t> &versions
+    )>;
+
+    // Hands every source file to the sink and returns once all of them are handed over. Runs its
+    // work on the given pool, which it shares with the PCH builds and parses.
+    using SourceProducer = std::function<void(llvm::ThreadPoolInterface &pool, const SourceSink &sink)>;
+
+    // Receives the sorted entries of a version as soon as every parse of it is done.
+    using VersionCallback = std::function<void(uint64_t version, const SigDatabase &sigDatabase)>;
+
     class ASTParser {
     public:
-        ASTParser(clang::tooling::CompilationDatabase &compilations, const CommandLine &cmd) :
-            mCompilations(compilations), mCmd(cmd) {}
+        ASTParser(clang::tooling::CompilationDatabase &compilations, const CodeGenOptions &options) :
+            mCompilations(compilations), mOptions(options) {}
+
+        // Reuses unchanged results from the cache and stores fresh ones into it.
+        void setResultCache(ResultCache *cache) { mCache = cache; }
+
+        // Every PCH build and parse reads files through fs instead of the real filesystem. Built
+        // PCHs are loaded into it once and shared by all parses.
+        void setFileSystem(llvm::IntrusiveRefCntPtr<CachingFileSystem> fs) { mFileSystem = std::move(fs); }
 
-        // Runs the AST parsing process on the given source files.
+        // Parses in child processes started with args when mWorkerCount is set. args[0] is the path
+        // of this executable, and the children must call serveWorker().
+        void setWorkerCommand(std::vector<std::string> args) { mWorkerArgs = std::move(args); }
+
+        // Orders parse jobs by their expected cost and records the actual cost of each header.
+        void setCostHistory(CostHistory *history) { mCostHistory = history; }
+
+        // Called from a pool thread during run() for every version with entries, so that its
+        // outputs can be written while other versions are still parsed.
+        void setVersionCallback(VersionCallback callback) { mVersionCallback = std::move(callback); }
+
+        // Builds the PCH of every target version into outputDir and parses the source files for
+        // all of them as one task graph on a shared thread pool, which also runs produceSources.
+        // All PCH builds start with the first source and each source is parsed as soon as it is
+        // produced and its PCH is ready. With synthesized PCHs parsing waits for every source.
         // Returns 0 on success.
         int run(
-            const std::vector<std::string> &sourceFiles, const std::string &pchPath, const std::string &targetMCVersion
+            const SourceProducer           &produceSources,
+            const std::vector<std::string> &targetMCVersions,
+            const std::string              &outputDir
         );
 
-        // Provides access to the parsed export data.
+        // Serves parse requests of a parent process on stdin and stdout until stdin is closed.
+        // Returns 0 on a clean shutdown.
+        int serveWorker();
+
+        // Provides access to the parsed export data. Entries of each version are sorted.
         const ExportMap &getExports() const;
 
+        // Files the last run() read for each version: the headers, their includes and the PCH
+        // inputs. Only collected if a depfile is requested.
+        const std::map<uint64_t, std::set<std::string>> &getDependencies() const { return mDependencies; }
+
     private:
-        clang::tooling::CompilationDatabase &mCompilations;
-        const CommandLine                   &mCmd;
+        CompileCommandIndex                         mCompilations;
+        const CodeGenOptions                       &mOptions;
+        ResultCache                                *mCache = nullptr;
+        CostHistory                                *mCostHistory = nullptr;
+        VersionCallback                             mVersionCallback;
+        std::vector<std::string>                    mWorkerArgs;
+        ExportMap                                   mExports;
+        std::mutex                                  mDependencyMutex;
+        std::map<uint64_t, std::set<std::string>>   mDependencies;
+        llvm::IntrusiveRefCntPtr<CachingFileSystem> mFileSystem =
+            llvm::makeIntrusiveRefCnt<CachingFileSystem>(llvm::vfs::getRealFileSystem());
     };
 
 } // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "AnnotationScanner.h"
+#include "../util/StringUtil.h"
+
+#include <llvm/ADT/STLExtras.h>
+#include <cctype>
+#include <optional>
+#include <set>
+
+namespace sapphire::codegen {
+
+    namespace {
+
+        // Bits of the target versions.
+        using VersionMask = std::vector<bool>;
+
+        // The versions a condition may be true for and may be false for. Both are set for every
+        // version if the condition is not understood.
+        struct Condition {
+            VersionMask mMayBeTrue;
+            VersionMask mMayBeFalse;
+        };
+
+        VersionMask operator&(const VersionMask &lhs, const VersionMask &rhs) {
+            VersionMask result(lhs.size());
+            for (size_t i = 0; i < lhs.size(); ++i)
+                result[i] = lhs[i] && rhs[i];
+            return result;
+        }
+
+        // Strips comments and parentheses around the whole expression.
+        llvm::StringRef stripExpression(llvm::StringRef expression) {
+            expression = expression.split("//").first.split("/*").first.trim();
+            while (expression.size() >= 2 && expression.front() == '(' && expression.back() == ')') {
+                int depth = 0;
+                for (size_t i = 0; i + 1 < expression.size(); ++i) {
+                    depth += expression[i] == '(' ? 1 : expression[i] == ')' ? -1 : 0;
+                    if (depth == 0)
+                        return expression;
+                }
+                expression = expression.drop_front().drop_back().trim();
+            }
+            return expression;
+        }
+
+        // Whether an operand is exactly one identifier or number, with nothing else around it.
+        bool isSingleToken(llvm::StringRef operand) {
+            return !operand.empty() && llvm::all_of(operand, [](char c) {
+                       return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+                   });
+        }
+
+        // Evaluates `MC_VERSION <op> <version>` or `<version> <op> MC_VERSION` for every target.
+        // Anything more, such as `&&`, `||`, `!` or text after the version, is unknown.
+        Condition evaluateCondition(llvm::StringRef expression, const std::vector<uint64_t> &targets) {
+            Condition unknown{VersionMask(targets.size(), true), VersionMask(targets.size(), true)};
+
+            expression = stripExpression(expression);
+            static constexpr llvm::StringLiteral OPERATORS[] = {"==", "!=", "<=", ">=", "<", ">"};
+            for (auto op : OPERATORS) {
+                auto found = expression.find(op);
+                if (found == llvm::StringRef::npos)
+                    continue;
+                auto lhs = stripExpression(expression.take_front(found));
+                auto rhs = stripExpression(expression.drop_front(found + op.size()));
+                bool swapped = false;
+                if (rhs == "MC_VERSION") {
+                    std::swap(lhs, rhs);
+                    swapped = true;
+                }
+                if (lhs != "MC_VERSION" || !isSingleToken(rhs))
+                    return unknown;
+                uint64_t version = util::parseMCVersion(rhs);
+                if (!version)
+                    return unknown;
+
+                Condition condition{VersionMask(targets.size()), VersionMask(targets.size())};
+                for (size_t i = 0; i < targets.size(); ++i) {
+                    auto lhsValue = swapped ? version : targets[i];
+                    auto rhsValue = swapped ? targets[i] : version;
+                    bool holds = op == "==" ? lhsValue == rhsValue
+                               : op == "!=" ? lhsValue != rhsValue
+                               : op == "<=" ? lhsValue <= rhsValue
+                               : op == ">=" ? lhsValue >= rhsValue
+                               : op == "<"  ? lhsValue < rhsValue
+                                            : lhsValue > rhsValue;
+                    condition.mMayBeTrue[i] = holds;
+                    condition.mMayBeFalse[i] = !holds;
+                }
+                return condition;
+            }
+            return unknown;
+        }
+
+        // Reads the version list of an annotation from the text after its macro name, which must
+        // start with a plain string literal argument.
+        std::optional<std::set<uint64_t>> readVersionList(llvm::StringRef arguments) {
+            arguments = arguments.ltrim();
+            if (!arguments.consume_front("("))
+                return std::nullopt;
+            arguments = arguments.ltrim();
+            if (!arguments.consume_front("\""))
+                return std::nullopt;
+            auto [list, rest] = arguments.split('"');
+            rest = rest.ltrim();
+            if (list.contains('\\') || list.contains('\n') || !(rest.starts_with(",") || rest.starts_with(")")))
+                return std::nullopt;
+            std::set<uint64_t> versions;
+            if (!util::parseMCVersions(versions, list))
+                return std::nullopt;
+            return versions;
+        }
+
+        // Advances over a line of code, tracking whether it ends inside a block comment.
+        bool endsInBlockComment(llvm::StringRef line, bool inBlockComment) {
+            for (size_t i = 0; i < line.size(); ++i) {
+                if (inBlockComment) {
+                    if (line[i] == '*' && i + 1 < line.size() && line[i + 1] == '/') {
+                        inBlockComment = false;
+                        ++i;
+                    }
+                } else if (line[i] == '/' && i + 1 < line.size() && line[i + 1] == '/') {
+                    break;
+                } else if (line[i] == '/' && i + 1 < line.size() && line[i + 1] == '*') {
+                    inBlockComment = true;
+                    ++i;
+                } else if (line[i] == '"' || line[i] == '\'') {
+                    char quote = line[i];
+                    for (++i; i < line.size() && line[i] != quote; ++i) {
+                        if (line[i] == '\\')
+                            ++i;
+                    }
+                }
+            }
+            return inBlockComment;
+        }
+
+    } // namespace
+
+    std::vector<uint64_t> AnnotationScanner::getActiveVersions(
+        llvm::StringRef              content,
+        const std::vector<uint32_t> &offsets,
+        llvm::StringRef              token,
+        const std::vector<uint64_t> &targetVersions
+    ) {
+        const size_t targetCount = targetVersions.size();
+
+        // A conditional group: the versions its enclosing code is compiled for, and those for
+        // which every branch so far may have been skipped.
+        struct Group {
+            VersionMask mParent;
+            VersionMask mNotTaken;
+        };
+        std::vector<Group> groups;
+        VersionMask        compiled(targetCount, true);
+        VersionMask        active(targetCount, false);
+
+        size_t nextOffset = 0;
+        bool   inBlockComment = false;
+        for (size_t lineBegin = 0; lineBegin < content.size();) {
+            // A directive continues over escaped line ends.
+            size_t lineEnd = content.find('\n', lineBegin);
+            while (lineEnd != llvm::StringRef::npos
+                   && content.slice(lineBegin, lineEnd).rtrim('\r').ends_with("\\"))
+                lineEnd = content.find('\n', lineEnd + 1);
+            if (lineEnd == llvm::StringRef::npos)
+                lineEnd = content.size();
+            auto line = content.slice(lineBegin, lineEnd);
+            auto directive = line.ltrim();
+            bool isDirective = !inBlockComment && directive.consume_front("#");
+
+            for (; nextOffset < offsets.size() && offsets[nextOffset] < lineEnd; ++nextOffset) {
+                // Annotations in macro definitions are compiled where the macro is used.
+                if (isDirective)
+                    return targetVersions;
+                auto versions = readVersionList(content.drop_front(offsets[nextOffset] + token.size()));
+                if (!versions)
+                    return targetVersions;
+                for (size_t i = 0; i < targetCount; ++i) {
+                    if (compiled[i] && versions->count(targetVersions[i]))
+                        active[i] = true;
+                }
+            }
+
+            if (isDirective) {
+                directive = directive.ltrim();
+                auto keyword = directive.take_while([](char c) { return std::isalpha(static_cast<unsigned char>(c)); });
+                auto expression = directive.drop_front(keyword.size());
+                auto condition = [&] {
+                    return keyword == "if" || keyword == "elif" ? evaluateCondition(expression, targetVersions)
+                                                                : evaluateCondition("", targetVersions);
+                };
+                if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef") {
+                    auto branch = condition();
+                    groups.push_back({compiled, branch.mMayBeFalse});
+                    compiled = compiled & branch.mMayBeTrue;
+                } else if (keyword == "elif" || keyword == "elifdef" || keyword == "elifndef") {
+                    if (groups.empty())
+                        return targetVersions;
+                    auto branch = condition();
+                    auto &group = groups.back();
+                    compiled = group.mParent & group.mNotTaken & branch.mMayBeTrue;
+                    group.mNotTaken = group.mNotTaken & branch.mMayBeFalse;
+                } else if (keyword == "else") {
+                    if (groups.empty())
+                        return targetVersions;
+                    auto &group = groups.back();
+                    compiled = group.mParent & group.mNotTaken;
+                    group.mNotTaken.assign(targetCount, false);
+                } else if (keyword == "endif") {
+                    if (groups.empty())
+                        return targetVersions;
+                    compiled = groups.back().mParent;
+                    groups.pop_back();
+                }
+            } else {
+                inBlockComment = endsInBlockComment(line, inBlockComment);
+            }
+            lineBegin = lineEnd + 1;
+        }
+        if (!groups.empty())
+            return targetVersions;
+
+        std::vector<uint64_t> result;
+        for (size_t i = 0; i < targetCount; ++i) {
+            if (active[i])
+                result.push_back(targetVersions[i]);
+        }
+        return result;
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <cstdint>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Tells which target versions can see an annotation of a header without preprocessing it. The
+    // version list of every annotation is read from its first string argument, and `#if`/`#elif`
+    // conditions that compare MC_VERSION with a version macro such as v1_21_50 exclude the
+    // versions they are false for. Other conditions may be true or false for any version.
+    class AnnotationScanner {
+    public:
+        // Returns the versions of targetVersions for which one of the annotations at offsets may
+        // be compiled and lists the version. Returns every target version if any annotation or
+        // the conditional structure of the content cannot be read this way.
+        static std::vector<uint64_t> getActiveVersions(
+            llvm::StringRef              content,
+            const std::vector<uint32_t> &offsets,
+            llvm::StringRef              token,
+            const std::vector<uint64_t> &targetVersions
+        );
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
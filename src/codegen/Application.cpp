@@ -1,13 +1,17 @@
 #include "Application.h"
+#include "CodeGenerator.h"
 #include "CommandLine.h"
 #include "FileProcessor.h"
-#include "PCHGenerator.h"
+#include "FileWatcher.h"
 #include "ASTParser.h"
 #include "SignatureGenerator.h"
 #include "HeaderGenerator.h"
 #include "../util/StringUtil.h"
 
+#include <chrono>
 #include <filesystem>
+#include <optional>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/FormatVariadic.h>
 
@@ -15,6 +19,9 @@ namespace fs = std::filesystem;
 
 namespace sapphire::codegen {
 
+    // Its address identifies this executable for getMainExecutable().
+    static int gMainAnchor;
+
     Application::Application(int argc, const char **argv) :
         mArgc(argc), mArgv(argv), mCategory("Sapphire CodeGen Options") {}
 
@@ -27,72 +34,145 @@ namespace sapphire::codegen {
         //     -p <path>               build path that contains compile commands
         //     -resource-dir <path>    clang resource headers path
         //     -mc-versions <ver-list> mc version macro names, seperated by ','
+        //     -header-extensions=<l>  extensions of the scanned headers (default: .h,.hpp)
+        //     -exclude=<glob-list>    skip files and directories matching any glob
         //     -gen-headers            generate headers
+        //     -single-pass            parse version independent headers once for all versions
+        //     -incremental            reuse results of unchanged headers from the previous run
+        //     -pch-cache=<bool>       reuse PCHs whose inputs are unchanged (default: true)
+        //     -auto-pch-threshold=<%> synthesize a PCH of includes shared by % of the headers
+        //     -pch-clusters=<N>       synthesize PCHs for the N largest header directories
+        //     -unity-batch=<N>        parse up to N headers with the same flags in one TU
+        //     -skip-pch-validation    do not revalidate the PCH inputs in every TU
+        //     -lean-parse             skip function bodies and unannotated declarations
+        //     -j=<N>                  number of parse threads
+        //     -max-memory=<MB>        memory budget for concurrent parses
+        //     -workers=<N>            parse in N child processes
+        //     -shard=<i>/<N>          process shard i of N and write partial databases
+        //     -merge                  merge the partial databases in the given directories
+        //     -watch                  stay resident and regenerate when the sources change
+        //     -depfile=<path>         write a Makefile-style depfile of the inputs of each output
+        //     -sig-format=<1.1|2>     format of the .sig.db files, 2 is indexed and memory-mappable
+        //     -sig-bundle             also write every version into one bundle
+        //     -sig-bundle-compression=<none|zlib|zstd>
+        //                             compression of the bundle sections (default: zstd)
 
         CommandLine cmd(mArgc, mArgv, mCategory);
         if (!cmd.isValid()) {
             llvm::errs() << "Failed to parse command line arguments.\n";
             return 1;
         }
+        auto options = cmd.getOptions();
+
+        // A worker owns stdout for replies to its parent.
+        if (cmd.parseWorker())
+            return ASTParser(cmd.getCompilations(), options).serveWorker();
 
-        auto outputPath = fs::absolute(cmd.getOutputDirectory()).lexically_normal();
+        auto outputPath = fs::absolute(options.mOutputDirectory).lexically_normal();
 
-        std::set<std::string> targetMCVersions;
-        if (!util::parseMCVersions(targetMCVersions, cmd.getTargetMCVersions())) {
-            llvm::errs() << llvm::formatv("[Error] Invalid mc version: '{0}'.\n", cmd.getTargetMCVersions());
+        unsigned shardIndex = 0, shardCount = 1;
+        if (!cmd.getShard().empty() && !util::parseShard(cmd.getShard(), shardIndex, shardCount)) {
+            llvm::errs() << llvm::formatv("[Error] Invalid shard: '{0}', expected <i>/<N>.\n", cmd.getShard());
+            return 1;
+        }
+        bool sharded = !cmd.getShard().empty();
+        if (cmd.watch() && (sharded || cmd.merge())) {
+            llvm::errs() << "[Error] -watch cannot be combined with -shard or -merge.\n";
+            return 1;
         }
 
         std::filesystem::create_directories(outputPath);
 
-        llvm::outs() << "[Scan] Scanning directories...\n";
-        FileProcessor fileProcessor(cmd.getSourcePaths());
+        if (cmd.merge()) {
+            // Versions of the partial databases written by the shards.
+            std::set<uint64_t> partialVersions;
+            for (auto &&version : options.mTargetMCVersions) {
+                if (auto versionNum = util::parseMCVersion(version))
+                    partialVersions.emplace(versionNum);
+            }
+            ExportMap exports;
+            if (!SignatureGenerator::mergePartials(options.mSourcePaths, partialVersions, exports))
+                return 1;
+            SignatureGenerator::generate(exports, outputPath.string(), options.mSigFormat);
+            if (options.mSigBundle
+                && !SignatureGenerator::generateBundle(exports, outputPath.string(), options.mSigBundleCompression))
+                return 1;
+            return 0;
+        }
 
-        const auto &allSources = fileProcessor.getAllHeaderFiles();
-        if (allSources.empty()) {
-            llvm::errs() << "[Error] No header files found.\n";
-            return 1;
+        if (cmd.benchFilterRounds()) {
+            FileProcessor fileProcessor(options);
+            fileProcessor.scan();
+            const auto &allSources = fileProcessor.getAllHeaderFiles();
+            if (allSources.empty()) {
+                llvm::errs() << "[Error] No header files found.\n";
+                return 1;
+            }
+            return FileProcessor::benchmarkFilter(allSources, "SPHR_DECL_API", cmd.benchFilterRounds()) ? 0 : 1;
         }
-        llvm::outs() << llvm::formatv("[Scan] Found {0} header files.\n", allSources.size());
 
         if (cmd.genHeader()) {
-            HeaderGenerator::generate(cmd.getSourcePaths(), allSources, outputPath.string());
+            llvm::outs() << "[Scan] Scanning directories...\n";
+            FileProcessor fileProcessor(options);
+            fileProcessor.scan();
+            const auto &allSources = fileProcessor.getAllHeaderFiles();
+            if (allSources.empty()) {
+                llvm::errs() << "[Error] No header files found.\n";
+                return 1;
+            }
+            llvm::outs() << llvm::formatv("[Scan] Found {0} header files.\n", allSources.size());
+            HeaderGenerator::generate(options.mSourcePaths, allSources, outputPath.string());
             return 0;
         }
 
-        auto beginFilter = std::chrono::steady_clock::now();
-        auto activeSources = fileProcessor.filterFilesByToken("SPHR_DECL_API");
-        auto endFilter = std::chrono::steady_clock::now();
-        llvm::outs() << llvm::formatv(
-            "[Filter] Retained {0} / {1} files (Took {2}s)\n",
-            activeSources.size(),
-            allSources.size(),
-            std::chrono::duration<double>(endFilter - beginFilter).count()
-        );
-
-        if (activeSources.empty()) {
-            llvm::outs() << "[Info] No files contain SPHR_DECL_API. Nothing to do.\n";
-            return 0;
+        CodeGenerator generator(options, cmd.getCompilations());
+        // Watch mode keeps the results of unchanged headers in memory even without -incremental.
+        generator.setKeepResults(cmd.watch());
+        if (sharded) {
+            generator.setShard(shardIndex, shardCount);
+        } else {
+            generator.setStreamOutputs(true);
+        }
+        if (options.mWorkerCount) {
+            std::vector<std::string> workerArgs{llvm::sys::fs::getMainExecutable(mArgv[0], &gMainAnchor)};
+            workerArgs.insert(workerArgs.end(), mArgv + 1, mArgv + mArgc);
+            workerArgs.emplace_back("-parse-worker");
+            generator.setWorkerCommand(std::move(workerArgs));
         }
 
-        ASTParser astParser(cmd.getCompilations(), cmd);
-        for (auto &&version : targetMCVersions) {
-            llvm::outs() << llvm::formatv("[Info] Processing for version: {}.\n", version);
+        // Created before the first run, so that changes made during it are not missed.
+        std::optional<FileWatcher> watcher;
+        if (cmd.watch()) {
+            watcher.emplace(options.mSourcePaths);
+        }
 
-            auto pchPath = (outputPath / llvm::formatv("sapphire_codegen.{0}.pch", version).str()).string();
-            if (!PCHGenerator::generate(cmd.getCompilations(), cmd, pchPath, version)) {
-                llvm::errs() << "[PCH] Warning: Generation failed. Performance will be impacted.\n";
-                pchPath.clear();
-            } else {
-                llvm::outs() << llvm::formatv("[PCH] Ready: {0}\n", pchPath);
-            }
+        if (!generator.run())
+            return 1;
+        if (sharded)
+            return generator.writePartialOutputs() ? 0 : 1;
+        generator.writeOutputs();
+        if (!watcher)
+            return 0;
 
-            auto beginT = std::chrono::steady_clock::now();
-            int  result = astParser.run(activeSources, pchPath, version);
-            auto endT = std::chrono::steady_clock::now();
-            llvm::outs() << llvm::formatv("[ASTParser] Time: {0}ms.\n", (endT - beginT).count() / 1'000'000.0);
+        llvm::outs() << llvm::formatv("[Watch] Watching {0} directories for changes.\n", watcher->directoryCount());
+        std::vector<std::string> changedPaths;
+        while (watcher->wait(changedPaths)) {
+            auto beginUpdate = std::chrono::steady_clock::now();
+            generator.update(changedPaths);
+            llvm::outs() << llvm::formatv(
+                "[Watch] {0} paths changed, {1} files retained.\n",
+                changedPaths.size(),
+                generator.getActiveSources().size()
+            );
+            generator.writeOutputs();
+            auto endUpdate = std::chrono::steady_clock::now();
+            llvm::outs() << llvm::formatv(
+                "[Watch] Regenerated in {0}s\n", std::chrono::duration<double>(endUpdate - beginUpdate).count()
+            );
+            llvm::outs().flush();
         }
-        SignatureGenerator::generate(astParser.getExports(), outputPath.string());
-        return 0;
+        llvm::errs() << "[Watch] Error: Failed to watch the source directories.\n";
+        return 1;
     }
 
 } // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "CachingFileSystem.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+namespace sapphire::codegen {
+
+    namespace {
+
+        // A view of cached content that keeps the content alive.
+        class SharedMemoryBuffer : public llvm::MemoryBuffer {
+        public:
+            SharedMemoryBuffer(std::shared_ptr<const CachingFileSystem::Content> content, std::string name) :
+                mContent(std::move(content)), mName(std::move(name)) {
+                auto data = mContent->mBuffer->getBuffer();
+                init(data.begin(), data.end(), /*RequiresNullTerminator*/ true);
+            }
+
+            llvm::StringRef getBufferIdentifier() const override { return mName; }
+
+            BufferKind getBufferKind() const override { return MemoryBuffer_Malloc; }
+
+        private:
+            std::shared_ptr<const CachingFileSystem::Content> mContent;
+            std::string                                       mName;
+        };
+
+        class CachedFile : public llvm::vfs::File {
+        public:
+            CachedFile(std::shared_ptr<const CachingFileSystem::Content> content, std::string name) :
+                mContent(std::move(content)), mName(std::move(name)) {}
+
+            llvm::ErrorOr<llvm::vfs::Status> status() override {
+                return llvm::vfs::Status::copyWithNewName(mContent->mStatus, mName);
+            }
+
+            llvm::ErrorOr<std::string> getName() override { return mContent->mRealName; }
+
+            llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+            getBuffer(const llvm::Twine &name, int64_t, bool, bool) override {
+                return std::make_unique<SharedMemoryBuffer>(mContent, name.str());
+            }
+
+            std::error_code close() override { return {}; }
+
+        private:
+            std::shared_ptr<const CachingFileSystem::Content> mContent;
+            std::string                                       mName;
+        };
+
+    } // namespace
+
+    std::string CachingFileSystem::getKey(const llvm::Twine &path) const {
+        llvm::SmallString<256> key;
+        path.toVector(key);
+        makeAbsolute(key);
+        llvm::sys::path::remove_dots(key);
+        return std::string(key);
+    }
+
+    llvm::ErrorOr<llvm::vfs::Status> CachingFileSystem::status(const llvm::Twine &path) {
+        auto key = getKey(path);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto                        found = mStatuses.find(key);
+            if (found != mStatuses.end()) {
+                ++mStatHitCount;
+                if (!found->second)
+                    return found->second.getError();
+                return llvm::vfs::Status::copyWithNewName(*found->second, path.str());
+            }
+        }
+
+        auto status = ProxyFileSystem::status(path);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStatuses.try_emplace(key, status);
+        return status;
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> CachingFileSystem::openFileForRead(const llvm::Twine &path) {
+        auto key = getKey(path);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto                        found = mContents.find(key);
+            if (found != mContents.end()) {
+                ++mReadHitCount;
+                return std::make_unique<CachedFile>(found->second, path.str());
+            }
+            auto missing = mStatuses.find(key);
+            if (missing != mStatuses.end() && !missing->second) {
+                ++mStatHitCount;
+                return missing->second.getError();
+            }
+        }
+
+        auto file = ProxyFileSystem::openFileForRead(path);
+        if (!file)
+            return file.getError();
+        auto status = (*file)->status();
+        if (!status)
+            return status.getError();
+        auto buffer = (*file)->getBuffer(
+            status->getName(), status->getSize(), /*RequiresNullTerminator*/ true, /*IsVolatile*/ false
+        );
+        if (!buffer)
+            return buffer.getError();
+        auto realName = (*file)->getName();
+
+        auto content = std::make_shared<Content>();
+        content->mBuffer = std::move(*buffer);
+        content->mStatus = *status;
+        content->mRealName = realName ? *realName : key;
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto [found, inserted] = mContents.try_emplace(key, std::move(content));
+        mStatuses.insert_or_assign(key, found->second->mStatus);
+        return std::make_unique<CachedFile>(found->second, path.str());
+    }
+
+    void CachingFileSystem::seed(const std::string &path, std::unique_ptr<llvm::MemoryBuffer> buffer) {
+        auto key = getKey(path);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mContents.count(key))
+                return;
+        }
+
+        auto status = ProxyFileSystem::status(key);
+        if (!status || status->getSize() != buffer->getBufferSize())
+            return;
+
+        auto content = std::make_shared<Content>();
+        content->mBuffer = std::move(buffer);
+        content->mStatus = *status;
+        llvm::SmallString<256> realPath;
+        content->mRealName = llvm::sys::fs::real_path(key, realPath) ? key : std::string(realPath);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto [found, inserted] = mContents.try_emplace(key, std::move(content));
+        mStatuses.insert_or_assign(key, found->second->mStatus);
+    }
+
+    uint64_t CachingFileSystem::preload(const llvm::Twine &path) {
+        auto key = getKey(path);
+        auto current = ProxyFileSystem::status(key);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto                        found = mContents.find(key);
+            if (found != mContents.end() && current
+                && (found->second->mStatus.getSize() != current->getSize()
+                    || found->second->mStatus.getLastModificationTime() != current->getLastModificationTime())) {
+                mContents.erase(found);
+                mStatuses.erase(key);
+            }
+        }
+
+        auto file = openFileForRead(path);
+        if (!file)
+            return 0;
+        auto status = (*file)->status();
+        return status ? status->getSize() : 0;
+    }
+
+    void CachingFileSystem::invalidate() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStatuses.clear();
+        mContents.clear();
+        mStatHitCount = 0;
+        mReadHitCount = 0;
+    }
+
+    void CachingFileSystem::invalidate(const std::vector<std::string> &paths) {
+        std::vector<std::string> keys;
+        keys.reserve(paths.size());
+        for (auto &&path : paths)
+            keys.emplace_back(getKey(path));
+        auto isInvalidated = [&](const std::string &cached) {
+            for (auto &&key : keys) {
+                if (llvm::StringRef(cached).starts_with(key)
+                    && (cached.size() == key.size() || llvm::sys::path::is_separator(cached[key.size()])))
+                    return true;
+            }
+            return false;
+        };
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto it = mStatuses.begin(); it != mStatuses.end();)
+            it = !it->second || isInvalidated(it->first) ? mStatuses.erase(it) : std::next(it);
+        for (auto it = mContents.begin(); it != mContents.end();)
+            it = isInvalidated(it->first) ? mContents.erase(it) : std::next(it);
+        mStatHitCount = 0;
+        mReadHitCount = 0;
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
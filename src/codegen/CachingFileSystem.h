@@ -0,0 +1,63 @@
+#pragma once
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // A thread-safe filesystem shared by every ClangTool of a run. Each path is stat'ed and
+    // read from the underlying filesystem at most once; failed stats are cached as well, so
+    // the include search of every TU does not probe the same missing paths again. Contents
+    // are handed out as shared buffers and stay valid after invalidate().
+    class CachingFileSystem : public llvm::vfs::ProxyFileSystem {
+    public:
+        // The cached content and status of a file.
+        struct Content {
+            std::unique_ptr<llvm::MemoryBuffer> mBuffer;
+            llvm::vfs::Status                   mStatus;
+            std::string                         mRealName;
+        };
+
+        explicit CachingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs) :
+            ProxyFileSystem(std::move(fs)) {}
+
+        llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+
+        llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+
+        // Provides the content of a file that was already read elsewhere. The buffer must be
+        // null-terminated. Does nothing if the file is cached already.
+        void seed(const std::string &path, std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+        // Reads a file into the cache ahead of its first use, so that concurrent first readers do
+        // not each read it. A cached copy is read again if the file changed since, such as a
+        // rebuilt PCH. Returns the size of the file, or 0 if it cannot be read.
+        uint64_t preload(const llvm::Twine &path);
+
+        // Drops every cached status and content, so that the next run sees the current files.
+        void invalidate();
+
+        // Drops the given paths, everything below them and every cached failed stat, so that
+        // changed, created and removed files are seen while everything else stays cached.
+        void invalidate(const std::vector<std::string> &paths);
+
+        size_t statHitCount() const { return mStatHitCount; }
+        size_t readHitCount() const { return mReadHitCount; }
+
+    private:
+        std::string getKey(const llvm::Twine &path) const;
+
+        std::mutex                                                        mMutex;
+        std::unordered_map<std::string, llvm::ErrorOr<llvm::vfs::Status>> mStatuses;
+        std::unordered_map<std::string, std::shared_ptr<const Content>>   mContents;
+        std::atomic<size_t>                                               mStatHitCount{0};
+        std::atomic<size_t>                                               mReadHitCount{0};
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "SigBundle.h"
+#include "SigDatabase.h"
+
+#include <string>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Settings of a code generation run. The command line fills them from its options, library
+    // users set them directly.
+    struct CodeGenOptions {
+        // Directories scanned for headers.
+        std::vector<std::string>   mSourcePaths;
+        // Extensions of the files that are headers, with the leading dot.
+        std::vector<std::string>   mHeaderExtensions{".h", ".hpp"};
+        // Glob patterns of files and directories the scan skips, matched against the full path
+        // with forward slashes and against the name.
+        std::vector<std::string>   mExcludePatterns;
+        // Directory of the generated databases, PCHs and state files.
+        std::string                mOutputDirectory;
+        // MC_VERSION macro names (e.g. v1_21_50), sorted and unique.
+        std::vector<std::string>   mTargetMCVersions;
+        // Overrides the clang resource dir (path to lib/clang/<version>) if not empty.
+        std::string                mClangResourceDir;
+        bool                       mSinglePass = false;
+        bool                       mIncremental = false;
+        bool                       mPchCache = true;
+        // Without a /FI in the compile commands, includes shared by this percentage of headers
+        // are compiled into a synthesized PCH. 0 to disable.
+        unsigned                   mAutoPchThreshold = 50;
+        // Directories with a synthesized PCH of their own.
+        unsigned                   mPchClusterCount = 0;
+        // Headers with identical compile flags parsed in one TU, 0 to disable.
+        unsigned                   mUnityBatchSize = 0;
+        bool                       mSkipPchValidation = false;
+        bool                       mLeanParse = false;
+        // Parse threads, 0 for one per hardware thread.
+        unsigned                   mJobCount = 0;
+        // Memory budget for concurrent parses, 0 for no limit.
+        unsigned                   mMaxMemoryMB = 0;
+        // Child processes that parse instead of threads, 0 to parse in this process.
+        unsigned                   mWorkerCount = 0;
+        // Makefile-style depfile written with the outputs, none if empty.
+        std::string                mDepfile;
+        // Files the compilation database was loaded from, listed in the depfile.
+        std::vector<std::string>   mCompilationDatabaseFiles;
+        // Format of the written .sig.db files. Partial databases always use the default.
+        SigDatabase::FormatVersion mSigFormat = SigDatabase::FormatVersion::v1_1_0;
+        // Also write every version into one bundle, see SigBundle.
+        bool                       mSigBundle = false;
+        SigBundle::Compression     mSigBundleCompression = SigBundle::Compression::Zstd;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include "CodeGenerator.h"
+#include "SignatureGenerator.h"
+#include "../util/LogUtil.h"
+#include "../util/StringUtil.h"
+
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+namespace sapphire::codegen {
+
+    namespace fs = std::filesystem;
+
+    static const std::string DECL_TOKEN = "SPHR_DECL_API";
+
+    // Hashes the entries of a database in their saved layout.
+    static uint64_t hashSigDatabase(const SigDatabase &sigDatabase) {
+        std::ostringstream out(std::ios::binary);
+        for (auto &&entry : sigDatabase.getSigEntries())
+            SigDatabase::writeSigEntry(out, entry);
+        return llvm::xxh3_64bits(out.str());
+    }
+
+    // Hashes a header by its path relative to the source directory that contains it, so that
+    // every machine assigns it to the same shard wherever the tree is checked out.
+    static uint64_t getShardKey(const std::string &header, const std::vector<std::string> &sourcePaths) {
+        auto path = fs::path(header).lexically_normal();
+        for (auto &&sourcePath : sourcePaths) {
+            auto relative = path.lexically_relative(fs::absolute(sourcePath).lexically_normal());
+            if (!relative.empty() && *relative.begin() != "..")
+                return llvm::xxh3_64bits(relative.generic_string());
+        }
+        return llvm::xxh3_64bits(path.generic_string());
+    }
+
+    // Numeric versions of the MC_VERSION names, without names that are not versions.
+    static std::set<uint64_t> getTargetVersions(const CodeGenOptions &options) {
+        std::set<uint64_t> versions;
+        for (auto &&version : options.mTargetMCVersions) {
+            if (auto versionNum = util::parseMCVersion(version))
+                versions.emplace(versionNum);
+        }
+        return versions;
+    }
+
+    // Escapes a path for a depfile as make and ninja read it.
+    static std::string escapeDepfilePath(const std::string &path) {
+        std::string escaped;
+        for (char c : fs::path(path).generic_string()) {
+            if (c == ' ' || c == '#')
+                escaped += '\\';
+            else if (c == '$')
+                escaped += '$';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    CodeGenerator::CodeGenerator(CodeGenOptions options, clang::tooling::CompilationDatabase &compilations) :
+        mOptions(std::move(options)),
+        mCompilations(compilations),
+        mOutputDirectory(fs::absolute(mOptions.mOutputDirectory).lexically_normal().string()),
+        mFileCache(llvm::makeIntrusiveRefCnt<CachingFileSystem>(llvm::vfs::getRealFileSystem())),
+        mParser(compilations, mOptions) {}
+
+    CodeGenerator::~CodeGenerator() = default;
+
+    void CodeGenerator::setShard(unsigned index, unsigned count) {
+        mShardIndex = index;
+        mShardCount = count;
+    }
+
+    void CodeGenerator::setWorkerCommand(std::vector<std::string> args) {
+        mParser.setWorkerCommand(std::move(args));
+    }
+
+    bool CodeGenerator::isInShard(const std::string &header) const {
+        return !mShardCount || getShardKey(header, mOptions.mSourcePaths) % mShardCount == mShardIndex;
+    }
+
+    void CodeGenerator::applyShard() {
+        if (!mShardCount)
+            return;
+        mActiveSources.erase(
+            std::remove_if(
+                mActiveSources.begin(),
+                mActiveSources.end(),
+                [&](const std::string &header) { return !isInShard(header); }
+            ),
+            mActiveSources.end()
+        );
+        llvm::outs() << llvm::formatv(
+            "[Shard] Processing {0} files as shard {1} of {2}.\n", mActiveSources.size(), mShardIndex, mShardCount
+        );
+    }
+
+    bool CodeGenerator::run() {
+        fs::create_directories(mOutputDirectory);
+
+        // Shards keep their own state files, so that the state of several shards can live side by side.
+        auto stateSuffix =
+            mShardCount ? llvm::formatv(".part-{0}-of-{1}", mShardIndex, mShardCount).str() : std::string();
+        mCachePath = (fs::path(mOutputDirectory) / ("sapphire_codegen.cache" + stateSuffix)).string();
+        mCostPath = (fs::path(mOutputDirectory) / ("sapphire_codegen.costs" + stateSuffix)).string();
+        mSnapshotPath = (fs::path(mOutputDirectory) / ("sapphire_codegen.scan" + stateSuffix)).string();
+
+        if (mOptions.mIncremental && mResultCache.load(mCachePath)) {
+            llvm::outs() << llvm::formatv("[Cache] Loaded: {0}\n", mCachePath);
+        }
+        mCostHistory.load(mCostPath);
+
+        if (mOptions.mIncremental || mKeepResults) {
+            mParser.setResultCache(&mResultCache);
+        }
+        mParser.setFileSystem(mFileCache);
+        mParser.setCostHistory(&mCostHistory);
+        if (mStreamOutputs) {
+            mParser.setVersionCallback([this](uint64_t version, const SigDatabase &sigDatabase) {
+                writeVersionOutputs(version, sigDatabase);
+            });
+        }
+
+        // Shared by every parse, so that each file is stat'ed and read once per run.
+        mFileCache->invalidate();
+        mResultCache.refresh();
+
+        // Headers are filtered while the scan goes on, and retained ones are parsed right away.
+        llvm::outs() << "[Scan] Scanning directories...\n";
+        mFileProcessor = std::make_unique<FileProcessor>(mOptions);
+        bool snapshotLoaded = mFileProcessor->loadSnapshot(mSnapshotPath, DECL_TOKEN);
+        mActiveSources.clear();
+        std::atomic<size_t> retainedCount{0};
+        parse([&](llvm::ThreadPoolInterface &pool, const SourceSink &sink) {
+            auto beginFilter = std::chrono::steady_clock::now();
+            mFileProcessor->scanAndFilter(
+                DECL_TOKEN,
+                pool,
+                mFileCache.get(),
+                [&](const std::string           &header,
+                    const std::vector<uint32_t> &offsets,
+                    const std::vector<uint64_t> &versions) {
+                    ++retainedCount;
+                    if (!isInShard(header))
+                        return;
+                    {
+                        std::lock_guard<std::mutex> lock(mActiveSourceMutex);
+                        mActiveSources.push_back(header);
+                    }
+                    sink(header, offsets, versions);
+                }
+            );
+            auto endFilter = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::outs() << llvm::formatv(
+                "[Scan] Found {0} header files.\n", mFileProcessor->getAllHeaderFiles().size()
+            );
+            if (snapshotLoaded) {
+                llvm::outs() << llvm::formatv(
+                    "[Scan] Reused {0} / {1} directory listings and {2} filter results from {3}\n",
+                    mFileProcessor->reusedDirectoryCount(),
+                    mFileProcessor->getScannedDirectories().size(),
+                    mFileProcessor->reusedHeaderCount(),
+                    mSnapshotPath
+                );
+            }
+            llvm::outs() << llvm::formatv(
+                "[Filter] Retained {0} / {1} files (Took {2}s)\n",
+                retainedCount.load(),
+                mFileProcessor->getAllHeaderFiles().size(),
+                std::chrono::duration<double>(endFilter - beginFilter).count()
+            );
+            if (mShardCount) {
+                llvm::outs() << llvm::formatv(
+                    "[Shard] Processing {0} files as shard {1} of {2}.\n",
+                    mActiveSources.size(),
+                    mShardIndex,
+                    mShardCount
+                );
+            }
+        });
+        std::sort(mActiveSources.begin(), mActiveSources.end());
+        mFileProcessor->saveSnapshot(mSnapshotPath, DECL_TOKEN);
+
+        if (mFileProcessor->getAllHeaderFiles().empty()) {
+            llvm::errs() << "[Error] No header files found.\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool CodeGenerator::update(const std::vector<std::string> &changedPaths) {
+        if (!mFileProcessor)
+            return false;
+        mFileCache->invalidate(changedPaths);
+        mResultCache.refresh();
+        mActiveSources = mFileProcessor->updateFiles(changedPaths, DECL_TOKEN, mFileCache.get());
+        applyShard();
+        parse([&](llvm::ThreadPoolInterface &, const SourceSink &sink) {
+            const auto &tokenOffsets = mFileProcessor->getTokenOffsets();
+            const auto &activeVersions = mFileProcessor->getActiveVersions();
+            for (auto &&header : mActiveSources)
+                sink(header, tokenOffsets.at(header), activeVersions.at(header));
+        });
+        return true;
+    }
+
+    void CodeGenerator::parse(const SourceProducer &produceSources) {
+        mParser.run(produceSources, mOptions.mTargetMCVersions, mOutputDirectory);
+        if (mActiveSources.empty()) {
+            llvm::outs() << "[Info] No files contain SPHR_DECL_API. Nothing to do.\n";
+            return;
+        }
+        llvm::outs() << llvm::formatv(
+            "[VFS] Served {0} stats and {1} reads from memory.\n",
+            mFileCache->statHitCount(),
+            mFileCache->readHitCount()
+        );
+
+        mCostHistory.save(mCostPath);
+        if (mOptions.mIncremental || mKeepResults) {
+            llvm::outs() << llvm::formatv("[Cache] Reused {0} parse results.\n", mResultCache.hitCount());
+        }
+        if (mOptions.mIncremental) {
+            mResultCache.save(mCachePath);
+        }
+    }
+
+    void CodeGenerator::writeVersionOutputs(uint64_t version, const SigDatabase &sigDatabase) {
+        auto hash = hashSigDatabase(sigDatabase);
+        {
+            std::lock_guard<std::mutex> lock(mOutputMutex);
+            if (std::exchange(mWrittenHashes[version], hash) == hash)
+                return;
+            mBundleDirty = true;
+        }
+        SignatureGenerator::generate(version, sigDatabase, mOutputDirectory, mOptions.mSigFormat);
+    }
+
+    void CodeGenerator::writeOutputs() {
+        // Only versions whose entries changed since the last write are written again, which skips
+        // every version that was streamed already.
+        for (auto &&[version, sigDatabase] : getExports())
+            writeVersionOutputs(version, sigDatabase);
+        if (mOptions.mSigBundle && std::exchange(mBundleDirty, false))
+            SignatureGenerator::generateBundle(getExports(), mOutputDirectory, mOptions.mSigBundleCompression);
+        writeDepfile();
+    }
+
+    bool CodeGenerator::writePartialOutputs() {
+        if (!mShardCount)
+            return false;
+        bool success = SignatureGenerator::generatePartial(
+            getExports(), getTargetVersions(mOptions), mOutputDirectory, mShardIndex, mShardCount
+        );
+        return writeDepfile() && success;
+    }
+
+    bool CodeGenerator::writeDepfile() {
+        if (mOptions.mDepfile.empty() || !mFileProcessor)
+            return true;
+
+        // Inputs of every output: any scanned header may gain an annotation, any scanned directory
+        // may gain a header and every compile command may change.
+        const auto           &allSources = mFileProcessor->getAllHeaderFiles();
+        std::set<std::string> commonInputs(allSources.begin(), allSources.end());
+        commonInputs.insert(
+            mFileProcessor->getScannedDirectories().begin(), mFileProcessor->getScannedDirectories().end()
+        );
+        commonInputs.insert(mOptions.mCompilationDatabaseFiles.begin(), mOptions.mCompilationDatabaseFiles.end());
+
+        std::ofstream file(mOptions.mDepfile);
+        if (!file.is_open()) {
+            llvm::errs() << llvm::formatv("[Depfile] Error: Cannot write to {0}\n", mOptions.mDepfile);
+            return false;
+        }
+
+        // One rule per version, since each version's outputs only depend on what its parses read.
+        // The bundle depends on what any of them read.
+        const auto           &dependencies = mParser.getDependencies();
+        std::set<std::string> bundleInputs = commonInputs;
+        for (auto version : getTargetVersions(mOptions)) {
+            auto outputs = mShardCount ? std::vector<std::string>{SignatureGenerator::getPartialPath(
+                                             mOutputDirectory, version, mShardIndex, mShardCount
+                                         )}
+                                       : SignatureGenerator::getOutputPaths(mOutputDirectory, version);
+            for (size_t i = 0; i < outputs.size(); ++i)
+                file << (i ? " " : "") << escapeDepfilePath(outputs[i]);
+            file << ":";
+
+            auto inputs = commonInputs;
+            auto found = dependencies.find(version);
+            if (found != dependencies.end()) {
+                // Files that no longer exist, such as synthetic unity TUs, would make every build
+                // run again.
+                for (auto &&path : found->second) {
+                    if (!commonInputs.count(path) && fs::exists(path))
+                        inputs.insert(path);
+                }
+            }
+            for (auto &&input : inputs)
+                file << " \\\n  " << escapeDepfilePath(input);
+            file << "\n";
+            bundleInputs.insert(inputs.begin(), inputs.end());
+        }
+        if (mOptions.mSigBundle && !mShardCount) {
+            file << escapeDepfilePath(SignatureGenerator::getBundlePath(mOutputDirectory)) << ":";
+            for (auto &&input : bundleInputs)
+                file << " \\\n  " << escapeDepfilePath(input);
+            file << "\n";
+        }
+        llvm::outs() << llvm::formatv("[Depfile] Generated: {0}\n", mOptions.mDepfile);
+        return file.good();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
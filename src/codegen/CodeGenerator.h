@@ -0,0 +1,109 @@
+#pragma once
+
+#include "ASTParser.h" // For ExportMap
+#include "CachingFileSystem.h"
+#include "CodeGenOptions.h"
+#include "CostHistory.h"
+#include "FileProcessor.h"
+#include "ResultCache.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // The code generator as a library. A generator keeps no global state: its options, the
+    // compilation database and everything it loads belong to the instance. A host can run
+    // generators for many configurations in one process, one after another or side by side.
+    class CodeGenerator {
+    public:
+        CodeGenerator(CodeGenOptions options, clang::tooling::CompilationDatabase &compilations);
+        ~CodeGenerator();
+
+        CodeGenerator(const CodeGenerator &) = delete;
+        CodeGenerator &operator=(const CodeGenerator &) = delete;
+
+        // Parses only the headers of shard `index` of `count`. Must be called before run().
+        void setShard(unsigned index, unsigned count);
+
+        // Parses in child processes started with args, see ASTParser::setWorkerCommand().
+        void setWorkerCommand(std::vector<std::string> args);
+
+        // Keeps the parse results in memory for update() even without mIncremental.
+        void setKeepResults(bool keepResults) { mKeepResults = keepResults; }
+
+        // Writes the outputs of each version as soon as its parses are done, instead of only in
+        // writeOutputs(). Not for shards, which write partial databases.
+        void setStreamOutputs(bool streamOutputs) { mStreamOutputs = streamOutputs; }
+
+        // Scans the source directories and parses every header that contains SPHR_DECL_API for
+        // every target version, starting with the first header found. Loads and saves the result
+        // cache and the cost history in the output directory. Returns false on error.
+        bool run();
+
+        // Applies changes reported by a FileWatcher and parses what they affect. Everything
+        // loaded by run() is reused.
+        bool update(const std::vector<std::string> &changedPaths);
+
+        // Entries of every version from the last run() or update(). Entries are sorted.
+        const ExportMap &getExports() const { return mParser.getExports(); }
+
+        // Headers that contain SPHR_DECL_API, limited to the shard if one is set.
+        const std::vector<std::string> &getActiveSources() const { return mActiveSources; }
+
+        // Writes the .sig.db and .def files of every version whose entries changed since the
+        // last write, the bundle if requested and any of them changed, and the depfile if
+        // requested.
+        void writeOutputs();
+
+        // Writes the entries as the partial databases of the shard set by setShard(), and the
+        // depfile if requested.
+        bool writePartialOutputs();
+
+    private:
+        // Whether a header belongs to the shard set by setShard(). Every header does without one.
+        bool isInShard(const std::string &header) const;
+
+        // Drops the headers outside the shard from the active sources.
+        void applyShard();
+
+        // Parses the sources of produceSources and saves the state files.
+        void parse(const SourceProducer &produceSources);
+
+        // Writes the .sig.db and .def file of a version unless its entries are unchanged since
+        // the last write. Called from parse threads while streaming outputs.
+        void writeVersionOutputs(uint64_t version, const SigDatabase &sigDatabase);
+
+        // Writes a rule for the outputs of each version that lists every file they were
+        // generated from. Does nothing if no depfile is requested.
+        bool writeDepfile();
+
+        const CodeGenOptions                        mOptions;
+        clang::tooling::CompilationDatabase        &mCompilations;
+        std::string                                 mOutputDirectory;
+        std::unique_ptr<FileProcessor>              mFileProcessor;
+        llvm::IntrusiveRefCntPtr<CachingFileSystem> mFileCache;
+        ResultCache                                 mResultCache;
+        CostHistory                                 mCostHistory;
+        ASTParser                                   mParser;
+        std::mutex                                  mActiveSourceMutex;
+        std::vector<std::string>                    mActiveSources;
+        // Content hash of the database last written for each version.
+        std::mutex                                  mOutputMutex;
+        std::map<uint64_t, uint64_t>                mWrittenHashes;
+        // Whether a version was written since the last bundle.
+        bool                                        mBundleDirty = false;
+        std::string                                 mCachePath;
+        std::string                                 mCostPath;
+        std::string                                 mSnapshotPath;
+        unsigned                                    mShardIndex = 0;
+        unsigned                                    mShardCount = 0;
+        bool                                        mKeepResults = false;
+        bool                                        mStreamOutputs = false;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include "CommandLine.h"
+#include "../util/StringUtil.h"
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <algorithm>
 
 using namespace clang::tooling;
 using namespace llvm;
@@ -30,6 +34,20 @@ namespace sapphire::codegen {
         cl::cat(gSapphireToolCategory)
     );
 
+    static cl::opt<std::string> optHeaderExtensions(
+        "header-extensions",
+        cl::desc("Extensions of the scanned headers, seperated by ','"),
+        cl::init(".h,.hpp"),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<std::string> optExclude(
+        "exclude",
+        cl::desc("Glob patterns of files and directories not to scan, seperated by ','"),
+        cl::Optional,
+        cl::cat(gSapphireToolCategory)
+    );
+
     static cl::opt<bool> optGenHeader(
         "gen-headers",
         cl::desc("Generate Headers"),
@@ -37,6 +55,157 @@ namespace sapphire::codegen {
         cl::cat(gSapphireToolCategory)
     );
 
+    static cl::opt<bool> optSinglePass(
+        "single-pass",
+        cl::desc("Parse each header once for all versions unless it depends on MC_VERSION"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optIncremental(
+        "incremental",
+        cl::desc("Reuse parse results of unchanged headers from the cache in the output directory"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optPCHCache(
+        "pch-cache",
+        cl::desc("Reuse the PCH from the previous run if none of its inputs changed"),
+        cl::init(true),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optAutoPCHThreshold(
+        "auto-pch-threshold",
+        cl::desc("Without a /FI, synthesize a PCH of the includes shared by N percent of the headers (0 to disable)"),
+        cl::init(50),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optPCHClusters(
+        "pch-clusters",
+        cl::desc("Synthesize separate PCHs for up to N of the largest header directories"),
+        cl::init(0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optUnityBatch(
+        "unity-batch",
+        cl::desc("Parse up to N headers with identical compile flags in one translation unit (0 to disable)"),
+        cl::init(0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optSkipPCHValidation(
+        "skip-pch-validation",
+        cl::desc("Do not check the inputs of the PCH again in every translation unit"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optLeanParse(
+        "lean-parse",
+        cl::desc("Skip function bodies and declarations without SPHR_DECL_API while parsing"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optJobs(
+        "j",
+        cl::desc("Number of parse threads (0 for one per hardware thread)"),
+        cl::init(0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optMaxMemory(
+        "max-memory",
+        cl::desc("Memory budget in MB for concurrent parses, predicted from previous runs (0 for no limit)"),
+        cl::init(0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optWorkers(
+        "workers",
+        cl::desc("Parse in N child processes instead of threads, so that a crashing TU fails only its own job"),
+        cl::init(0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<std::string> optShard(
+        "shard",
+        cl::desc("Process only shard i of N of the headers and write partial databases (e.g. 0/4)"),
+        cl::Optional,
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optMerge(
+        "merge",
+        cl::desc("Merge the partial databases in the given directories instead of parsing"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optWatch(
+        "watch",
+        cl::desc("Stay resident, watch the source directories and regenerate the outputs on every change"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<std::string> optDepfile(
+        "depfile",
+        cl::desc("Write a Makefile-style depfile listing the inputs of each output"),
+        cl::Optional,
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<SigDatabase::FormatVersion> optSigFormat(
+        "sig-format",
+        cl::desc("Format of the written .sig.db files"),
+        cl::values(
+            clEnumValN(SigDatabase::FormatVersion::v1_1_0, "1.1", "Sequential entries (default)"),
+            clEnumValN(SigDatabase::FormatVersion::v2_0_0, "2", "Indexed, read in place from a mapped file")
+        ),
+        cl::init(SigDatabase::FormatVersion::v1_1_0),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optSigBundle(
+        "sig-bundle",
+        cl::desc("Also write the databases of every version into one compressed bundle"),
+        cl::init(false),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<SigBundle::Compression> optSigBundleCompression(
+        "sig-bundle-compression",
+        cl::desc("Compression of the sections of the bundle"),
+        cl::values(
+            clEnumValN(SigBundle::Compression::None, "none", "Uncompressed"),
+            clEnumValN(SigBundle::Compression::Zlib, "zlib", "zlib"),
+            clEnumValN(SigBundle::Compression::Zstd, "zstd", "zstd (default)")
+        ),
+        cl::init(SigBundle::Compression::Zstd),
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<bool> optParseWorker(
+        "parse-worker",
+        cl::desc("Serve parse requests of a parent process on stdin"),
+        cl::init(false),
+        cl::Hidden,
+        cl::cat(gSapphireToolCategory)
+    );
+
+    static cl::opt<unsigned> optBenchFilter(
+        "bench-filter",
+        cl::desc("Benchmark the token filter on the source headers for N rounds and exit"),
+        cl::init(0),
+        cl::Hidden,
+        cl::cat(gSapphireToolCategory)
+    );
+
     CommandLine::CommandLine(int argc, const char **argv, cl::OptionCategory &category) {
         auto expectedParser = CommonOptionsParser::create(argc, argv, category);
         if (!expectedParser) {
@@ -44,6 +213,20 @@ namespace sapphire::codegen {
         } else {
             mOptionsParser.emplace(std::move(expectedParser.get()));
         }
+
+        // CommonOptionsParser keeps its -p option to itself, so the build path is read from the
+        // arguments in the forms cl accepts for a string option.
+        for (int i = 1; i < argc; ++i) {
+            StringRef arg(argv[i]);
+            if (arg == "--")
+                break;
+            if (!arg.consume_front("--") && !arg.consume_front("-"))
+                continue;
+            if (arg == "p" && i + 1 < argc)
+                mBuildPath = argv[++i];
+            else if (arg.consume_front("p="))
+                mBuildPath = arg.str();
+        }
     }
 
     const std::string &CommandLine::getOutputDirectory() const {
@@ -58,10 +241,169 @@ namespace sapphire::codegen {
         return optClangResourceDir.getValue();
     }
 
+    std::vector<std::string> CommandLine::getHeaderExtensions() const {
+        SmallVector<StringRef> extensions;
+        StringRef(optHeaderExtensions.getValue()).split(extensions, ',', -1, /*KeepEmpty*/ false);
+        std::vector<std::string> result;
+        for (auto extension : extensions) {
+            extension = extension.trim();
+            if (!extension.empty())
+                result.emplace_back(extension.starts_with(".") ? extension.str() : "." + extension.str());
+        }
+        return result;
+    }
+
+    std::vector<std::string> CommandLine::getExcludePatterns() const {
+        SmallVector<StringRef> patterns;
+        StringRef(optExclude.getValue()).split(patterns, ',', -1, /*KeepEmpty*/ false);
+        std::vector<std::string> result;
+        for (auto pattern : patterns) {
+            if (!pattern.trim().empty())
+                result.emplace_back(pattern.trim());
+        }
+        return result;
+    }
+
     bool CommandLine::genHeader() const {
         return optGenHeader.getValue();
     }
 
+    bool CommandLine::singlePass() const {
+        return optSinglePass.getValue();
+    }
+
+    bool CommandLine::incremental() const {
+        return optIncremental.getValue();
+    }
+
+    bool CommandLine::pchCache() const {
+        return optPCHCache.getValue();
+    }
+
+    unsigned CommandLine::autoPchThreshold() const {
+        return optAutoPCHThreshold.getValue();
+    }
+
+    unsigned CommandLine::pchClusterCount() const {
+        return optPCHClusters.getValue();
+    }
+
+    unsigned CommandLine::unityBatchSize() const {
+        return optUnityBatch.getValue();
+    }
+
+    bool CommandLine::skipPchValidation() const {
+        return optSkipPCHValidation.getValue();
+    }
+
+    bool CommandLine::leanParse() const {
+        return optLeanParse.getValue();
+    }
+
+    unsigned CommandLine::jobCount() const {
+        return optJobs.getValue();
+    }
+
+    unsigned CommandLine::maxMemoryMB() const {
+        return optMaxMemory.getValue();
+    }
+
+    unsigned CommandLine::workerCount() const {
+        return optWorkers.getValue();
+    }
+
+    const std::string &CommandLine::getShard() const {
+        return optShard.getValue();
+    }
+
+    bool CommandLine::merge() const {
+        return optMerge.getValue();
+    }
+
+    bool CommandLine::watch() const {
+        return optWatch.getValue();
+    }
+
+    const std::string &CommandLine::getDepfile() const {
+        return optDepfile.getValue();
+    }
+
+    SigDatabase::FormatVersion CommandLine::sigFormat() const {
+        return optSigFormat.getValue();
+    }
+
+    bool CommandLine::sigBundle() const {
+        return optSigBundle.getValue();
+    }
+
+    SigBundle::Compression CommandLine::sigBundleCompression() const {
+        return optSigBundleCompression.getValue();
+    }
+
+    bool CommandLine::parseWorker() const {
+        return optParseWorker.getValue();
+    }
+
+    unsigned CommandLine::benchFilterRounds() const {
+        return optBenchFilter.getValue();
+    }
+
+    CodeGenOptions CommandLine::getOptions() const {
+        CodeGenOptions        options;
+        std::set<std::string> targetMCVersions;
+        util::parseMCVersions(targetMCVersions, getTargetMCVersions());
+        options.mSourcePaths = getSourcePaths();
+        options.mHeaderExtensions = getHeaderExtensions();
+        options.mExcludePatterns = getExcludePatterns();
+        options.mOutputDirectory = getOutputDirectory();
+        options.mTargetMCVersions.assign(targetMCVersions.begin(), targetMCVersions.end());
+        options.mClangResourceDir = getClangResourceDir();
+        options.mSinglePass = singlePass();
+        options.mIncremental = incremental();
+        options.mPchCache = pchCache();
+        options.mAutoPchThreshold = std::min(autoPchThreshold(), 100u);
+        options.mPchClusterCount = pchClusterCount();
+        options.mUnityBatchSize = unityBatchSize();
+        options.mSkipPchValidation = skipPchValidation();
+        options.mLeanParse = leanParse();
+        options.mJobCount = jobCount();
+        options.mMaxMemoryMB = maxMemoryMB();
+        options.mWorkerCount = workerCount();
+        options.mDepfile = getDepfile();
+        options.mCompilationDatabaseFiles = getCompilationDatabaseFiles();
+        options.mSigFormat = sigFormat();
+        options.mSigBundle = sigBundle();
+        options.mSigBundleCompression = sigBundleCompression();
+        return options;
+    }
+
+    std::vector<std::string> CommandLine::getCompilationDatabaseFiles() const {
+        // Mirrors where CommonOptionsParser looks for the database: the -p directory, or else the
+        // nearest parent of the first source that has one.
+        std::vector<std::string> directories;
+        if (!mBuildPath.empty()) {
+            directories.emplace_back(mBuildPath);
+        } else if (!getSourcePaths().empty()) {
+            SmallString<256> sourcePath(getSourcePaths().front());
+            sys::fs::make_absolute(sourcePath);
+            for (StringRef directory = sourcePath; !directory.empty(); directory = sys::path::parent_path(directory))
+                directories.emplace_back(directory.str());
+        }
+
+        std::vector<std::string> files;
+        for (auto &&directory : directories) {
+            for (const char *name : {"compile_commands.json", "compile_flags.txt"}) {
+                SmallString<256> path(directory);
+                sys::path::append(path, name);
+                if (sys::fs::exists(path))
+                    files.emplace_back(path.str());
+            }
+            if (!files.empty())
+                break;
+        }
+        return files;
+    }
+
     const std::vector<std::string> &CommandLine::getSourcePaths() const {
         return mOptionsParser->getSourcePathList();
     }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "CodeGenOptions.h"
+
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/CompilationDatabase.h>
 #include <string>
@@ -12,17 +14,47 @@ namespace sapphire::codegen {
     public:
         CommandLine(int argc, const char **argv, llvm::cl::OptionCategory &category);
 
-        bool               isValid() const { return mOptionsParser.has_value(); }
-        const std::string &getOutputDirectory() const;
-        const std::string &getTargetMCVersions() const;
-        const std::string &getClangResourceDir() const;
-        bool               genHeader() const;
+        bool                       isValid() const { return mOptionsParser.has_value(); }
+        const std::string         &getOutputDirectory() const;
+        const std::string         &getTargetMCVersions() const;
+        const std::string         &getClangResourceDir() const;
+        std::vector<std::string>   getHeaderExtensions() const;
+        std::vector<std::string>   getExcludePatterns() const;
+        bool                       genHeader() const;
+        bool                       singlePass() const;
+        bool                       incremental() const;
+        bool                       pchCache() const;
+        unsigned                   autoPchThreshold() const;
+        unsigned                   pchClusterCount() const;
+        unsigned                   unityBatchSize() const;
+        bool                       skipPchValidation() const;
+        bool                       leanParse() const;
+        unsigned                   jobCount() const;
+        unsigned                   maxMemoryMB() const;
+        unsigned                   workerCount() const;
+        const std::string         &getShard() const;
+        bool                       merge() const;
+        bool                       watch() const;
+        const std::string         &getDepfile() const;
+        SigDatabase::FormatVersion sigFormat() const;
+        bool                       sigBundle() const;
+        SigBundle::Compression     sigBundleCompression() const;
+        bool                       parseWorker() const;
+        unsigned                   benchFilterRounds() const;
+
+        // Collects the options of a code generation run.
+        CodeGenOptions getOptions() const;
 
         const std::vector<std::string>      &getSourcePaths() const;
         clang::tooling::CompilationDatabase &getCompilations();
 
     private:
+        // The compilation database files that the compile commands were read from.
+        std::vector<std::string> getCompilationDatabaseFiles() const;
+
         std::optional<clang::tooling::CommonOptionsParser> mOptionsParser;
+        // The -p directory of CommonOptionsParser, empty if not given.
+        std::string                                        mBuildPath;
     };
 
 } // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "CompileCommandIndex.h"
+#include "../util/HashUtil.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+using namespace clang::tooling;
+
+namespace sapphire::codegen {
+
+    std::string CompileCommandIndex::getKey(llvm::StringRef file) const {
+        llvm::SmallString<256> key(file);
+        llvm::sys::fs::make_absolute(key);
+        llvm::sys::path::remove_dots(key, /*remove_dot_dot*/ true);
+        llvm::sys::path::native(key);
+        return std::string(key);
+    }
+
+    const CompileCommandIndex::Entry &CompileCommandIndex::resolve(llvm::StringRef file) const {
+        auto key = getKey(file);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto                        found = mEntries.find(key);
+            if (found != mEntries.end())
+                return found->second;
+        }
+
+        // Resolved without the lock, since interpolation is the slow part. Concurrent first
+        // queries of a file may both resolve it, the first one to finish is kept.
+        Entry              entry;
+        util::StableHasher hasher;
+        entry.mCommands = mBase.getCompileCommands(file);
+        for (auto &&command : entry.mCommands) {
+            hasher.add(command.Directory);
+            for (auto &&arg : command.CommandLine) {
+                if (arg != command.Filename)
+                    hasher.add(arg);
+            }
+        }
+        entry.mFlagsKey = hasher.finish();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mEntries.try_emplace(std::move(key), std::move(entry)).first->second;
+    }
+
+    const CompileCommand *CompileCommandIndex::getForceIncludeCommand() const {
+        std::call_once(mForceIncludeOnce, [&] {
+            // Commands of the files in the database are read as they are, no interpolation.
+            for (auto &&command : mBase.getAllCompileCommands()) {
+                for (auto &&arg : command.CommandLine) {
+                    if (arg.rfind("/FI", 0) == 0) {
+                        mForceIncludeCommand = command;
+                        return;
+                    }
+                }
+            }
+        });
+        return mForceIncludeCommand ? &*mForceIncludeCommand : nullptr;
+    }
+
+    std::vector<CompileCommand> CompileCommandIndex::getCompileCommands(llvm::StringRef file) const {
+        return resolve(file).mCommands;
+    }
+
+    std::vector<std::string> CompileCommandIndex::getAllFiles() const {
+        return mBase.getAllFiles();
+    }
+
+    std::vector<CompileCommand> CompileCommandIndex::getAllCompileCommands() const {
+        return mBase.getAllCompileCommands();
+    }
+
+    size_t CompileCommandIndex::size() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mEntries.size();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <clang/Tooling/CompilationDatabase.h>
+#include <llvm/ADT/StringRef.h>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Resolves the compile commands of each file once and answers every later query from an
+    // index. Headers are not in the database, so each query for one interpolates a command from
+    // the whole database; without the index every PCH build, flags key, config hash and ClangTool
+    // of a header would repeat that. Thread-safe.
+    class CompileCommandIndex : public clang::tooling::CompilationDatabase {
+    public:
+        // The resolved commands of a file.
+        struct Entry {
+            std::vector<clang::tooling::CompileCommand> mCommands;
+            // Hash of the commands without the file name. Files with equal keys have identical
+            // flag sets and can share a TU.
+            uint64_t                                    mFlagsKey = 0;
+        };
+
+        explicit CompileCommandIndex(const clang::tooling::CompilationDatabase &base) : mBase(base) {}
+
+        // Returns the indexed entry of a file, resolving it on first use. The entry stays valid
+        // for the lifetime of the index.
+        const Entry &resolve(llvm::StringRef file) const;
+
+        // The first command of the database that force-includes a header with /FI, which PCHs
+        // are built from. Searched once. Returns null if there is none.
+        const clang::tooling::CompileCommand *getForceIncludeCommand() const;
+
+        std::vector<clang::tooling::CompileCommand> getCompileCommands(llvm::StringRef file) const override;
+        std::vector<std::string>                    getAllFiles() const override;
+        std::vector<clang::tooling::CompileCommand> getAllCompileCommands() const override;
+
+        size_t size() const;
+
+    private:
+        std::string getKey(llvm::StringRef file) const;
+
+        const clang::tooling::CompilationDatabase             &mBase;
+        mutable std::mutex                                    mMutex;
+        // Values of an unordered_map keep their address when it grows.
+        mutable std::unordered_map<std::string, Entry>        mEntries;
+        mutable std::once_flag                                mForceIncludeOnce;
+        mutable std::optional<clang::tooling::CompileCommand> mForceIncludeCommand;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
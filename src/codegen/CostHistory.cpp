@@ -0,0 +1,112 @@
+#include "CostHistory.h"
+#include "../util/FsHelper.h"
+
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <exception>
+
+namespace sapphire::codegen {
+
+    bool CostHistory::load(const std::string &path) {
+        mRecords.clear();
+        mTotalSize = 0;
+        mTotalMicros = 0;
+        mTotalMemory = 0;
+
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+        );
+        if (!buffer)
+            return false;
+        fshelper::SpanReader reader({(*buffer)->getBufferStart(), (*buffer)->getBufferSize()});
+        try {
+            if (fshelper::read<uint32_t>(reader) != MAGIC_NUMBER || fshelper::read<uint32_t>(reader) != FORMAT_VERSION)
+                return false;
+            auto recordCount = fshelper::read<uint64_t>(reader);
+            // Header length, size, time and memory.
+            reader.expect(recordCount, 4 * sizeof(uint64_t));
+            for (uint64_t i = 0; i < recordCount; ++i) {
+                auto   header = fshelper::read<std::string>(reader);
+                Record record;
+                record.mSize = fshelper::read<uint64_t>(reader);
+                record.mMicros = fshelper::read<uint64_t>(reader);
+                record.mMemory = fshelper::read<uint64_t>(reader);
+                mTotalSize += record.mSize;
+                mTotalMicros += record.mMicros;
+                mTotalMemory += record.mMemory;
+                mRecords.emplace(std::move(header), record);
+            }
+            return true;
+        } catch (std::exception &e) {
+            llvm::errs() << llvm::formatv("[Cost] Warning: Failed to load {0}: {1}\n", path, e.what());
+        }
+        mRecords.clear();
+        mTotalSize = 0;
+        mTotalMicros = 0;
+        mTotalMemory = 0;
+        return false;
+    }
+
+    bool CostHistory::save(const std::string &path) const {
+        std::ofstream fs(path, std::ios::binary);
+        if (!fs.is_open()) {
+            llvm::errs() << llvm::formatv("[Cost] Warning: Cannot write to {0}\n", path);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        uint64_t                    recordCount = 0;
+        for (auto &&[header, record] : mRecords) {
+            if (record.mUsed)
+                ++recordCount;
+        }
+        fshelper::write(fs, MAGIC_NUMBER);
+        fshelper::write(fs, FORMAT_VERSION);
+        fshelper::write(fs, recordCount);
+        for (auto &&[header, record] : mRecords) {
+            if (!record.mUsed)
+                continue;
+            fshelper::write(fs, header);
+            fshelper::write(fs, record.mSize);
+            fshelper::write(fs, record.mMicros);
+            fshelper::write(fs, record.mMemory);
+        }
+        return fs.good();
+    }
+
+    void CostHistory::record(const std::string &header, uint64_t fileSize, uint64_t micros, uint64_t memoryBytes) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto                       &record = mRecords[header];
+        mTotalSize += fileSize - record.mSize;
+        mTotalMicros += micros - record.mMicros;
+        mTotalMemory += memoryBytes - record.mMemory;
+        record.mSize = fileSize;
+        record.mMicros = micros;
+        record.mMemory = memoryBytes;
+        record.mUsed = true;
+    }
+
+    uint64_t CostHistory::estimate(const std::string &header, uint64_t fileSize) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto                        found = mRecords.find(header);
+        if (found != mRecords.end()) {
+            found->second.mUsed = true;
+            return found->second.mMicros;
+        }
+        if (mTotalSize == 0)
+            return fileSize;
+        return static_cast<uint64_t>(static_cast<double>(fileSize) * mTotalMicros / mTotalSize);
+    }
+
+    uint64_t CostHistory::estimateMemory(const std::string &header) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto                        found = mRecords.find(header);
+        if (found != mRecords.end() && found->second.mMemory)
+            return found->second.mMemory;
+        if (mRecords.empty())
+            return 0;
+        return mTotalMemory / mRecords.size();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
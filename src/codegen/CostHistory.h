@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace sapphire::codegen {
+
+    // Persists how long each header took to parse and how much memory its TU used, so that later
+    // runs can start the most expensive headers first and admit only as many parses as fit in
+    // the memory budget.
+    class CostHistory {
+    public:
+        static constexpr uint32_t MAGIC_NUMBER = 0x54534F43; // "COST"
+        static constexpr uint32_t FORMAT_VERSION = 2;
+
+        // Loads a history file. A missing, corrupted or outdated file yields an empty history.
+        bool load(const std::string &path);
+
+        // Saves the records that were estimated or recorded since load().
+        bool save(const std::string &path) const;
+
+        // Records the parse time and memory of a header of the given size.
+        void record(const std::string &header, uint64_t fileSize, uint64_t micros, uint64_t memoryBytes);
+
+        // Estimates the parse time of a header in microseconds. Headers without history are
+        // estimated from their size and the average parse time per byte of known headers.
+        uint64_t estimate(const std::string &header, uint64_t fileSize);
+
+        // Estimates the memory a parse of the header needs. Headers without history are estimated
+        // as the average of known headers. Returns 0 if there is no history at all.
+        uint64_t estimateMemory(const std::string &header);
+
+    private:
+        struct Record {
+            uint64_t mSize = 0;
+            uint64_t mMicros = 0;
+            uint64_t mMemory = 0;
+            bool     mUsed = false;
+        };
+
+        mutable std::mutex            mMutex;
+        std::map<std::string, Record> mRecords;
+        uint64_t                      mTotalSize = 0;
+        uint64_t                      mTotalMicros = 0;
+        uint64_t                      mTotalMemory = 0;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
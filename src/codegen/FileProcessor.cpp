@@ -1,8 +1,24 @@
 #include "FileProcessor.h"
+#include "AnnotationScanner.h"
+#include "CachingFileSystem.h"
+#include "CodeGenOptions.h"
+#include "FileStamp.h"
+#include "TokenScanner.h"
+#include "../util/HashUtil.h"
+#include "../util/StringUtil.h"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
-#include <fstream>
+#include <limits>
+#include <set>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/raw_ostream.h>
 
 namespace sapphire::codegen {
 
@@ -12,39 +28,158 @@ namespace sapphire::codegen {
         return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
     }
 
-    FileProcessor::FileProcessor(const std::vector<std::string> &sourcePaths) {
-        for (const auto &path : sourcePaths) {
-            scanHeaderFiles(path);
+    // Headers of a directory checked in one task.
+    static constexpr size_t HEADERS_PER_TASK = 64;
+
+    static int64_t getMTime(const llvm::sys::fs::file_status &status) {
+        return status.getLastModificationTime().time_since_epoch().count();
+    }
+
+    FileProcessor::FileProcessor(const CodeGenOptions &options) :
+        mSourcePaths(options.mSourcePaths),
+        mHeaderExtensions(options.mHeaderExtensions),
+        mExcludePatternStrings(options.mExcludePatterns) {
+        for (auto &&pattern : mExcludePatternStrings) {
+            auto glob = llvm::GlobPattern::create(pattern);
+            if (!glob) {
+                llvm::errs() << llvm::formatv(
+                    "[Scan] Warning: Ignoring invalid exclude pattern '{0}': {1}\n",
+                    pattern,
+                    llvm::toString(glob.takeError())
+                );
+                continue;
+            }
+            mExcludePatterns.emplace_back(std::move(*glob));
         }
+        // Invalid versions are reported by the parser.
+        for (auto &&version : options.mTargetMCVersions) {
+            if (auto versionNum = util::parseMCVersion(version))
+                mTargetVersions.push_back(versionNum);
+        }
+        std::sort(mTargetVersions.begin(), mTargetVersions.end());
+        mTargetVersions.erase(std::unique(mTargetVersions.begin(), mTargetVersions.end()), mTargetVersions.end());
     }
 
     const std::vector<std::string> &FileProcessor::getAllHeaderFiles() const {
         return mAllHeaderFiles;
     }
 
-    void FileProcessor::scanHeaderFiles(const std::string &rootDir) {
-        if (!fs::exists(rootDir)) return;
+    bool FileProcessor::isHeader(const fs::path &path) const {
+        auto ext = path.extension().string();
+        return std::find(mHeaderExtensions.begin(), mHeaderExtensions.end(), ext) != mHeaderExtensions.end();
+    }
+
+    bool FileProcessor::isExcluded(const std::string &path) const {
+        if (mExcludePatterns.empty()) return false;
+
+        // Patterns are written with forward slashes and match the whole path or the name.
+        std::string genericPath = path;
+        if (fs::path::preferred_separator != '/')
+            std::replace(genericPath.begin(), genericPath.end(), '\\', '/');
+        auto name = llvm::sys::path::filename(genericPath, llvm::sys::path::Style::posix);
+        for (auto &&pattern : mExcludePatterns) {
+            if (pattern.match(genericPath) || pattern.match(name))
+                return true;
+        }
+        return false;
+    }
+
+    uint64_t FileProcessor::getSnapshotKey(const std::string &token) const {
+        util::StableHasher hasher;
+        hasher.add(token);
+        hasher.add(static_cast<uint64_t>(mHeaderExtensions.size()));
+        for (auto &&extension : mHeaderExtensions)
+            hasher.add(extension);
+        hasher.add(static_cast<uint64_t>(mExcludePatternStrings.size()));
+        for (auto &&pattern : mExcludePatternStrings)
+            hasher.add(pattern);
+        hasher.add(static_cast<uint64_t>(mTargetVersions.size()));
+        for (auto version : mTargetVersions)
+            hasher.add(version);
+        return hasher.finish();
+    }
+
+    bool FileProcessor::loadSnapshot(const std::string &path, const std::string &token) {
+        return mSnapshot.load(path, getSnapshotKey(token));
+    }
+
+    bool FileProcessor::saveSnapshot(const std::string &path, const std::string &token) const {
+        return mSnapshot.save(path, getSnapshotKey(token));
+    }
+
+    void FileProcessor::walk(
+        llvm::ThreadPoolInterface &pool, const std::function<void(const std::vector<std::string> &)> &onHeaders
+    ) {
+        mAllHeaderFiles.clear();
+        mScannedDirectories.clear();
+        mNextSnapshot = ScanSnapshot();
+        mReusedDirectoryCount = 0;
+        auto trustedBefore = std::chrono::system_clock::now() - MTIME_GRANULARITY;
+        mTrustedBefore = std::chrono::duration_cast<std::chrono::nanoseconds>(trustedBefore.time_since_epoch()).count();
+
+        llvm::ThreadPoolTaskGroup tasks(pool);
+
+        // Lists a directory, or takes its listing from the snapshot while its mtime is unchanged,
+        // and walks each subdirectory in a task of its own.
+        std::function<void(const std::string &)> visit = [&](const std::string &directory) {
+            llvm::sys::fs::file_status status;
+            auto mtime = llvm::sys::fs::status(directory, status) ? ScanSnapshot::UNTRUSTED_MTIME : getMTime(status);
 
-        for (const auto &entry : fs::recursive_directory_iterator(rootDir)) {
-            if (entry.is_regular_file()) {
-                auto ext = entry.path().extension().string();
-                if (ext == ".h" || ext == ".hpp") {
-                    mAllHeaderFiles.emplace_back(fs::absolute(entry.path()).string());
+            ScanSnapshot::Directory listing;
+            auto                    found = mSnapshot.mDirectories.find(directory);
+            // An untrusted mtime, stored or failed to stat, never matches.
+            if (mtime != ScanSnapshot::UNTRUSTED_MTIME && found != mSnapshot.mDirectories.end()
+                && found->second.mMTime == mtime) {
+                listing = found->second;
+                ++mReusedDirectoryCount;
+            } else {
+                std::error_code ec;
+                for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+                    auto path = it->path().string();
+                    if (isExcluded(path))
+                        continue;
+                    // Linked directories are not followed, as they may form cycles.
+                    std::error_code typeEc;
+                    if (it->is_directory(typeEc) && !it->is_symlink(typeEc))
+                        listing.mSubdirectories.emplace_back(std::move(path));
+                    else if (it->is_regular_file(typeEc) && isHeader(it->path()))
+                        listing.mHeaders.emplace_back(std::move(path));
                 }
+                listing.mMTime = isTrusted(mtime) ? mtime : ScanSnapshot::UNTRUSTED_MTIME;
+            }
+
+            for (auto &&subdirectory : listing.mSubdirectories)
+                tasks.async([&visit, subdirectory] { visit(subdirectory); });
+            for (size_t i = 0; onHeaders && i < listing.mHeaders.size(); i += HEADERS_PER_TASK) {
+                auto                     last = std::min(listing.mHeaders.size(), i + HEADERS_PER_TASK);
+                std::vector<std::string> headers(listing.mHeaders.begin() + i, listing.mHeaders.begin() + last);
+                tasks.async([&onHeaders, headers = std::move(headers)] { onHeaders(headers); });
             }
+
+            std::lock_guard<std::mutex> lock(mWalkMutex);
+            mScannedDirectories.insert(directory);
+            mAllHeaderFiles.insert(mAllHeaderFiles.end(), listing.mHeaders.begin(), listing.mHeaders.end());
+            mNextSnapshot.mDirectories.emplace(directory, std::move(listing));
+        };
+
+        for (const auto &path : mSourcePaths) {
+            std::error_code ec;
+            if (!fs::is_directory(path, ec)) continue;
+            tasks.async([&visit, root = fs::absolute(path).string()] { visit(root); });
         }
-    }
+        tasks.wait();
 
-    bool FileProcessor::fastCheckToken(const std::string &filePath, const std::string &token) {
-        std::ifstream ifs(filePath, std::ios::binary | std::ios::ate);
-        if (!ifs.is_open()) return false;
+        std::sort(mAllHeaderFiles.begin(), mAllHeaderFiles.end());
+        mSnapshot = std::move(mNextSnapshot);
+    }
 
-        auto size = ifs.tellg();
-        if (size == 0) return false;
+    void FileProcessor::scan() {
+        llvm::DefaultThreadPool pool(llvm::hardware_concurrency());
+        walk(pool, nullptr);
+    }
 
-        std::string content(size, '\0');
-        ifs.seekg(0);
-        ifs.read(&content[0], size);
+    bool FileProcessor::fastCheckToken(llvm::StringRef content, const std::string &token, std::vector<uint32_t> *offsets) {
+        if (content.empty()) return false;
 
         enum State { CODE,
                      LINE_COMMENT,
@@ -84,12 +219,15 @@ namespace sapphire::codegen {
 
                 if (c == token[0]) {
                     if (i + tLen <= n) {
-                        if (content.compare(i, tLen, token) == 0) {
+                        if (content.substr(i, tLen) == token) {
                             bool prevOk = (i == 0) || !isIdentChar(content[i - 1]);
                             bool nextOk = (i + tLen == n) || !isIdentChar(content[i + tLen]);
 
                             if (prevOk && nextOk) {
-                                return true;
+                                if (!offsets)
+                                    return true;
+                                offsets->push_back(static_cast<uint32_t>(i));
+                                i += tLen - 1;
                             }
                         }
                     }
@@ -125,25 +263,220 @@ namespace sapphire::codegen {
             }
         }
 
-        return false;
+        return offsets && !offsets->empty();
     }
 
-    std::vector<std::string> FileProcessor::filterFilesByToken(const std::string &token) {
-        llvm::DefaultThreadPool Pool(llvm::hardware_concurrency());
+    void FileProcessor::scanAndFilter(
+        const std::string         &token,
+        llvm::ThreadPoolInterface &pool,
+        CachingFileSystem         *fileCache,
+        const MatchCallback       &onMatch
+    ) {
+        mTokenOffsets.clear();
+        mActiveVersions.clear();
+        mReusedHeaderCount = 0;
 
-        std::vector<std::string> filteredFiles;
-        std::mutex               resultMutex;
+        // Headers are checked while the walk goes on. A header whose size and mtime are unchanged
+        // since the snapshot keeps its offsets and active versions without being read.
+        walk(pool, [&](const std::vector<std::string> &headers) {
+            for (auto &&header : headers) {
+                llvm::sys::fs::file_status status;
+                if (llvm::sys::fs::status(header, status))
+                    continue;
+                ScanSnapshot::Header result;
+                result.mSize = status.getSize();
+                result.mMTime = getMTime(status);
 
-        for (const auto &file : mAllHeaderFiles) {
-            Pool.async([&]() {
-                if (fastCheckToken(file, token)) {
-                    std::lock_guard<std::mutex> lock(resultMutex);
-                    filteredFiles.push_back(file);
+                auto found = mSnapshot.mHeaders.find(header);
+                if (found != mSnapshot.mHeaders.end() && found->second.mMTime == result.mMTime
+                    && found->second.mSize == result.mSize) {
+                    result.mTokenOffsets = found->second.mTokenOffsets;
+                    result.mActiveVersions = found->second.mActiveVersions;
+                    ++mReusedHeaderCount;
+                } else {
+                    checkFile(header, token, fileCache, result);
+                    if (!isTrusted(result.mMTime))
+                        result.mMTime = ScanSnapshot::UNTRUSTED_MTIME;
                 }
-            });
+
+                if (isRetained(result)) {
+                    onMatch(header, result.mTokenOffsets, result.mActiveVersions);
+                    std::lock_guard<std::mutex> lock(mTokenOffsetMutex);
+                    mTokenOffsets.emplace(header, result.mTokenOffsets);
+                    mActiveVersions.emplace(header, result.mActiveVersions);
+                }
+                std::lock_guard<std::mutex> lock(mWalkMutex);
+                mNextSnapshot.mHeaders.emplace(header, std::move(result));
+            }
+        });
+    }
+
+    bool FileProcessor::isRetained(const ScanSnapshot::Header &result) const {
+        return !result.mTokenOffsets.empty() && (mTargetVersions.empty() || !result.mActiveVersions.empty());
+    }
+
+    bool FileProcessor::checkFile(
+        const std::string &file, const std::string &token, CachingFileSystem *fileCache, ScanSnapshot::Header &result
+    ) const {
+        // Large files are mapped, so that the many files without the token are never copied.
+        auto buffer = llvm::MemoryBuffer::getFile(
+            file, /*IsText*/ false, /*RequiresNullTerminator*/ true, /*IsVolatile*/ false
+        );
+        if (!buffer) return false;
+        if (!TokenScanner::scan((*buffer)->getBuffer(), token, &result.mTokenOffsets))
+            return false;
+        result.mActiveVersions = AnnotationScanner::getActiveVersions(
+            (*buffer)->getBuffer(), result.mTokenOffsets, token, mTargetVersions
+        );
+        if (!isRetained(result))
+            return false;
+        if (!fileCache)
+            return true;
+        // A retained file is copied out of its mapping, which would otherwise keep the file
+        // locked on Windows for as long as it is cached.
+        if ((*buffer)->getBufferKind() == llvm::MemoryBuffer::MemoryBuffer_MMap)
+            fileCache->seed(file, llvm::MemoryBuffer::getMemBufferCopy((*buffer)->getBuffer(), file));
+        else
+            fileCache->seed(file, std::move(*buffer));
+        return true;
+    }
+
+    bool FileProcessor::benchmarkFilter(
+        const std::vector<std::string> &files, const std::string &token, unsigned rounds
+    ) {
+        struct Timing {
+            double mReadSeconds = std::numeric_limits<double>::max();
+            double mScanSeconds = std::numeric_limits<double>::max();
+        };
+        using Clock = std::chrono::steady_clock;
+
+        // Reads every file as the filter did before, or maps it, and scans it. Read and scan
+        // times are summed separately, and the best round of each is kept.
+        auto measure = [&](bool isVolatile, auto &&scan, Timing &timing, std::vector<std::vector<uint32_t>> &results) {
+            for (unsigned round = 0; round < rounds; ++round) {
+                Clock::duration readTime{}, scanTime{};
+                results.assign(files.size(), {});
+                for (size_t i = 0; i < files.size(); ++i) {
+                    auto beginRead = Clock::now();
+                    auto buffer = llvm::MemoryBuffer::getFile(
+                        files[i], /*IsText*/ false, /*RequiresNullTerminator*/ true, isVolatile
+                    );
+                    auto beginScan = Clock::now();
+                    if (buffer)
+                        scan((*buffer)->getBuffer(), token, &results[i]);
+                    auto endScan = Clock::now();
+                    readTime += beginScan - beginRead;
+                    scanTime += endScan - beginScan;
+                }
+                timing.mReadSeconds = std::min(timing.mReadSeconds, std::chrono::duration<double>(readTime).count());
+                timing.mScanSeconds = std::min(timing.mScanSeconds, std::chrono::duration<double>(scanTime).count());
+            }
+        };
+
+        uint64_t totalSize = 0;
+        for (auto &&file : files) {
+            std::error_code ec;
+            auto            size = fs::file_size(file, ec);
+            totalSize += ec ? 0 : size;
         }
 
-        Pool.wait();
+        Timing                             reference, vectorized;
+        std::vector<std::vector<uint32_t>> referenceResults, vectorizedResults;
+        measure(/*IsVolatile*/ true, fastCheckToken, reference, referenceResults);
+        measure(/*IsVolatile*/ false, TokenScanner::scan, vectorized, vectorizedResults);
+
+        double megabytes = totalSize / (1024.0 * 1024.0);
+        auto   report = [&](llvm::StringRef name, const Timing &timing) {
+            llvm::outs() << llvm::formatv(
+                "[Bench] {0,-16} read {1,8:F1} ms, scan {2,8:F1} ms ({3,8:F0} MB/s)\n",
+                name,
+                timing.mReadSeconds * 1000.0,
+                timing.mScanSeconds * 1000.0,
+                megabytes / std::max(timing.mScanSeconds, 1e-9)
+            );
+        };
+        llvm::outs() << llvm::formatv(
+            "[Bench] {0} files, {1:F1} MB, best of {2} rounds.\n", files.size(), megabytes, rounds
+        );
+        report("Byte-wise", reference);
+        report(("Mapped " + TokenScanner::getInstructionSet()).str(), vectorized);
+
+        size_t mismatchCount = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (referenceResults[i] != vectorizedResults[i]) {
+                if (++mismatchCount <= 10)
+                    llvm::errs() << llvm::formatv("[Bench] Error: Results differ for {0}\n", files[i]);
+            }
+        }
+        if (mismatchCount) {
+            llvm::errs() << llvm::formatv("[Bench] Error: Results differ for {0} files.\n", mismatchCount);
+        }
+        return mismatchCount == 0;
+    }
+
+    std::vector<std::string> FileProcessor::updateFiles(
+        const std::vector<std::string> &changedPaths, const std::string &token, CachingFileSystem *fileCache
+    ) {
+        std::set<std::string>    headers(mAllHeaderFiles.begin(), mAllHeaderFiles.end());
+        std::vector<std::string> checkFiles;
+        for (auto &&path : changedPaths) {
+            if (isExcluded(path))
+                continue;
+            std::error_code ec;
+            auto            status = fs::status(path, ec);
+            if (fs::is_directory(status)) {
+                mScannedDirectories.insert(path);
+                for (fs::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+                    if (isExcluded(it->path().string())) {
+                        it.disable_recursion_pending();
+                        continue;
+                    }
+                    if (it->is_regular_file(ec) && isHeader(it->path())) {
+                        headers.insert(it->path().string());
+                        checkFiles.push_back(it->path().string());
+                    } else if (it->is_directory(ec)) {
+                        mScannedDirectories.insert(it->path().string());
+                    }
+                }
+            } else if (fs::is_regular_file(status)) {
+                if (isHeader(path)) {
+                    headers.insert(path);
+                    checkFiles.push_back(path);
+                }
+            } else {
+                auto isRemoved = [&](const std::string &header) {
+                    return header == path
+                        || (header.size() > path.size() && header.compare(0, path.size(), path) == 0
+                            && fs::path::preferred_separator == header[path.size()]);
+                };
+                for (auto it = headers.begin(); it != headers.end();)
+                    it = isRemoved(*it) ? headers.erase(it) : std::next(it);
+                for (auto it = mTokenOffsets.begin(); it != mTokenOffsets.end();)
+                    it = isRemoved(it->first) ? mTokenOffsets.erase(it) : std::next(it);
+                for (auto it = mActiveVersions.begin(); it != mActiveVersions.end();)
+                    it = isRemoved(it->first) ? mActiveVersions.erase(it) : std::next(it);
+                for (auto it = mScannedDirectories.begin(); it != mScannedDirectories.end();)
+                    it = isRemoved(*it) ? mScannedDirectories.erase(it) : std::next(it);
+            }
+        }
+        mAllHeaderFiles.assign(headers.begin(), headers.end());
+
+        for (auto &&file : checkFiles) {
+            ScanSnapshot::Header result;
+            if (checkFile(file, token, fileCache, result)) {
+                mTokenOffsets.insert_or_assign(file, std::move(result.mTokenOffsets));
+                mActiveVersions.insert_or_assign(file, std::move(result.mActiveVersions));
+            } else {
+                mTokenOffsets.erase(file);
+                mActiveVersions.erase(file);
+            }
+        }
+
+        std::vector<std::string> filteredFiles;
+        filteredFiles.reserve(mTokenOffsets.size());
+        for (auto &&[file, offsets] : mTokenOffsets)
+            filteredFiles.push_back(file);
+        std::sort(filteredFiles.begin(), filteredFiles.end());
         return filteredFiles;
     }
 
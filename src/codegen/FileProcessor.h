@@ -1,23 +1,148 @@
 #pragma once
 
+#include "ScanSnapshot.h"
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/GlobPattern.h>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+namespace llvm {
+    class ThreadPoolInterface;
+}
+
 namespace sapphire::codegen {
 
+    class CachingFileSystem;
+    struct CodeGenOptions;
+
+    // Sorted file offsets of a token, keyed by file path.
+    using TokenOffsetMap = std::unordered_map<std::string, std::vector<uint32_t>>;
+
+    // Target versions the annotations of a file are active for, keyed by file path.
+    using ActiveVersionMap = std::unordered_map<std::string, std::vector<uint64_t>>;
+
+    // Finds the headers in the source directories and the ones among them that contain a token.
+    // Headers are the files with one of mHeaderExtensions, and files and directories that match
+    // one of mExcludePatterns are skipped. Directories are walked in parallel. With target
+    // versions, a header is only retained if one of its annotations is active for one of them.
     class FileProcessor {
     public:
-        explicit FileProcessor(const std::vector<std::string>& sourcePaths);
+        using MatchCallback = std::function<
+            void(const std::string& file, const std::vector<uint32_t>& offsets, const std::vector<uint64_t>& versions)>;
+
+        // Nothing is scanned before scan() or scanAndFilter().
+        explicit FileProcessor(const CodeGenOptions& options);
+
+        // Scans the source directories for headers on a thread pool of its own.
+        void scan();
 
         const std::vector<std::string>& getAllHeaderFiles() const;
 
-        std::vector<std::string> filterFilesByToken(const std::string& token);
+        // Every directory the scan visited. A header created in one of them changes the result.
+        const std::set<std::string>& getScannedDirectories() const { return mScannedDirectories; }
+
+        // Scans the source directories and checks every header for the token outside comments and
+        // literals on pool as soon as it is found. onMatch is called from pool threads with each
+        // retained file, the offsets of the token in it and the target versions its annotations
+        // are active for, as told by AnnotationScanner. The contents of retained files are
+        // handed to fileCache, if given, so that parsing does not read them again. Returns once
+        // every header is checked. Directories and headers unchanged since the loaded snapshot
+        // are neither listed nor checked again.
+        void scanAndFilter(
+            const std::string&         token,
+            llvm::ThreadPoolInterface& pool,
+            CachingFileSystem*         fileCache,
+            const MatchCallback&       onMatch
+        );
+
+        // Loads the snapshot of a previous scanAndFilter() with the same token, filters and target
+        // versions.
+        bool loadSnapshot(const std::string& path, const std::string& token);
+
+        // Saves what the last scanAndFilter() found.
+        bool saveSnapshot(const std::string& path, const std::string& token) const;
+
+        // Directory listings and filter results the last scan took from the snapshot.
+        size_t reusedDirectoryCount() const { return mReusedDirectoryCount; }
+        size_t reusedHeaderCount() const { return mReusedHeaderCount; }
+
+        // Applies changes reported by a FileWatcher to the header list and checks only the changed
+        // headers for the token again. A changed directory is scanned for headers and a path
+        // that no longer exists removes every header at or below it. Returns the retained files.
+        std::vector<std::string> updateFiles(
+            const std::vector<std::string>& changedPaths,
+            const std::string&              token,
+            CachingFileSystem*              fileCache = nullptr
+        );
+
+        // Offsets of every occurrence of the token in the files retained by the last filter.
+        const TokenOffsetMap& getTokenOffsets() const { return mTokenOffsets; }
+
+        // Active target versions of the files retained by the last filter.
+        const ActiveVersionMap& getActiveVersions() const { return mActiveVersions; }
+
+        // Filters files with the byte-wise reader and state machine and with the mapped SIMD scan
+        // for the given number of rounds, and reports the best time of each. Returns false if
+        // their results differ for any file.
+        static bool benchmarkFilter(const std::vector<std::string>& files, const std::string& token, unsigned rounds);
 
     private:
-        void scanHeaderFiles(const std::string& rootDir);
-        static bool fastCheckToken(const std::string& filePath, const std::string& token);
+        bool isHeader(const std::filesystem::path& path) const;
+        bool isExcluded(const std::string& path) const;
+
+        // Identifies the token, the filters and the target versions a snapshot was taken with.
+        uint64_t getSnapshotKey(const std::string& token) const;
+
+        // Whether an mtime is old enough that a later change would have changed it.
+        bool isTrusted(int64_t mtime) const { return mtime < mTrustedBefore; }
+
+        // Walks every source directory on pool, one task per directory, and calls onHeaders, if
+        // given, from pool threads with groups of the headers found. Listings of directories
+        // unchanged since the snapshot are taken from it. Returns once every task is done.
+        void walk(
+            llvm::ThreadPoolInterface&                                   pool,
+            const std::function<void(const std::vector<std::string>&)>& onHeaders
+        );
+
+        // Maps or reads a file, collects the offsets of the token with TokenScanner and the active
+        // target versions with AnnotationScanner. Hands the content to fileCache and returns true
+        // if the file is retained.
+        bool checkFile(
+            const std::string&    file,
+            const std::string&    token,
+            CachingFileSystem*    fileCache,
+            ScanSnapshot::Header& result
+        ) const;
+        bool isRetained(const ScanSnapshot::Header& result) const;
+        // Byte-wise reference of TokenScanner::scan(), only used to benchmark it.
+        static bool fastCheckToken(llvm::StringRef content, const std::string& token, std::vector<uint32_t>* offsets = nullptr);
 
-        std::vector<std::string> mAllHeaderFiles;
+        std::vector<std::string>       mSourcePaths;
+        std::vector<std::string>       mHeaderExtensions;
+        std::vector<std::string>       mExcludePatternStrings;
+        std::vector<llvm::GlobPattern> mExcludePatterns;
+        // Sorted numbers of the target versions.
+        std::vector<uint64_t>          mTargetVersions;
+        std::mutex                     mWalkMutex;
+        std::vector<std::string>       mAllHeaderFiles;
+        std::set<std::string>          mScannedDirectories;
+        std::mutex                     mTokenOffsetMutex;
+        TokenOffsetMap                 mTokenOffsets;
+        ActiveVersionMap               mActiveVersions;
+        // Loaded or taken by the last scan, and the one the current scan takes.
+        ScanSnapshot                   mSnapshot;
+        ScanSnapshot                   mNextSnapshot;
+        std::atomic<size_t>            mReusedDirectoryCount{0};
+        std::atomic<size_t>            mReusedHeaderCount{0};
+        int64_t                        mTrustedBefore = 0;
     };
 
 } // namespace sapphire::codegen
\ No newline at end of file
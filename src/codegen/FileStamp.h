@@ -0,0 +1,29 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+
+namespace sapphire::codegen {
+
+    // Files modified this recently are not trusted to be unchanged while their mtime is, since a
+    // rewrite within the same mtime tick keeps it.
+    inline constexpr std::chrono::seconds MTIME_GRANULARITY{2};
+
+    // Size and mtime of a file, the mtime in seconds as clang's FileEntry holds it.
+    struct FileStamp {
+        // Stored for a file modified too recently to trust. Never matches a stat.
+        static constexpr int64_t UNTRUSTED_MTIME = std::numeric_limits<int64_t>::min();
+
+        uint64_t mSize = 0;
+        int64_t  mMTime = -1; // -1 if the file does not exist
+
+        bool operator==(const FileStamp &other) const { return mSize == other.mSize && mMTime == other.mMTime; }
+    };
+
+    // Stamps of the files a parse read, keyed by real path.
+    using FileStampMap = std::map<std::string, FileStamp>;
+
+} // namespace sapphire::codegen
\ No newline at end of file
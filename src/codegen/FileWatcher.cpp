@@ -0,0 +1,167 @@
+#include "FileWatcher.h"
+
+#include <chrono>
+#include <filesystem>
+#include <set>
+#include <thread>
+
+#ifdef __linux__
+#    include <cerrno>
+#    include <poll.h>
+#    include <sys/inotify.h>
+#    include <unistd.h>
+#endif
+
+namespace sapphire::codegen {
+
+    namespace fs = std::filesystem;
+
+    // How long no change must arrive before the collected changes are reported.
+    static constexpr auto QUIET_PERIOD = std::chrono::milliseconds(50);
+
+    FileWatcher::FileWatcher(const std::vector<std::string> &rootDirs) {
+        // Same spelling as the paths of FileProcessor.
+        for (auto &&rootDir : rootDirs)
+            mRootDirs.emplace_back(fs::absolute(rootDir).string());
+#ifdef __linux__
+        mFd = inotify_init1(IN_CLOEXEC);
+        if (mFd < 0)
+            return;
+        for (auto &&rootDir : mRootDirs)
+            addWatches(rootDir);
+#else
+        mSnapshot = takeSnapshot();
+#endif
+    }
+
+#ifdef __linux__
+
+    FileWatcher::~FileWatcher() {
+        if (mFd >= 0)
+            close(mFd);
+    }
+
+    size_t FileWatcher::directoryCount() const {
+        return mDirectories.size();
+    }
+
+    void FileWatcher::addWatches(const std::string &dir) {
+        constexpr uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                | IN_DELETE_SELF | IN_ONLYDIR;
+        int wd = inotify_add_watch(mFd, dir.c_str(), mask);
+        if (wd < 0)
+            return;
+        mDirectories.insert_or_assign(wd, dir);
+
+        std::error_code ec;
+        for (auto &&entry : fs::directory_iterator(dir, ec)) {
+            if (entry.is_directory(ec) && !entry.is_symlink(ec))
+                addWatches(entry.path().string());
+        }
+    }
+
+    bool FileWatcher::wait(std::vector<std::string> &changedPaths) {
+        changedPaths.clear();
+        if (mFd < 0)
+            return false;
+
+        std::set<std::string> changed;
+        int                   timeout = -1;
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (true) {
+            pollfd pfd{mFd, POLLIN, 0};
+            int    ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready < 0)
+                return false;
+            if (ready == 0)
+                break;
+
+            auto length = read(mFd, buffer, sizeof(buffer));
+            if (length < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (length <= 0)
+                return false;
+            for (char *p = buffer; p < buffer + length;) {
+                auto *event = reinterpret_cast<inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+                // Events were lost, so everything may have changed.
+                if (event->mask & IN_Q_OVERFLOW) {
+                    changed.insert(mRootDirs.begin(), mRootDirs.end());
+                    continue;
+                }
+                auto found = mDirectories.find(event->wd);
+                if (found == mDirectories.end())
+                    continue;
+                if (event->mask & IN_IGNORED) {
+                    mDirectories.erase(found);
+                    continue;
+                }
+                if (!event->len)
+                    continue;
+                auto path = (fs::path(found->second) / event->name).string();
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                    addWatches(path);
+                changed.insert(std::move(path));
+            }
+            timeout = static_cast<int>(QUIET_PERIOD.count());
+        }
+        changedPaths.assign(changed.begin(), changed.end());
+        return true;
+    }
+
+#else
+
+    // Interval between two scans of the trees.
+    static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(500);
+
+    FileWatcher::~FileWatcher() = default;
+
+    size_t FileWatcher::directoryCount() const {
+        return mRootDirs.size();
+    }
+
+    FileWatcher::Snapshot FileWatcher::takeSnapshot() const {
+        Snapshot snapshot;
+        for (auto &&rootDir : mRootDirs) {
+            std::error_code ec;
+            for (fs::recursive_directory_iterator it(rootDir, ec), end; !ec && it != end; it.increment(ec)) {
+                if (!it->is_regular_file(ec))
+                    continue;
+                auto size = it->file_size(ec);
+                auto mtime = it->last_write_time(ec);
+                if (!ec)
+                    snapshot.emplace(it->path().string(), std::make_pair(size, mtime.time_since_epoch().count()));
+            }
+        }
+        return snapshot;
+    }
+
+    bool FileWatcher::wait(std::vector<std::string> &changedPaths) {
+        changedPaths.clear();
+        std::set<std::string> changed;
+        while (true) {
+            std::this_thread::sleep_for(changed.empty() ? POLL_INTERVAL : QUIET_PERIOD);
+            auto   snapshot = takeSnapshot();
+            size_t before = changed.size();
+            for (auto &&[path, stamp] : snapshot) {
+                auto found = mSnapshot.find(path);
+                if (found == mSnapshot.end() || found->second != stamp)
+                    changed.insert(path);
+            }
+            for (auto &&[path, stamp] : mSnapshot) {
+                if (!snapshot.count(path))
+                    changed.insert(path);
+            }
+            mSnapshot = std::move(snapshot);
+            if (!changed.empty() && changed.size() == before)
+                break;
+        }
+        changedPaths.assign(changed.begin(), changed.end());
+        return true;
+    }
+
+#endif
+
+} // namespace sapphire::codegen
\ No newline at end of file
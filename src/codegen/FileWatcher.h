@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Watches directory trees for changes. Uses inotify on Linux and falls back to polling
+    // the trees elsewhere.
+    class FileWatcher {
+    public:
+        explicit FileWatcher(const std::vector<std::string> &rootDirs);
+        ~FileWatcher();
+
+        FileWatcher(const FileWatcher &) = delete;
+        FileWatcher &operator=(const FileWatcher &) = delete;
+
+        // Blocks until something below the roots changes, then collects further changes until
+        // none arrived for a short while, so that a save that touches several files is reported
+        // once. Reports the created, modified and removed paths. A path may be a directory
+        // whose content is unknown, such as a created directory or, after an event overflow,
+        // a root. Returns false if watching failed.
+        bool wait(std::vector<std::string> &changedPaths);
+
+        size_t directoryCount() const;
+
+    private:
+        std::vector<std::string> mRootDirs;
+#ifdef __linux__
+        void addWatches(const std::string &dir);
+
+        int                                  mFd = -1;
+        std::unordered_map<int, std::string> mDirectories;
+#else
+        // Size and modification time of every file below the roots.
+        using Snapshot = std::map<std::string, std::pair<uint64_t, int64_t>>;
+
+        Snapshot takeSnapshot() const;
+
+        Snapshot mSnapshot;
+#endif
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -1,104 +1,256 @@
 #include "PCHGenerator.h"
-#include "CommandLine.h"
+#include "CodeGenOptions.h"
+#include "CompileCommandIndex.h"
+#include "PreprocessorProbe.h"
+#include "../util/FsHelper.h"
+#include "../util/HashUtil.h"
+#include "../util/LogUtil.h"
 
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+#include <exception>
+#include <set>
 
 using namespace clang;
 using namespace clang::tooling;
 
 namespace sapphire::codegen {
 
-    bool PCHGenerator::generate(
-        const CompilationDatabase &db,
-        const CommandLine         &cmd,
-        const std::string         &outputPchPath,
-        const std::string         &targetMCVersion
-    ) {
-        std::vector<std::string> baseArgs;
-        std::string              sourceFilename;
-        std::string              pchHeader;
-        bool                     foundCandidate = false;
-
-        auto allFiles = db.getAllFiles();
-        for (const auto &file : allFiles) {
-            auto cmds = db.getCompileCommands(file);
-            if (cmds.empty()) continue;
-
-            const auto &args = cmds[0].CommandLine;
-
-            for (const auto &arg : args) {
-                if (arg.rfind("/FI", 0) == 0) { // Starts with /FI
-                    pchHeader = arg.substr(3);
-                    if (pchHeader.size() >= 2 && pchHeader.front() == '"')
-                        pchHeader = pchHeader.substr(1, pchHeader.size() - 2);
-
-                    foundCandidate = true;
-                    break;
-                }
+    class SapphirePCHAction : public GeneratePCHAction {
+        PCHInfo     &mInfo;
+        FileStampMap mInputStamps;
+
+    public:
+        explicit SapphirePCHAction(PCHInfo &info) : mInfo(info) {}
+
+        bool BeginSourceFileAction(CompilerInstance &CI) override {
+            mInfo.mUsesMCVersion = false;
+            CI.getPreprocessor().addPPCallbacks(
+                std::make_unique<PreprocessorProbe>(CI.getSourceManager(), mInfo.mUsesMCVersion, &mInputStamps)
+            );
+            return GeneratePCHAction::BeginSourceFileAction(CI);
+        }
+
+        // The PCH key hashes the input contents, so only their paths are kept.
+        void EndSourceFileAction() override {
+            for (auto &&[path, stamp] : mInputStamps)
+                mInfo.mInputFiles.insert(path);
+            GeneratePCHAction::EndSourceFileAction();
+        }
+    };
+
+    class SapphirePCHActionFactory : public FrontendActionFactory {
+        PCHInfo &mInfo;
+
+    public:
+        explicit SapphirePCHActionFactory(PCHInfo &info) : mInfo(info) {}
+
+        std::unique_ptr<FrontendAction> create() override {
+            return std::make_unique<SapphirePCHAction>(mInfo);
+        }
+    };
+
+    // The manifest stored next to a cached PCH. The PCH is reused while the config hash
+    // matches and the contents of every input file hash to the same key.
+    struct PCHManifest {
+        static constexpr uint32_t MAGIC_NUMBER = 0x50434D46; // "FMCP"
+        static constexpr uint32_t FORMAT_VERSION = 1;
+
+        uint64_t              mConfigHash = 0;
+        uint64_t              mKey = 0;
+        bool                  mUsesMCVersion = true;
+        std::set<std::string> mInputFiles;
+
+        // Hashes the inputs as fs returns them. After a build, fs still holds the content the
+        // build read, even if a file changed on disk since.
+        static uint64_t
+        computeKey(uint64_t configHash, const std::set<std::string> &inputFiles, llvm::vfs::FileSystem &fs) {
+            util::StableHasher hasher;
+            hasher.add(configHash);
+            for (auto &&file : inputFiles) {
+                hasher.add(file);
+                auto buffer = fs.getBufferForFile(file, /*FileSize*/ -1, /*RequiresNullTerminator*/ false);
+                hasher.add(buffer ? llvm::xxh3_64bits((*buffer)->getBuffer()) : 0);
+            }
+            return hasher.finish();
+        }
+
+        // Returns false for a missing or corrupted manifest, which means the PCH is rebuilt.
+        bool load(const std::string &path) {
+            auto buffer = llvm::MemoryBuffer::getFile(
+                path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+            );
+            if (!buffer)
+                return false;
+            fshelper::SpanReader reader({(*buffer)->getBufferStart(), (*buffer)->getBufferSize()});
+            try {
+                if (fshelper::read<uint32_t>(reader) != MAGIC_NUMBER
+                    || fshelper::read<uint32_t>(reader) != FORMAT_VERSION)
+                    return false;
+                mConfigHash = fshelper::read<uint64_t>(reader);
+                mKey = fshelper::read<uint64_t>(reader);
+                mUsesMCVersion = fshelper::read<bool>(reader);
+                auto fileCount = fshelper::read<uint64_t>(reader);
+                reader.expect(fileCount, sizeof(uint64_t));
+                for (uint64_t i = 0; i < fileCount; ++i)
+                    mInputFiles.emplace(fshelper::read<std::string>(reader));
+                return true;
+            } catch (std::exception &e) {
+                llvm::errs() << llvm::formatv("[PCH] Warning: Failed to load {0}: {1}\n", path, e.what());
             }
+            mInputFiles.clear();
+            return false;
+        }
+
+        bool save(const std::string &path) const {
+            std::ofstream fs(path, std::ios::binary);
+            if (!fs.is_open())
+                return false;
+            fshelper::write(fs, MAGIC_NUMBER);
+            fshelper::write(fs, FORMAT_VERSION);
+            fshelper::write(fs, mConfigHash);
+            fshelper::write(fs, mKey);
+            fshelper::write(fs, mUsesMCVersion);
+            fshelper::write<uint64_t>(fs, mInputFiles.size());
+            for (auto &&file : mInputFiles)
+                fshelper::write(fs, file);
+            return fs.good();
+        }
+    };
 
-            if (foundCandidate) {
-                baseArgs = args;
-                sourceFilename = cmds[0].Filename;
-                llvm::outs() << llvm::formatv("[PCH] Found PCH template from: {0}\n", sourceFilename);
+    std::optional<PCHSource> PCHGenerator::findForceInclude(const CompileCommandIndex &db) {
+        auto command = db.getForceIncludeCommand();
+        if (!command)
+            return std::nullopt;
+
+        PCHSource source;
+        for (const auto &arg : command->CommandLine) {
+            if (arg.rfind("/FI", 0) == 0) { // Starts with /FI
+                source.mHeader = arg.substr(3);
+                if (source.mHeader.size() >= 2 && source.mHeader.front() == '"')
+                    source.mHeader = source.mHeader.substr(1, source.mHeader.size() - 2);
                 break;
             }
         }
+        if (source.mHeader.empty())
+            return std::nullopt;
+        source.mCommand = *command;
+        std::lock_guard<std::mutex> lock(util::logMutex());
+        llvm::outs() << llvm::formatv("[PCH] Found PCH template from: {0}\n", command->Filename);
+        return source;
+    }
 
-        if (!foundCandidate || pchHeader.empty()) {
-            llvm::outs() << "[PCH] No /FI found in ANY compile commands. Skipping PCH generation.\n";
-            return false;
+    bool PCHGenerator::generate(
+        const CompileCommandIndex                      &db,
+        const CodeGenOptions                           &options,
+        const PCHSource                                &source,
+        const std::string                              &outputPchPath,
+        const std::string                              &targetMCVersion,
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+        PCHInfo                                        &info
+    ) {
+        const auto &baseArgs = source.mCommand.CommandLine;
+        const auto &pchHeader = source.mHeader;
+
+        auto &clangResourceDir = options.mClangResourceDir;
+
+        // Every argument after the compiler path.
+        CommandLineArguments pchArgs;
+        pchArgs.push_back("--target=x86_64-pc-windows-msvc");
+        pchArgs.push_back("-Wno-everything");
+
+        if (!clangResourceDir.empty()) {
+            pchArgs.push_back("-resource-dir");
+            pchArgs.push_back(clangResourceDir);
         }
 
-        std::vector<std::string> sources = {pchHeader};
-        ClangTool                PCHTool(db, sources);
+        if (!targetMCVersion.empty()) {
+            pchArgs.push_back("/DMC_VERSION=" + targetMCVersion);
+        }
+        pchArgs.push_back("/DSAPPHIRE_CODEGEN_PASS");
+        pchArgs.push_back("-Xclang");
+        pchArgs.push_back("-skip-function-bodies");
+        if (options.mLeanParse) {
+            // Delayed template parsing is a language option, TUs using the PCH must match it.
+            pchArgs.push_back("-Xclang");
+            pchArgs.push_back("-fdelayed-template-parsing");
+        }
+
+        for (size_t i = 1; i < baseArgs.size(); ++i) {
+            StringRef arg = baseArgs[i];
+            if (arg == source.mCommand.Filename || arg.starts_with("/Yu") || arg.starts_with("/Yc")
+                || arg.starts_with("/Fp") || arg.starts_with("/FI") || arg.starts_with("/Fo")
+                || arg.starts_with("/Fa") || arg.starts_with("/Fe") || arg.starts_with("-DMC_VERSION=")
+                || arg.starts_with("/DMC_VERSION=") || arg.ends_with(".cpp") || arg.ends_with(".cxx")
+                || arg.ends_with(".c") || arg.ends_with(".cc")) {
+                continue;
+            }
+            pchArgs.push_back(std::string(arg));
+        }
+
+        pchArgs.push_back("-o");
+        pchArgs.push_back(outputPchPath);
+        pchArgs.push_back(pchHeader);
 
-        auto &clangResourceDir = cmd.getClangResourceDir();
+        util::StableHasher configHasher;
+        configHasher.add(getClangFullVersion());
+        configHasher.add(baseArgs.empty() ? std::string() : baseArgs[0]);
+        for (auto &&arg : pchArgs)
+            configHasher.add(arg);
+        auto configHash = configHasher.finish();
+
+        auto        manifestPath = outputPchPath + ".manifest";
+        PCHManifest manifest;
+        if (options.mPchCache && llvm::sys::fs::exists(outputPchPath) && manifest.load(manifestPath)
+            && manifest.mConfigHash == configHash
+            && manifest.mKey == PCHManifest::computeKey(configHash, manifest.mInputFiles, *fs)) {
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::outs() << llvm::formatv("[PCH] Reusing unchanged: {0}\n", outputPchPath);
+            info.mUsesMCVersion = manifest.mUsesMCVersion;
+            info.mHash = manifest.mKey;
+            info.mInputFiles = std::move(manifest.mInputFiles);
+            return true;
+        }
+
+        std::vector<std::string> sources = {pchHeader};
+        ClangTool                PCHTool(db, sources, std::make_shared<PCHContainerOperations>(), fs);
 
         PCHTool.appendArgumentsAdjuster(
             [&](const CommandLineArguments &arg, StringRef) {
                 CommandLineArguments newArgs;
-
                 newArgs.push_back(arg[0]);
-                newArgs.push_back("--target=x86_64-pc-windows-msvc");
-                newArgs.push_back("-Wno-everything");
-
-                if (!clangResourceDir.empty()) {
-                    newArgs.push_back("-resource-dir");
-                    newArgs.push_back(clangResourceDir);
-                }
-
-                if (!targetMCVersion.empty()) {
-                    newArgs.push_back("/DMC_VERSION=" + targetMCVersion);
-                }
-                newArgs.push_back("/DSAPPHIRE_CODEGEN_PASS");
-                newArgs.push_back("-Xclang");
-                newArgs.push_back("-skip-function-bodies");
-
-                for (size_t i = 1; i < baseArgs.size(); ++i) {
-                    StringRef arg = baseArgs[i];
-                    if (arg.starts_with("/Yu") || arg.starts_with("/Yc") || arg.starts_with("/Fp") || arg.starts_with("/FI")
-                        || arg.starts_with("/Fo") || arg.starts_with("/Fa") || arg.starts_with("/Fe")
-                        || arg.starts_with("-DMC_VERSION=") || arg.starts_with("/DMC_VERSION=") || arg.ends_with(".cpp")
-                        || arg.ends_with(".cxx") || arg.ends_with(".c") || arg.ends_with(".cc")) {
-                        continue;
-                    }
-                    newArgs.push_back(std::string(arg));
-                }
-
-                newArgs.push_back("-o");
-                newArgs.push_back(outputPchPath);
-                newArgs.push_back(pchHeader);
-
+                newArgs.insert(newArgs.end(), pchArgs.begin(), pchArgs.end());
                 return newArgs;
             }
         );
 
-        llvm::outs() << llvm::formatv("[PCH] Generating: {0} from {1}\n", outputPchPath, pchHeader);
+        {
+            std::lock_guard<std::mutex> lock(util::logMutex());
+            llvm::outs() << llvm::formatv("[PCH] Generating: {0} from {1}\n", outputPchPath, pchHeader);
+        }
+
+        // A stale manifest must not survive a failed build.
+        llvm::sys::fs::remove(manifestPath);
 
-        return PCHTool.run(newFrontendActionFactory<GeneratePCHAction>().get()) == 0;
+        SapphirePCHActionFactory actionFactory(info);
+        if (PCHTool.run(&actionFactory) != 0)
+            return false;
+
+        manifest.mConfigHash = configHash;
+        manifest.mInputFiles = info.mInputFiles;
+        manifest.mUsesMCVersion = info.mUsesMCVersion;
+        manifest.mKey = PCHManifest::computeKey(configHash, manifest.mInputFiles, *fs);
+        info.mHash = manifest.mKey;
+        if (options.mPchCache && !manifest.save(manifestPath)) {
+            llvm::errs() << llvm::formatv("[PCH] Warning: Cannot write manifest {0}\n", manifestPath);
+        }
+        return true;
     }
 
 } // namespace sapphire::codegen
\ No newline at end of file
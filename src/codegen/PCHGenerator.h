@@ -1,24 +1,54 @@
 #pragma once
 
+#include <clang/Tooling/CompilationDatabase.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <cstdint>
+#include <optional>
+#include <set>
 #include <string>
 
-// Forward declarations
-namespace clang::tooling {
-    class CompilationDatabase;
-}
-
 namespace sapphire::codegen {
 
-    class CommandLine;
+    class CompileCommandIndex;
+    struct CodeGenOptions;
+
+    // Facts about a generated PCH.
+    struct PCHInfo {
+        // Whether preprocessing the PCH header referenced MC_VERSION. A PCH that does
+        // not can stand in for every version's PCH in a single-pass parse.
+        bool                  mUsesMCVersion = true;
+        // Hash of the clang version, the adjusted arguments and the contents of every input
+        // file. Identifies the PCH content in result cache keys.
+        uint64_t              mHash = 0;
+        // Real paths of the files the PCH was built from.
+        std::set<std::string> mInputFiles;
+    };
+
+    // What a PCH is built from.
+    struct PCHSource {
+        // Header compiled into the PCH.
+        std::string                    mHeader;
+        // Command whose flags the PCH is built with. Its own file is not an input of the PCH.
+        clang::tooling::CompileCommand mCommand;
+    };
 
     class PCHGenerator {
     public:
-        // Generates a PCH file. Returns true on success.
+        // The header force-included with /FI by the compile commands, and the command that does.
+        // Returns nothing if no command has a /FI.
+        static std::optional<PCHSource> findForceInclude(const CompileCommandIndex &db);
+
+        // Generates a PCH file, or reuses the existing one if its manifest shows that nothing
+        // it was built from changed. The PCH build reads its inputs through fs.
+        // Returns true on success.
         static bool generate(
-            const clang::tooling::CompilationDatabase &db,
-            const CommandLine                         &cmd,
-            const std::string                         &outputPchPath,
-            const std::string                         &targetMCVersion
+            const CompileCommandIndex                      &db,
+            const CodeGenOptions                           &options,
+            const PCHSource                                &source,
+            const std::string                              &outputPchPath,
+            const std::string                              &targetMCVersion,
+            llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+            PCHInfo                                        &info
         );
     };
 
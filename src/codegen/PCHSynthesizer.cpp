@@ -0,0 +1,251 @@
+#include "PCHSynthesizer.h"
+#include "CachingFileSystem.h"
+#include "CodeGenOptions.h"
+#include "CompileCommandIndex.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+
+namespace sapphire::codegen {
+
+    // Fewer headers do not repay building a PCH.
+    static constexpr size_t MIN_CLUSTER_HEADERS = 4;
+
+    using IncludeMap = std::unordered_map<std::string, std::vector<std::string>>;
+
+    static std::string toSlashes(llvm::StringRef path) {
+        return llvm::sys::path::convert_to_slash(path);
+    }
+
+    // Returns the #include directives of a header that are outside of every conditional but its
+    // include guard, each spelled as in an #include line. Quoted includes found next to the
+    // header are made absolute, so that the prefix header finds them from the output directory.
+    static std::vector<std::string> scanIncludes(llvm::vfs::FileSystem &fs, const std::string &header) {
+        std::vector<std::string> includes;
+        auto                     buffer = fs.getBufferForFile(header);
+        if (!buffer)
+            return includes;
+
+        llvm::StringRef directory = llvm::sys::path::parent_path(header);
+        llvm::StringRef rest = (*buffer)->getBuffer();
+        int             depth = 0;
+        // Depth of the include guard, 0 if there is none.
+        int             guardDepth = 0;
+        // Macro of a leading #ifndef, until the next directive shows whether it is a guard.
+        std::string     guardMacro;
+        bool            seenDirective = false;
+        bool            inBlockComment = false;
+        auto            isIdentifierChar = [](char c) { return llvm::isAlnum(c) || c == '_'; };
+
+        while (!rest.empty()) {
+            llvm::StringRef line;
+            std::tie(line, rest) = rest.split('\n');
+            line = line.trim();
+            if (inBlockComment) {
+                auto end = line.find("*/");
+                if (end == llvm::StringRef::npos)
+                    continue;
+                line = line.drop_front(end + 2).ltrim();
+                inBlockComment = false;
+            }
+            if (line.starts_with("/*") && line.find("*/") == llvm::StringRef::npos) {
+                inBlockComment = true;
+                continue;
+            }
+            if (!line.consume_front("#"))
+                continue;
+
+            line = line.ltrim();
+            auto directive = line.take_while(isIdentifierChar);
+            line = line.drop_front(directive.size()).ltrim();
+            auto macro = line.take_while(isIdentifierChar);
+            if (directive == "pragma")
+                continue;
+
+            if (directive == "define" && !guardMacro.empty() && macro == guardMacro)
+                guardDepth = depth;
+            guardMacro.clear();
+            if (directive == "if" || directive == "ifdef" || directive == "ifndef") {
+                if (directive == "ifndef" && depth == 0 && !seenDirective)
+                    guardMacro = macro.str();
+                ++depth;
+            } else if (directive == "endif") {
+                depth = std::max(depth - 1, 0);
+            } else if (directive == "include" && (depth == 0 || depth == guardDepth)) {
+                if (line.starts_with("<")) {
+                    auto end = line.find('>');
+                    if (end != llvm::StringRef::npos)
+                        includes.emplace_back(line.take_front(end + 1));
+                } else if (line.starts_with("\"")) {
+                    auto end = line.find('"', 1);
+                    if (end == llvm::StringRef::npos)
+                        continue;
+                    llvm::SmallString<256> path(directory);
+                    llvm::sys::path::append(path, line.slice(1, end));
+                    llvm::sys::path::remove_dots(path, /*remove_dot_dot*/ true);
+                    if (fs.exists(path))
+                        includes.emplace_back("\"" + toSlashes(path) + "\"");
+                    else
+                        includes.emplace_back(line.take_front(end + 1));
+                }
+            }
+            seenDirective = true;
+        }
+        return includes;
+    }
+
+    // Includes of at least threshold percent of the headers, and of two at least, in the order
+    // they first appear. The headers themselves are left out, since a header compiled into the
+    // PCH cannot be parsed as a main file with it.
+    static std::vector<std::string> findSharedIncludes(
+        const std::vector<std::string> &headers,
+        const IncludeMap               &includes,
+        unsigned                        threshold,
+        const std::set<std::string>    &activeHeaders
+    ) {
+        std::unordered_map<std::string, size_t> counts;
+        std::vector<std::string>                order;
+        for (auto &&header : headers) {
+            std::set<std::string> seen;
+            for (auto &&include : includes.at(header)) {
+                if (seen.insert(include).second && counts[include]++ == 0)
+                    order.push_back(include);
+            }
+        }
+
+        size_t                   minCount = std::max<size_t>(2, (headers.size() * threshold + 99) / 100);
+        std::vector<std::string> shared;
+        for (auto &&include : order) {
+            if (counts[include] < minCount)
+                continue;
+            if (include.front() == '"' && activeHeaders.count(include.substr(1, include.size() - 2)))
+                continue;
+            shared.push_back(include);
+        }
+        return shared;
+    }
+
+    // Writes the prefix header of a cluster, leaving an unchanged one untouched.
+    static bool
+    writePrefixHeader(CachingFileSystem &fs, PCHCluster &cluster, const std::vector<std::string> &includes) {
+        std::string content = llvm::formatv(
+            "// Shared includes of {0} headers, synthesized by SapphireCodeGen.\n", cluster.mHeaders.size()
+        );
+        for (auto &&include : includes)
+            content += "#include " + include + "\n";
+        cluster.mIncludeCount = includes.size();
+
+        std::ifstream      existing(cluster.mPrefixHeader, std::ios::binary);
+        std::ostringstream existingContent;
+        existingContent << existing.rdbuf();
+        if (existing.is_open() && existingContent.str() == content)
+            return true;
+        existing.close();
+
+        std::ofstream file(cluster.mPrefixHeader, std::ios::binary);
+        file << content;
+        fs.invalidate(std::vector<std::string>{cluster.mPrefixHeader});
+        return file.good();
+    }
+
+    std::vector<PCHCluster> PCHSynthesizer::plan(
+        const CompileCommandIndex      &compilations,
+        const CodeGenOptions           &options,
+        const std::vector<std::string> &headers,
+        CachingFileSystem              &fs,
+        const std::string              &outputDir
+    ) {
+        std::vector<PCHCluster> clusters;
+        if (!options.mAutoPchThreshold)
+            return clusters;
+
+        std::set<std::string> activeHeaders;
+        IncludeMap            includes;
+        // Only headers with identical compile flags can share a PCH.
+        std::map<uint64_t, std::vector<std::string>> groups;
+        for (auto &&header : headers) {
+            activeHeaders.insert(toSlashes(header));
+            includes[header] = scanIncludes(fs, header);
+            groups[compilations.resolve(header).mFlagsKey].push_back(header);
+        }
+
+        auto addCluster = [&](std::vector<std::string> members) {
+            auto shared = findSharedIncludes(members, includes, options.mAutoPchThreshold, activeHeaders);
+            if (shared.empty())
+                return false;
+            PCHCluster cluster;
+            cluster.mHeaders = std::move(members);
+            cluster.mPrefixHeader = (std::filesystem::path(outputDir)
+                                     / llvm::formatv("sapphire_codegen.auto{0}.h", clusters.size()).str())
+                                        .string();
+            if (!writePrefixHeader(fs, cluster, shared)) {
+                llvm::errs() << llvm::formatv("[PCH] Warning: Cannot write {0}\n", cluster.mPrefixHeader);
+                return false;
+            }
+            clusters.emplace_back(std::move(cluster));
+            return true;
+        };
+
+        // The largest directories get PCHs of their own, which can hold includes that are
+        // common in them but not in the whole group.
+        if (options.mPchClusterCount) {
+            std::map<std::pair<uint64_t, std::string>, std::vector<std::string>> directories;
+            for (auto &&[flagsKey, members] : groups) {
+                for (auto &&header : members)
+                    directories[{flagsKey, llvm::sys::path::parent_path(header).str()}].push_back(header);
+            }
+            std::vector<std::pair<const std::pair<uint64_t, std::string>, std::vector<std::string>> *> largest;
+            for (auto &&directory : directories) {
+                auto size = directory.second.size();
+                if (size >= MIN_CLUSTER_HEADERS && size < groups[directory.first.first].size())
+                    largest.push_back(&directory);
+            }
+            std::stable_sort(largest.begin(), largest.end(), [](auto *lhs, auto *rhs) {
+                return lhs->second.size() > rhs->second.size();
+            });
+            if (largest.size() > options.mPchClusterCount)
+                largest.resize(options.mPchClusterCount);
+
+            for (auto *directory : largest) {
+                if (!addCluster(directory->second))
+                    continue;
+                std::set<std::string> clustered(directory->second.begin(), directory->second.end());
+                auto                 &members = groups[directory->first.first];
+                members.erase(
+                    std::remove_if(
+                        members.begin(),
+                        members.end(),
+                        [&](const std::string &header) { return clustered.count(header) != 0; }
+                    ),
+                    members.end()
+                );
+            }
+        }
+
+        for (auto &&[flagsKey, members] : groups) {
+            if (members.size() >= MIN_CLUSTER_HEADERS)
+                addCluster(members);
+        }
+
+        for (auto &&cluster : clusters) {
+            llvm::outs() << llvm::formatv(
+                "[PCH] Synthesized {0}: {1} shared includes of {2} headers.\n",
+                cluster.mPrefixHeader,
+                cluster.mIncludeCount,
+                cluster.mHeaders.size()
+            );
+        }
+        return clusters;
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
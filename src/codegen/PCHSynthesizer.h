@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    class CachingFileSystem;
+    class CompileCommandIndex;
+    struct CodeGenOptions;
+
+    // A group of headers with identical compile flags that share a synthesized PCH.
+    struct PCHCluster {
+        // Headers parsed with the PCH.
+        std::vector<std::string> mHeaders;
+        // Generated header that includes the shared includes in the order they first appear.
+        std::string              mPrefixHeader;
+        // Number of includes in the prefix header.
+        size_t                   mIncludeCount = 0;
+    };
+
+    // Synthesizes PCHs for projects whose compile commands force-include none. The includes that
+    // at least mAutoPchThreshold percent of a cluster's headers share, outside of any conditional
+    // other than the include guard, are compiled into its PCH.
+    class PCHSynthesizer {
+    public:
+        // Groups the headers by their compile flags, splitting the mPchClusterCount largest
+        // directories off into clusters of their own, and writes a prefix header into outputDir for
+        // every cluster that shares includes. Headers of no cluster are parsed without a PCH.
+        static std::vector<PCHCluster> plan(
+            const CompileCommandIndex      &compilations,
+            const CodeGenOptions           &options,
+            const std::vector<std::string> &headers,
+            CachingFileSystem              &fs,
+            const std::string              &outputDir
+        );
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
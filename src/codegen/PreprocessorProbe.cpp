@@ -0,0 +1,57 @@
+#include "PreprocessorProbe.h"
+
+#include <clang/Basic/SourceManager.h>
+#include <clang/Lex/Token.h>
+
+using namespace clang;
+
+namespace sapphire::codegen {
+
+    void PreprocessorProbe::check(const Token &macroNameTok) {
+        if (mUsesMCVersion) return;
+        if (const IdentifierInfo *II = macroNameTok.getIdentifierInfo()) {
+            if (II->getName() == MC_VERSION_MACRO)
+                mUsesMCVersion = true;
+        }
+    }
+
+    void PreprocessorProbe::FileChanged(
+        SourceLocation loc, FileChangeReason reason, SrcMgr::CharacteristicKind, FileID
+    ) {
+        if (!mIncludedFiles || reason != EnterFile) return;
+        if (auto FE = mSM.getFileEntryRefForID(mSM.getFileID(loc))) {
+            llvm::StringRef realPath = FE->getFileEntry().tryGetRealPathName();
+            FileStamp       stamp;
+            stamp.mSize = FE->getSize();
+            stamp.mMTime = FE->getModificationTime();
+            mIncludedFiles->emplace(realPath.empty() ? FE->getName() : realPath, stamp);
+        }
+    }
+
+    void PreprocessorProbe::MacroExpands(
+        const Token &macroNameTok, const MacroDefinition &, SourceRange, const MacroArgs *
+    ) {
+        check(macroNameTok);
+    }
+
+    void PreprocessorProbe::Defined(const Token &macroNameTok, const MacroDefinition &, SourceRange) {
+        check(macroNameTok);
+    }
+
+    void PreprocessorProbe::Ifdef(SourceLocation, const Token &macroNameTok, const MacroDefinition &) {
+        check(macroNameTok);
+    }
+
+    void PreprocessorProbe::Ifndef(SourceLocation, const Token &macroNameTok, const MacroDefinition &) {
+        check(macroNameTok);
+    }
+
+    void PreprocessorProbe::Elifdef(SourceLocation, const Token &macroNameTok, const MacroDefinition &) {
+        check(macroNameTok);
+    }
+
+    void PreprocessorProbe::Elifndef(SourceLocation, const Token &macroNameTok, const MacroDefinition &) {
+        check(macroNameTok);
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
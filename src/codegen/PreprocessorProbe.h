@@ -0,0 +1,68 @@
+#pragma once
+
+#include "FileStamp.h"
+
+#include <clang/Lex/PPCallbacks.h>
+
+namespace clang {
+    class SourceManager;
+}
+
+namespace sapphire::codegen {
+
+    // Observes the preprocessor of a TU and records whether MC_VERSION was referenced
+    // by any expansion, defined() or #ifdef. If it was not, the preprocessed token
+    // stream is identical for every MC_VERSION value. Optionally records the real path of
+    // every file the preprocessor entered, with the size and mtime clang saw it with.
+    class PreprocessorProbe : public clang::PPCallbacks {
+    public:
+        static constexpr llvm::StringLiteral MC_VERSION_MACRO = "MC_VERSION";
+
+        PreprocessorProbe(
+            const clang::SourceManager &sm, bool &usesMCVersion, FileStampMap *includedFiles = nullptr
+        ) :
+            mSM(sm), mUsesMCVersion(usesMCVersion), mIncludedFiles(includedFiles) {}
+
+        void FileChanged(
+            clang::SourceLocation             loc,
+            FileChangeReason                  reason,
+            clang::SrcMgr::CharacteristicKind fileType,
+            clang::FileID                     prevFID
+        ) override;
+
+        void MacroExpands(
+            const clang::Token           &macroNameTok,
+            const clang::MacroDefinition &md,
+            clang::SourceRange            range,
+            const clang::MacroArgs       *args
+        ) override;
+
+        void Defined(
+            const clang::Token &macroNameTok, const clang::MacroDefinition &md, clang::SourceRange range
+        ) override;
+
+        void Ifdef(
+            clang::SourceLocation loc, const clang::Token &macroNameTok, const clang::MacroDefinition &md
+        ) override;
+
+        void Ifndef(
+            clang::SourceLocation loc, const clang::Token &macroNameTok, const clang::MacroDefinition &md
+        ) override;
+
+        void Elifdef(
+            clang::SourceLocation loc, const clang::Token &macroNameTok, const clang::MacroDefinition &md
+        ) override;
+
+        void Elifndef(
+            clang::SourceLocation loc, const clang::Token &macroNameTok, const clang::MacroDefinition &md
+        ) override;
+
+    private:
+        void check(const clang::Token &macroNameTok);
+
+        const clang::SourceManager &mSM;
+        bool                       &mUsesMCVersion;
+        FileStampMap               *mIncludedFiles;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
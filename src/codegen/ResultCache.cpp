@@ -0,0 +1,190 @@
+#include "ResultCache.h"
+#include "../util/FsHelper.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <exception>
+
+namespace sapphire::codegen {
+
+    FileStamp ResultCache::stat(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mStampMutex);
+            auto                        found = mStamps.find(path);
+            if (found != mStamps.end())
+                return found->second;
+        }
+
+        FileStamp                  stamp;
+        llvm::sys::fs::file_status status;
+        if (!llvm::sys::fs::status(path, status) && llvm::sys::fs::exists(status)) {
+            stamp.mSize = status.getSize();
+            stamp.mMTime = llvm::sys::toTimeT(status.getLastModificationTime());
+        }
+
+        std::lock_guard<std::mutex> lock(mStampMutex);
+        mStamps.emplace(path, stamp);
+        return stamp;
+    }
+
+    bool ResultCache::lookup(
+        const std::string                  &header,
+        uint64_t                            version,
+        uint64_t                            configHash,
+        std::vector<SigDatabase::SigEntry> &entries,
+        FileStampMap                       *dependencies
+    ) {
+        std::vector<Dependency> recorded;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto                        found = mRecords.find({header, version});
+            if (found == mRecords.end() || found->second.mConfigHash != configHash)
+                return false;
+            recorded = found->second.mDependencies;
+        }
+
+        for (auto &&dependency : recorded) {
+            if (!(stat(dependency.mPath) == dependency.mStamp))
+                return false;
+        }
+        if (dependencies) {
+            for (auto &&dependency : recorded)
+                dependencies->emplace(dependency.mPath, dependency.mStamp);
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto                        found = mRecords.find({header, version});
+        if (found == mRecords.end())
+            return false;
+        found->second.mUsed = true;
+        entries = found->second.mEntries;
+        ++mHitCount;
+        return true;
+    }
+
+    void ResultCache::store(
+        const std::string                        &header,
+        uint64_t                                  version,
+        uint64_t                                  configHash,
+        const FileStampMap                       &dependencies,
+        const std::vector<SigDatabase::SigEntry> &entries
+    ) {
+        Record record;
+        record.mConfigHash = configHash;
+        record.mEntries = entries;
+        record.mUsed = true;
+        record.mDependencies.reserve(dependencies.size() + 1);
+        // Every parse enters the header. Should its stamp be missing anyway, the record never hits.
+        if (!dependencies.count(header))
+            record.mDependencies.push_back({header, FileStamp{0, FileStamp::UNTRUSTED_MTIME}});
+        for (auto &&[path, stamp] : dependencies) {
+            // A file rewritten within its mtime tick after the parse read it keeps the same stamp.
+            if (stamp.mMTime >= mTrustedBefore)
+                record.mDependencies.push_back({path, FileStamp{stamp.mSize, FileStamp::UNTRUSTED_MTIME}});
+            else
+                record.mDependencies.push_back({path, stamp});
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRecords[{header, version}] = std::move(record);
+    }
+
+    void ResultCache::refresh() {
+        std::lock_guard<std::mutex> lock(mStampMutex);
+        mStamps.clear();
+        mHitCount = 0;
+        // Files are read after this point, so one modified before it minus the mtime granularity
+        // cannot have been rewritten within its tick since the read.
+        mTrustedBefore = llvm::sys::toTimeT(std::chrono::system_clock::now() - MTIME_GRANULARITY);
+    }
+
+    bool ResultCache::load(const std::string &path) {
+        mRecords.clear();
+        mStamps.clear();
+        mHitCount = 0;
+
+        // One read of the whole file. Every length and count is checked against what is left of
+        // it, so a corrupted file cannot make the loops below allocate for data it does not have.
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+        );
+        if (!buffer)
+            return false;
+        fshelper::SpanReader reader({(*buffer)->getBufferStart(), (*buffer)->getBufferSize()});
+        try {
+            if (fshelper::read<uint32_t>(reader) != MAGIC_NUMBER || fshelper::read<uint32_t>(reader) != FORMAT_VERSION)
+                return false;
+            auto recordCount = fshelper::read<uint64_t>(reader);
+            // Header length, version, config hash, dependency and entry counts.
+            reader.expect(recordCount, 5 * sizeof(uint64_t));
+            for (uint64_t i = 0; i < recordCount; ++i) {
+                auto   header = fshelper::read<std::string>(reader);
+                auto   version = fshelper::read<uint64_t>(reader);
+                Record record;
+                record.mConfigHash = fshelper::read<uint64_t>(reader);
+                auto dependencyCount = fshelper::read<uint64_t>(reader);
+                // Path length, size and mtime.
+                reader.expect(dependencyCount, 3 * sizeof(uint64_t));
+                record.mDependencies.reserve(dependencyCount);
+                for (uint64_t j = 0; j < dependencyCount; ++j) {
+                    auto &dependency = record.mDependencies.emplace_back();
+                    dependency.mPath = fshelper::read<std::string>(reader);
+                    dependency.mStamp.mSize = fshelper::read<uint64_t>(reader);
+                    dependency.mStamp.mMTime = fshelper::read<int64_t>(reader);
+                }
+                auto entryCount = fshelper::read<uint64_t>(reader);
+                reader.expect(entryCount, SigDatabase::MIN_SIG_ENTRY_SIZE);
+                record.mEntries.reserve(entryCount);
+                for (uint64_t j = 0; j < entryCount; ++j) {
+                    record.mEntries.emplace_back(SigDatabase::readSigEntry(reader));
+                }
+                mRecords.emplace(std::make_pair(std::move(header), version), std::move(record));
+            }
+            return true;
+        } catch (std::exception &e) {
+            llvm::errs() << llvm::formatv("[Cache] Warning: Failed to load {0}: {1}\n", path, e.what());
+        }
+        mRecords.clear();
+        return false;
+    }
+
+    bool ResultCache::save(const std::string &path) const {
+        std::ofstream fs(path, std::ios::binary);
+        if (!fs.is_open()) {
+            llvm::errs() << llvm::formatv("[Cache] Warning: Cannot write to {0}\n", path);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        uint64_t                    recordCount = 0;
+        for (auto &&[key, record] : mRecords) {
+            if (record.mUsed)
+                ++recordCount;
+        }
+        fshelper::write(fs, MAGIC_NUMBER);
+        fshelper::write(fs, FORMAT_VERSION);
+        fshelper::write(fs, recordCount);
+        for (auto &&[key, record] : mRecords) {
+            if (!record.mUsed)
+                continue;
+            fshelper::write(fs, key.first);
+            fshelper::write(fs, key.second);
+            fshelper::write(fs, record.mConfigHash);
+            fshelper::write<uint64_t>(fs, record.mDependencies.size());
+            for (auto &&dependency : record.mDependencies) {
+                fshelper::write(fs, dependency.mPath);
+                fshelper::write(fs, dependency.mStamp.mSize);
+                fshelper::write(fs, dependency.mStamp.mMTime);
+            }
+            fshelper::write<uint64_t>(fs, record.mEntries.size());
+            for (auto &&entry : record.mEntries) {
+                SigDatabase::writeSigEntry(fs, entry);
+            }
+        }
+        return fs.good();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "FileStamp.h"
+#include "SigDatabase.h"
+
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Persists the entries produced by each (header, version) parse together with every file
+    // the parse read, so that a header is only parsed again when its compile configuration,
+    // its own content or one of its transitive includes changed.
+    class ResultCache {
+    public:
+        static constexpr uint32_t MAGIC_NUMBER = 0x52534348; // "HCSR"
+        static constexpr uint32_t FORMAT_VERSION = 2;
+
+        // Loads a cache file. A missing, corrupted or outdated file yields an empty cache.
+        bool load(const std::string &path);
+
+        // Saves the records that were looked up or stored since load().
+        bool save(const std::string &path) const;
+
+        // Returns true and fills `entries` if the header was parsed for this version with the
+        // same config hash and none of the files it read changed since. Adds the files the parse
+        // read to `dependencies` if given.
+        bool lookup(
+            const std::string                  &header,
+            uint64_t                            version,
+            uint64_t                            configHash,
+            std::vector<SigDatabase::SigEntry> &entries,
+            FileStampMap                       *dependencies = nullptr
+        );
+
+        // Records the entries of a parse with the stamps of the files it read, as clang saw them.
+        // A stamp too recent to trust is stored untrusted, so that the record misses next run.
+        void store(
+            const std::string                        &header,
+            uint64_t                                  version,
+            uint64_t                                  configHash,
+            const FileStampMap                       &dependencies,
+            const std::vector<SigDatabase::SigEntry> &entries
+        );
+
+        // Forgets the file stamps and the hit count of the previous run, so that the next lookups
+        // see files that changed since. Called at the start of every run, before any file is read.
+        void refresh();
+
+        size_t hitCount() const { return mHitCount; }
+
+    private:
+        struct Dependency {
+            std::string mPath;
+            FileStamp   mStamp;
+        };
+
+        struct Record {
+            uint64_t                           mConfigHash = 0;
+            std::vector<Dependency>            mDependencies;
+            std::vector<SigDatabase::SigEntry> mEntries;
+            bool                               mUsed = false;
+        };
+
+        // Stats a file once per run.
+        FileStamp stat(const std::string &path);
+
+        mutable std::mutex                                 mMutex;
+        std::map<std::pair<std::string, uint64_t>, Record> mRecords;
+        std::mutex                                         mStampMutex;
+        std::unordered_map<std::string, FileStamp>         mStamps;
+        size_t                                             mHitCount = 0;
+        // Stamps with an mtime from this point on are stored untrusted. Set by refresh().
+        int64_t                                            mTrustedBefore = std::numeric_limits<int64_t>::min();
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
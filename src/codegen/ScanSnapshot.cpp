@@ -0,0 +1,112 @@
+#include "ScanSnapshot.h"
+#include "../util/FsHelper.h"
+
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <exception>
+
+namespace sapphire::codegen {
+
+    static void writeStrings(std::ostream &fs, const std::vector<std::string> &strings) {
+        fshelper::write<uint64_t>(fs, strings.size());
+        for (auto &&string : strings)
+            fshelper::write(fs, string);
+    }
+
+    static void readStrings(fshelper::SpanReader &reader, std::vector<std::string> &strings) {
+        auto count = fshelper::read<uint64_t>(reader);
+        reader.expect(count, sizeof(uint64_t));
+        strings.reserve(count);
+        for (uint64_t i = 0; i < count; ++i)
+            strings.emplace_back(fshelper::read<std::string>(reader));
+    }
+
+    bool ScanSnapshot::load(const std::string &path, uint64_t key) {
+        mDirectories.clear();
+        mHeaders.clear();
+
+        // One read of the whole file, with every length and count checked against what is left.
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+        );
+        if (!buffer)
+            return false;
+        fshelper::SpanReader reader({(*buffer)->getBufferStart(), (*buffer)->getBufferSize()});
+        try {
+            if (fshelper::read<uint32_t>(reader) != MAGIC_NUMBER || fshelper::read<uint32_t>(reader) != FORMAT_VERSION
+                || fshelper::read<uint64_t>(reader) != key)
+                return false;
+            auto directoryCount = fshelper::read<uint64_t>(reader);
+            // Path length, mtime and two counts.
+            reader.expect(directoryCount, 4 * sizeof(uint64_t));
+            for (uint64_t i = 0; i < directoryCount; ++i) {
+                auto      path = fshelper::read<std::string>(reader);
+                Directory directory;
+                directory.mMTime = fshelper::read<int64_t>(reader);
+                readStrings(reader, directory.mSubdirectories);
+                readStrings(reader, directory.mHeaders);
+                mDirectories.emplace(std::move(path), std::move(directory));
+            }
+            auto headerCount = fshelper::read<uint64_t>(reader);
+            // Path length, size, mtime and two counts.
+            reader.expect(headerCount, 5 * sizeof(uint64_t));
+            for (uint64_t i = 0; i < headerCount; ++i) {
+                auto   path = fshelper::read<std::string>(reader);
+                Header header;
+                header.mSize = fshelper::read<uint64_t>(reader);
+                header.mMTime = fshelper::read<int64_t>(reader);
+                auto offsetCount = fshelper::read<uint64_t>(reader);
+                reader.expect(offsetCount, sizeof(uint32_t));
+                header.mTokenOffsets.reserve(offsetCount);
+                for (uint64_t j = 0; j < offsetCount; ++j)
+                    header.mTokenOffsets.push_back(fshelper::read<uint32_t>(reader));
+                auto versionCount = fshelper::read<uint64_t>(reader);
+                reader.expect(versionCount, sizeof(uint64_t));
+                header.mActiveVersions.reserve(versionCount);
+                for (uint64_t j = 0; j < versionCount; ++j)
+                    header.mActiveVersions.push_back(fshelper::read<uint64_t>(reader));
+                mHeaders.emplace(std::move(path), std::move(header));
+            }
+            return true;
+        } catch (std::exception &e) {
+            llvm::errs() << llvm::formatv("[Scan] Warning: Failed to load {0}: {1}\n", path, e.what());
+        }
+        mDirectories.clear();
+        mHeaders.clear();
+        return false;
+    }
+
+    bool ScanSnapshot::save(const std::string &path, uint64_t key) const {
+        std::ofstream fs(path, std::ios::binary);
+        if (!fs.is_open()) {
+            llvm::errs() << llvm::formatv("[Scan] Warning: Cannot write to {0}\n", path);
+            return false;
+        }
+
+        fshelper::write(fs, MAGIC_NUMBER);
+        fshelper::write(fs, FORMAT_VERSION);
+        fshelper::write(fs, key);
+        fshelper::write<uint64_t>(fs, mDirectories.size());
+        for (auto &&[directoryPath, directory] : mDirectories) {
+            fshelper::write(fs, directoryPath);
+            fshelper::write(fs, directory.mMTime);
+            writeStrings(fs, directory.mSubdirectories);
+            writeStrings(fs, directory.mHeaders);
+        }
+        fshelper::write<uint64_t>(fs, mHeaders.size());
+        for (auto &&[headerPath, header] : mHeaders) {
+            fshelper::write(fs, headerPath);
+            fshelper::write(fs, header.mSize);
+            fshelper::write(fs, header.mMTime);
+            fshelper::write<uint64_t>(fs, header.mTokenOffsets.size());
+            for (auto offset : header.mTokenOffsets)
+                fshelper::write(fs, offset);
+            fshelper::write<uint64_t>(fs, header.mActiveVersions.size());
+            for (auto version : header.mActiveVersions)
+                fshelper::write(fs, version);
+        }
+        return fs.good();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // What a scan of the source directories found, so that the next scan can reuse the listing
+    // of every directory and the token filter result of every header that did not change since.
+    // Entries modified shortly before the scan are recorded as untrusted, since a change within
+    // the same timestamp tick would go unnoticed.
+    struct ScanSnapshot {
+        static constexpr uint32_t MAGIC_NUMBER = 0x4e414353; // "SCAN"
+        static constexpr uint32_t FORMAT_VERSION = 2;
+        static constexpr int64_t  UNTRUSTED_MTIME = std::numeric_limits<int64_t>::min();
+
+        // Headers and subdirectories of a directory, valid while its mtime is unchanged.
+        struct Directory {
+            int64_t                  mMTime = UNTRUSTED_MTIME;
+            std::vector<std::string> mSubdirectories;
+            std::vector<std::string> mHeaders;
+        };
+
+        // Token offsets of a header and the target versions its annotations are active for, valid
+        // while its size and mtime are unchanged. Empty if the header does not contain the token.
+        struct Header {
+            uint64_t              mSize = 0;
+            int64_t               mMTime = UNTRUSTED_MTIME;
+            std::vector<uint32_t> mTokenOffsets;
+            std::vector<uint64_t> mActiveVersions;
+        };
+
+        // Loads a snapshot saved with the same key, which identifies the token, the header
+        // filters and the target versions. A missing, corrupted or outdated file or another key
+        // yields an empty snapshot.
+        bool load(const std::string &path, uint64_t key);
+
+        bool save(const std::string &path, uint64_t key) const;
+
+        std::unordered_map<std::string, Directory> mDirectories;
+        std::unordered_map<std::string, Header>    mHeaders;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
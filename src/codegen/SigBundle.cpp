@@ -0,0 +1,313 @@
+#include "SigBundle.h"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+
+namespace sapphire::codegen {
+
+    namespace {
+
+        // A bundle starts with a BundleHeader and a SectionRecord for each SectionKind in order,
+        // followed by the sections at 8-byte aligned offsets. Strings in the string and pattern
+        // pools are followed by a null byte that their size does not count. Integers are
+        // little-endian.
+        enum class SectionKind : uint32_t {
+            // Symbols and extra symbols.
+            Strings,
+            // Signature bytes.
+            Patterns,
+            // sigdb::EntryRecord, whose mSig refers to the pattern pool.
+            Entries,
+            // sigdb::OpRecord.
+            Operations,
+            // VersionRecord of each version, in ascending order.
+            Versions,
+            // Indices into Entries, listed by VersionRecord.
+            VersionEntries,
+            _count,
+        };
+        constexpr uint32_t SECTION_COUNT = static_cast<uint32_t>(SectionKind::_count);
+
+        struct BundleHeader {
+            uint32_t mMagic;
+            uint32_t mFormatVersion;
+            uint32_t mSectionCount;
+            uint32_t mReserved;
+        };
+
+        struct SectionRecord {
+            uint32_t mKind;
+            uint32_t mCompression;
+            uint64_t mOffset;
+            uint64_t mStoredSize;
+            uint64_t mSize;
+        };
+
+        struct VersionRecord {
+            uint64_t mVersion;
+            uint32_t mFirstIndex;
+            uint32_t mCount;
+        };
+
+        static_assert(sizeof(BundleHeader) == 16 && sizeof(SectionRecord) == 32 && sizeof(VersionRecord) == 16);
+
+        std::optional<llvm::compression::Format> getFormat(SigBundle::Compression compression) {
+            switch (compression) {
+            case SigBundle::Compression::Zlib:
+                return llvm::compression::Format::Zlib;
+            case SigBundle::Compression::Zstd:
+                return llvm::compression::Format::Zstd;
+            default:
+                return std::nullopt;
+            }
+        }
+
+        template <typename T>
+        std::string toBytes(const std::vector<T> &records) {
+            return std::string(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(T));
+        }
+
+        template <typename T>
+        bool fromBytes(const std::string &bytes, std::vector<T> &records) {
+            if (bytes.size() % sizeof(T) != 0)
+                return false;
+            records.resize(bytes.size() / sizeof(T));
+            std::memcpy(records.data(), bytes.data(), bytes.size());
+            return true;
+        }
+
+    } // namespace
+
+    bool SigBundle::write(
+        const std::string &path, const std::map<uint64_t, SigDatabase> &databases, Compression compression
+    ) {
+        std::string                     strings, patterns;
+        llvm::StringMap<uint32_t>       stringOffsets, patternOffsets;
+        std::vector<sigdb::EntryRecord> entries;
+        std::vector<sigdb::OpRecord>    ops;
+        std::vector<VersionRecord>      versions;
+        std::vector<uint32_t>           versionEntries;
+        // Index of each distinct entry, keyed by the bytes of its record and operations.
+        std::unordered_map<std::string, uint32_t> entryIndices;
+
+        auto addString = [](std::string &pool, llvm::StringMap<uint32_t> &offsets, llvm::StringRef str) {
+            auto [found, inserted] = offsets.try_emplace(str, static_cast<uint32_t>(pool.size()));
+            if (inserted) {
+                pool.append(str.begin(), str.end());
+                pool.push_back('\0');
+            }
+            return sigdb::StringRecord{found->second, static_cast<uint32_t>(str.size())};
+        };
+
+        for (auto &&[version, sigDatabase] : databases) {
+            VersionRecord versionRecord{version, static_cast<uint32_t>(versionEntries.size()), 0};
+            for (auto &&entry : sigDatabase.getSigEntries()) {
+                sigdb::EntryRecord record{};
+                record.mSymbol = addString(strings, stringOffsets, entry.mSymbol);
+                record.mExtraSymbol = addString(
+                    strings, stringOffsets, entry.hasExtraSymbol() ? llvm::StringRef(entry.mExtraSymbol) : ""
+                );
+                record.mSig = addString(patterns, patternOffsets, entry.mSig);
+                record.mOpCount = static_cast<uint32_t>(entry.mOperations.size());
+                record.mType = static_cast<int8_t>(entry.mType);
+
+                std::vector<sigdb::OpRecord> entryOps;
+                for (auto &&op : entry.mOperations)
+                    entryOps.push_back(sigdb::toOpRecord(op));
+                auto key = std::string(reinterpret_cast<const char *>(&record), sizeof(record)) + toBytes(entryOps);
+                auto [found, inserted] =
+                    entryIndices.try_emplace(std::move(key), static_cast<uint32_t>(entries.size()));
+                if (inserted) {
+                    record.mFirstOp = static_cast<uint32_t>(ops.size());
+                    ops.insert(ops.end(), entryOps.begin(), entryOps.end());
+                    entries.push_back(record);
+                }
+                versionEntries.push_back(found->second);
+            }
+            versionRecord.mCount = static_cast<uint32_t>(versionEntries.size() - versionRecord.mFirstIndex);
+            versions.push_back(versionRecord);
+        }
+        if (strings.size() > UINT32_MAX || patterns.size() > UINT32_MAX || ops.size() > UINT32_MAX
+            || versionEntries.size() > UINT32_MAX) {
+            llvm::errs() << llvm::formatv("[Bundle] Error: Too many entries for a bundle: {0}\n", path);
+            return false;
+        }
+
+        auto format = getFormat(compression);
+        if (format) {
+            if (auto reason = llvm::compression::getReasonIfUnsupported(*format)) {
+                llvm::errs() << llvm::formatv("[Bundle] Warning: {0}, writing uncompressed sections.\n", reason);
+                format.reset();
+            }
+        }
+
+        std::string sections[SECTION_COUNT] = {
+            std::move(strings),
+            std::move(patterns),
+            toBytes(entries),
+            toBytes(ops),
+            toBytes(versions),
+            toBytes(versionEntries),
+        };
+        BundleHeader  header{MAGIC_NUMBER, FORMAT_VERSION, SECTION_COUNT, 0};
+        SectionRecord records[SECTION_COUNT];
+        std::string   stored[SECTION_COUNT];
+        uint64_t      offset = sizeof(header) + sizeof(records);
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+            records[i] = {i, static_cast<uint32_t>(Compression::None), 0, sections[i].size(), sections[i].size()};
+            stored[i] = std::move(sections[i]);
+            if (format && !stored[i].empty()) {
+                // Pools and tables are written once and read many times, so size wins over speed.
+                llvm::SmallVector<uint8_t, 0> compressed;
+                int level = *format == llvm::compression::Format::Zlib ? llvm::compression::zlib::BestSizeCompression
+                                                                       : llvm::compression::zstd::BestSizeCompression;
+                llvm::compression::compress({*format, level}, llvm::arrayRefFromStringRef(stored[i]), compressed);
+                if (compressed.size() < stored[i].size()) {
+                    records[i].mCompression = static_cast<uint32_t>(compression);
+                    records[i].mStoredSize = compressed.size();
+                    stored[i].assign(compressed.begin(), compressed.end());
+                }
+            }
+            offset = llvm::alignTo(offset, alignof(uint64_t));
+            records[i].mOffset = offset;
+            offset += stored[i].size();
+        }
+
+        std::string data(offset, '\0');
+        std::memcpy(data.data(), &header, sizeof(header));
+        std::memcpy(data.data() + sizeof(header), records, sizeof(records));
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i)
+            std::memcpy(data.data() + records[i].mOffset, stored[i].data(), stored[i].size());
+
+        std::ofstream fs(path, std::ios::binary);
+        if (!fs.is_open() || !fs.write(data.data(), data.size())) {
+            llvm::errs() << llvm::formatv("[Bundle] Error: Cannot write to {0}\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    bool SigBundle::load(const std::string &path) {
+        *this = SigBundle();
+
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+        );
+        if (!buffer)
+            return false;
+        llvm::StringRef data = (*buffer)->getBuffer();
+
+        BundleHeader  header;
+        SectionRecord records[SECTION_COUNT];
+        if (data.size() < sizeof(header) + sizeof(records))
+            return false;
+        std::memcpy(&header, data.data(), sizeof(header));
+        std::memcpy(records, data.data() + sizeof(header), sizeof(records));
+        if (header.mMagic != MAGIC_NUMBER || header.mFormatVersion != FORMAT_VERSION
+            || header.mSectionCount != SECTION_COUNT)
+            return false;
+
+        std::string sections[SECTION_COUNT];
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+            auto &record = records[i];
+            // Offsets in the sections are 32-bit, which also bounds what a corrupted size allocates.
+            if (record.mKind != i || record.mOffset > data.size() || record.mStoredSize > data.size() - record.mOffset
+                || record.mSize > UINT32_MAX)
+                return false;
+            auto storedData = data.substr(record.mOffset, record.mStoredSize);
+            if (record.mCompression == static_cast<uint32_t>(Compression::None)) {
+                if (record.mSize != record.mStoredSize)
+                    return false;
+                sections[i] = storedData.str();
+                continue;
+            }
+            auto format = getFormat(static_cast<Compression>(record.mCompression));
+            if (!format)
+                return false;
+            if (auto reason = llvm::compression::getReasonIfUnsupported(*format)) {
+                llvm::errs() << llvm::formatv("[Bundle] Error: Cannot load {0}: {1}\n", path, reason);
+                return false;
+            }
+            llvm::SmallVector<uint8_t, 0> decompressed;
+            if (auto error = llvm::compression::decompress(
+                    *format, llvm::arrayRefFromStringRef(storedData), decompressed, record.mSize
+                )) {
+                llvm::errs() << llvm::formatv(
+                    "[Bundle] Error: Cannot load {0}: {1}\n", path, llvm::toString(std::move(error))
+                );
+                return false;
+            }
+            sections[i].assign(decompressed.begin(), decompressed.end());
+        }
+
+        std::vector<VersionRecord> versions;
+        mStrings = std::move(sections[static_cast<uint32_t>(SectionKind::Strings)]);
+        mPatterns = std::move(sections[static_cast<uint32_t>(SectionKind::Patterns)]);
+        bool valid = fromBytes(sections[static_cast<uint32_t>(SectionKind::Entries)], mEntries)
+                  && fromBytes(sections[static_cast<uint32_t>(SectionKind::Operations)], mOps)
+                  && fromBytes(sections[static_cast<uint32_t>(SectionKind::Versions)], versions)
+                  && fromBytes(sections[static_cast<uint32_t>(SectionKind::VersionEntries)], mVersionEntries);
+
+        // Checked once here, so that extract() needs no checks.
+        auto isValidString = [](const std::string &pool, const sigdb::StringRecord &record) {
+            return record.mOffset <= pool.size() && record.mSize < pool.size() - record.mOffset
+                && pool[record.mOffset + record.mSize] == '\0';
+        };
+        for (size_t i = 0; valid && i < mEntries.size(); ++i) {
+            auto &entry = mEntries[i];
+            valid = isValidString(mStrings, entry.mSymbol) && isValidString(mStrings, entry.mExtraSymbol)
+                 && isValidString(mPatterns, entry.mSig) && entry.mFirstOp <= mOps.size()
+                 && entry.mOpCount <= mOps.size() - entry.mFirstOp;
+        }
+        for (size_t i = 0; valid && i < mVersionEntries.size(); ++i)
+            valid = mVersionEntries[i] < mEntries.size();
+        for (size_t i = 0; valid && i < versions.size(); ++i) {
+            auto &version = versions[i];
+            valid = version.mFirstIndex <= mVersionEntries.size()
+                 && version.mCount <= mVersionEntries.size() - version.mFirstIndex
+                 && mVersions.try_emplace(version.mVersion, version.mFirstIndex, version.mCount).second;
+        }
+        if (!valid) {
+            *this = SigBundle();
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<uint64_t> SigBundle::versions() const {
+        std::vector<uint64_t> result;
+        for (auto &&[version, range] : mVersions)
+            result.push_back(version);
+        return result;
+    }
+
+    bool SigBundle::extract(uint64_t version, SigDatabase &sigDatabase) const {
+        auto found = mVersions.find(version);
+        if (found == mVersions.end())
+            return false;
+        auto [firstIndex, count] = found->second;
+        for (uint32_t i = firstIndex; i < firstIndex + count; ++i) {
+            auto                 &record = mEntries[mVersionEntries[i]];
+            SigDatabase::SigEntry entry;
+            entry.mType = static_cast<SigDatabase::SigEntry::Type>(record.mType);
+            entry.mSymbol = mStrings.substr(record.mSymbol.mOffset, record.mSymbol.mSize);
+            entry.mExtraSymbol = mStrings.substr(record.mExtraSymbol.mOffset, record.mExtraSymbol.mSize);
+            entry.mSig = mPatterns.substr(record.mSig.mOffset, record.mSig.mSize);
+            entry.mOperations.reserve(record.mOpCount);
+            for (uint32_t j = 0; j < record.mOpCount; ++j)
+                entry.mOperations.emplace_back(sigdb::toSigOp(mOps[record.mFirstOp + j]));
+            sigDatabase.addSigEntry(std::move(entry));
+        }
+        return true;
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "SigDatabase.h"
+#include "SigDatabaseView.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // The databases of several versions in a single file. Symbols, signature patterns and whole
+    // entries that are the same in several versions are stored once, and each version lists the
+    // entries it has. Each section is compressed with zlib or zstd if LLVM was built with it and
+    // compressing makes the section smaller.
+    class SigBundle {
+    public:
+        static constexpr uint32_t MAGIC_NUMBER = 0x42474953; // "SIGB"
+        static constexpr uint32_t FORMAT_VERSION = 1;
+
+        enum class Compression : uint32_t {
+            None,
+            Zlib,
+            Zstd,
+        };
+
+        // Writes the entries of every database. Sections are stored uncompressed if LLVM does not
+        // support the compression.
+        static bool
+        write(const std::string &path, const std::map<uint64_t, SigDatabase> &databases, Compression compression);
+
+        // Reads and decompresses a bundle. Returns false if it is missing, corrupted or uses a
+        // compression LLVM does not support.
+        bool load(const std::string &path);
+
+        // Versions in the loaded bundle, in ascending order.
+        std::vector<uint64_t> versions() const;
+
+        // Adds the entries of a version to sigDatabase. Returns false if the bundle does not
+        // have the version.
+        bool extract(uint64_t version, SigDatabase &sigDatabase) const;
+
+    private:
+        std::string                                       mStrings;
+        std::string                                       mPatterns;
+        std::vector<sigdb::EntryRecord>                   mEntries;
+        std::vector<sigdb::OpRecord>                      mOps;
+        std::vector<uint32_t>                             mVersionEntries;
+        // First index into mVersionEntries and entry count of each version.
+        std::map<uint64_t, std::pair<uint32_t, uint32_t>> mVersions;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
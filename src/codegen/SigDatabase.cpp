@@ -1,40 +1,21 @@
 #include "SigDatabase.h"
+#include "SigDatabaseView.h"
+#include "../util/FsHelper.h"
 
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MathExtras.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <exception>
+#include <tuple>
 
 namespace sapphire::codegen {
 
     namespace fshelper {
 
-        template <typename T, std::enable_if_t<std::is_scalar_v<T>, char> = 0>
-        auto read(std::ifstream &fs) {
-            T result;
-            fs.read(reinterpret_cast<char *>(&result), sizeof(T));
-            return result;
-        }
-
-        template <typename T, typename = std::enable_if_t<std::is_scalar_v<T>>>
-        void write(std::ofstream &fs, T s) {
-            fs.write(reinterpret_cast<char *>(&s), sizeof(T));
-        }
-
-        template <typename T, std::enable_if_t<std::is_same_v<T, std::string>, char> = 0>
-        auto read(std::ifstream &fs) {
-            std::string    result;
-            const uint64_t length = fshelper::read<uint64_t>(fs);
-            result.resize(length);
-            fs.read(result.data(), length);
-            return result;
-        }
-
-        void write(std::ofstream &fs, const std::string &s) {
-            write<uint64_t>(fs, s.size());
-            fs.write(s.data(), s.size());
-        }
-
-        template <typename T, std::enable_if_t<std::is_same_v<T, SigDatabase::SigOp>, char> = 0>
-        auto read(std::ifstream &fs) {
+        template <typename T, typename Source, std::enable_if_t<std::is_same_v<T, SigDatabase::SigOp>, char> = 0>
+        auto read(Source &fs) {
             SigDatabase::SigOp result;
             result.opType = fshelper::read<SigDatabase::SigOpType>(fs);
             switch (result.opType) {
@@ -58,51 +39,178 @@ namespace sapphire::codegen {
             return result;
         }
 
-        void write(std::ofstream &fs, SigDatabase::SigOp s) {
-            fs.write(reinterpret_cast<char *>(&s.opType), sizeof(s.opType));
+        void write(std::string &buffer, SigDatabase::SigOp s) {
+            write(buffer, s.opType);
             switch (s.opType) {
             case SigDatabase::SigOpType::Disp:
-                fs.write(reinterpret_cast<char *>(&s.data), sizeof(s.data));
+                write(buffer, s.data.disp);
                 break;
             case SigDatabase::SigOpType::RipRel:
-                fs.write(reinterpret_cast<char *>(&s.data.ripRel.offset), sizeof(s.data.ripRel.offset));
-                fs.write(reinterpret_cast<char *>(&s.data.ripRel.insLen), sizeof(s.data.ripRel.insLen));
+                write(buffer, s.data.ripRel.offset);
+                write(buffer, s.data.ripRel.insLen);
                 break;
             default:
                 break;
             }
         }
 
+        // Reads an entry from a stream or from a SpanReader, which also rejects an operation
+        // count that the rest of the data cannot hold.
+        template <typename T, typename Source, std::enable_if_t<std::is_same_v<T, SigDatabase::SigEntry>, char> = 0>
+        auto read(Source &fs) {
+            SigDatabase::SigEntry sigEntry;
+            sigEntry.mType = fshelper::read<SigDatabase::SigEntry::Type>(fs);
+            sigEntry.mSymbol = fshelper::read<std::string>(fs);
+            if (sigEntry.hasExtraSymbol())
+                sigEntry.mExtraSymbol = fshelper::read<std::string>(fs);
+            sigEntry.mSig = fshelper::read<std::string>(fs);
+            size_t sigOpCount = fshelper::read<size_t>(fs);
+            if constexpr (std::is_same_v<Source, SpanReader>)
+                fs.expect(sigOpCount, sizeof(SigDatabase::SigOpType));
+            if (sigOpCount) {
+                sigEntry.mOperations.reserve(sigOpCount);
+                for (size_t j = 0; j < sigOpCount; ++j) {
+                    sigEntry.mOperations.emplace_back(fshelper::read<SigDatabase::SigOp>(fs));
+                }
+            }
+            return sigEntry;
+        }
+
+        void write(std::string &buffer, const SigDatabase::SigEntry &sigEntry) {
+            write(buffer, sigEntry.mType);
+            write(buffer, sigEntry.mSymbol);
+            if (sigEntry.hasExtraSymbol()) {
+                write(buffer, sigEntry.mExtraSymbol);
+            }
+            write(buffer, sigEntry.mSig);
+            write(buffer, sigEntry.mOperations.size());
+            for (auto &&op : sigEntry.mOperations) {
+                write(buffer, op);
+            }
+        }
+
     } // namespace fshelper
 
-    bool SigDatabase::load(std::ifstream &fs) {
+    // Lays out a database in the v2_0_0 format.
+    static std::string
+    buildIndexedDatabase(uint64_t supportVersion, const std::vector<SigDatabase::SigEntry> &entries) {
+        if (entries.size() >= UINT32_MAX)
+            throw std::runtime_error{"Too many sig entries for the indexed format"};
+
+        std::string               strings;
+        llvm::StringMap<uint32_t> stringOffsets;
+
+        auto addString = [&](llvm::StringRef str) -> sigdb::StringRecord {
+            auto [found, inserted] = stringOffsets.try_emplace(str, static_cast<uint32_t>(strings.size()));
+            if (inserted) {
+                strings.append(str.begin(), str.end());
+                strings.push_back('\0');
+                if (strings.size() > UINT32_MAX)
+                    throw std::runtime_error{"String table too large for the indexed format"};
+            }
+            return {found->second, static_cast<uint32_t>(str.size())};
+        };
+
+        std::vector<sigdb::EntryRecord> entryRecords;
+        std::vector<sigdb::OpRecord>    opRecords;
+        entryRecords.reserve(entries.size());
+        for (auto &&entry : entries) {
+            sigdb::EntryRecord record{};
+            record.mSymbol = addString(entry.mSymbol);
+            record.mExtraSymbol = addString(entry.hasExtraSymbol() ? llvm::StringRef(entry.mExtraSymbol) : "");
+            record.mSig = addString(entry.mSig);
+            record.mFirstOp = static_cast<uint32_t>(opRecords.size());
+            record.mOpCount = static_cast<uint32_t>(entry.mOperations.size());
+            record.mType = static_cast<int8_t>(entry.mType);
+            for (auto &&op : entry.mOperations)
+                opRecords.push_back(sigdb::toOpRecord(op));
+            if (opRecords.size() >= UINT32_MAX)
+                throw std::runtime_error{"Too many sig operations for the indexed format"};
+            entryRecords.push_back(record);
+        }
+
+        // At most half full, so that probes stay short.
+        uint64_t              minBucketCount = std::max<uint64_t>(entries.size() * 2, 1);
+        auto                  bucketCount = static_cast<uint32_t>(llvm::PowerOf2Ceil(minBucketCount));
+        std::vector<uint32_t> buckets(bucketCount, sigdb::EMPTY_BUCKET);
+        for (uint32_t i = 0; i < entryRecords.size(); ++i) {
+            auto bucket = sigdb::hashSymbol(entries[i].mSymbol) & (bucketCount - 1);
+            while (buckets[bucket] != sigdb::EMPTY_BUCKET)
+                bucket = (bucket + 1) & (bucketCount - 1);
+            buckets[bucket] = i;
+        }
+
+        sigdb::FileHeader header{};
+        header.mMagic = SigDatabase::MAGIC_NUMBER;
+        header.mFormatVersion = static_cast<int32_t>(SigDatabase::FormatVersion::v2_0_0);
+        header.mSupportVersion = supportVersion;
+        header.mEntryCount = static_cast<uint32_t>(entryRecords.size());
+        header.mOpCount = static_cast<uint32_t>(opRecords.size());
+        header.mBucketCount = bucketCount;
+        header.mStringTableSize = static_cast<uint32_t>(strings.size());
+        header.mStringTableOffset = llvm::alignTo(sizeof(header), alignof(uint64_t));
+        header.mEntryOffset = llvm::alignTo(header.mStringTableOffset + strings.size(), alignof(uint64_t));
+        header.mOpOffset = header.mEntryOffset + entryRecords.size() * sizeof(sigdb::EntryRecord);
+        header.mBucketOffset = header.mOpOffset + opRecords.size() * sizeof(sigdb::OpRecord);
+
+        std::string result(header.mBucketOffset + buckets.size() * sizeof(uint32_t), '\0');
+        std::memcpy(result.data(), &header, sizeof(header));
+        std::memcpy(result.data() + header.mStringTableOffset, strings.data(), strings.size());
+        std::memcpy(
+            result.data() + header.mEntryOffset, entryRecords.data(), entryRecords.size() * sizeof(sigdb::EntryRecord)
+        );
+        std::memcpy(result.data() + header.mOpOffset, opRecords.data(), opRecords.size() * sizeof(sigdb::OpRecord));
+        std::memcpy(result.data() + header.mBucketOffset, buckets.data(), buckets.size() * sizeof(uint32_t));
+        return result;
+    }
+
+    SigDatabase::SigEntry SigDatabase::readSigEntry(std::istream &fs) {
+        return fshelper::read<SigEntry>(fs);
+    }
+
+    SigDatabase::SigEntry SigDatabase::readSigEntry(fshelper::SpanReader &reader) {
+        return fshelper::read<SigEntry>(reader);
+    }
+
+    void SigDatabase::writeSigEntry(std::ostream &fs, const SigEntry &sigEntry) {
+        std::string buffer;
+        fshelper::write(buffer, sigEntry);
+        fs.write(buffer.data(), buffer.size());
+    }
+
+    bool SigDatabase::load(std::ifstream &fs, bool allowEmpty) {
         try {
-            auto magicNum = fshelper::read<uint32_t>(fs);
+            // One read of the rest of the file instead of one per field, into memory aligned as
+            // the indexed format expects it.
+            auto begin = fs.tellg();
+            if (begin < 0 || !fs.seekg(0, std::ios::end))
+                return false;
+            auto size = static_cast<size_t>(fs.tellg() - begin);
+            fs.seekg(begin);
+            auto buffer = llvm::WritableMemoryBuffer::getNewUninitMemBuffer(size);
+            if (!buffer || !fs.read(buffer->getBufferStart(), size))
+                return false;
+            llvm::StringRef data(buffer->getBufferStart(), size);
+
+            fshelper::SpanReader reader({data.data(), data.size()});
+            if (reader.remaining() < sizeof(uint32_t) + sizeof(FormatVersion))
+                return false;
+            auto magicNum = fshelper::read<uint32_t>(reader);
             if (magicNum != SigDatabase::MAGIC_NUMBER)
                 return false;
-            mFormatVersion = fshelper::read<FormatVersion>(fs);
+            mFormatVersion = fshelper::read<FormatVersion>(reader);
+            if (mFormatVersion == FormatVersion::v2_0_0)
+                return loadIndexed(data, allowEmpty);
             if (mSupportVersion == 0)
-                mSupportVersion = fshelper::read<uint64_t>(fs);
-            else if (mSupportVersion != fshelper::read<uint64_t>(fs))
+                mSupportVersion = fshelper::read<uint64_t>(reader);
+            else if (mSupportVersion != fshelper::read<uint64_t>(reader))
                 return false;
-            auto sigCount = fshelper::read<size_t>(fs);
-            if (!sigCount) return false;
+            auto sigCount = fshelper::read<size_t>(reader);
+            if (!sigCount) return allowEmpty;
+            reader.expect(sigCount, MIN_SIG_ENTRY_SIZE);
             mSigEntries.reserve(sigCount);
             for (size_t i = 0; i < sigCount; ++i) {
-                SigEntry sigEntry;
-                sigEntry.mType = fshelper::read<SigEntry::Type>(fs);
-                sigEntry.mSymbol = fshelper::read<std::string>(fs);
-                if (sigEntry.hasExtraSymbol())
-                    sigEntry.mExtraSymbol = fshelper::read<std::string>(fs);
-                sigEntry.mSig = fshelper::read<std::string>(fs);
-                size_t sigOpCount = fshelper::read<size_t>(fs);
-                if (sigOpCount) {
-                    sigEntry.mOperations.reserve(sigOpCount);
-                    for (size_t j = 0; j < sigOpCount; ++j) {
-                        sigEntry.mOperations.emplace_back(fshelper::read<SigOp>(fs));
-                    }
-                }
-                mSigEntries.emplace_back(std::move(sigEntry));
+                mSigEntries.emplace_back(fshelper::read<SigEntry>(reader));
             }
             return true;
         } catch (std::exception &e) {
@@ -113,25 +221,40 @@ namespace sapphire::codegen {
         return false;
     }
 
-    bool SigDatabase::save(std::ofstream &fs) const {
+    bool SigDatabase::loadIndexed(llvm::StringRef data, bool allowEmpty) {
+        SigDatabaseView view;
+        if (!view.attach(data)) {
+            std::cerr << "[Error] invalid indexed sig file\n";
+            return false;
+        }
+        if (mSupportVersion == 0)
+            mSupportVersion = view.supportVersion();
+        else if (mSupportVersion != view.supportVersion())
+            return false;
+        if (!view.size()) return allowEmpty;
+        mSigEntries.reserve(view.size());
+        for (size_t i = 0; i < view.size(); ++i) {
+            mSigEntries.emplace_back(view.entry(i).toSigEntry());
+        }
+        return true;
+    }
+
+    bool SigDatabase::save(std::ofstream &fs, FormatVersion fmtVer) const {
         try {
-            fshelper::write(fs, SigDatabase::MAGIC_NUMBER);
-            fshelper::write(fs, mFormatVersion);
-            fshelper::write(fs, mSupportVersion);
-            fshelper::write(fs, mSigEntries.size());
-            for (auto &&it : mSigEntries) {
-                fshelper::write(fs, it.mType);
-                fshelper::write(fs, it.mSymbol);
-                if (it.hasExtraSymbol()) {
-                    fshelper::write(fs, it.mExtraSymbol);
-                }
-                fshelper::write(fs, it.mSig);
-                fshelper::write(fs, it.mOperations.size());
-                for (auto &&op : it.mOperations) {
-                    fshelper::write(fs, op);
+            std::string data;
+            if (fmtVer == FormatVersion::v2_0_0) {
+                data = buildIndexedDatabase(mSupportVersion, mSigEntries);
+            } else {
+                fshelper::write(data, SigDatabase::MAGIC_NUMBER);
+                fshelper::write(data, fmtVer);
+                fshelper::write(data, mSupportVersion);
+                fshelper::write(data, mSigEntries.size());
+                for (auto &&it : mSigEntries) {
+                    fshelper::write(data, it);
                 }
             }
-            return true;
+            fs.write(data.data(), data.size());
+            return fs.good();
         } catch (std::exception &e) {
             std::cerr << "[Error] error while saving sig file, msg: " << e.what() << '\n';
         } catch (...) {
@@ -140,6 +263,43 @@ namespace sapphire::codegen {
         return false;
     }
 
+    void SigDatabase::merge(SigDatabase &&other) {
+        if (mSigEntries.empty()) {
+            mSigEntries = std::move(other.mSigEntries);
+            return;
+        }
+        mSigEntries.reserve(mSigEntries.size() + other.mSigEntries.size());
+        std::move(other.mSigEntries.begin(), other.mSigEntries.end(), std::back_inserter(mSigEntries));
+        other.mSigEntries.clear();
+    }
+
+    static std::pair<SigDatabase::SigOpType, int64_t> sigOpKey(const SigDatabase::SigOp &op) {
+        switch (op.opType) {
+        case SigDatabase::SigOpType::Disp:
+            return {op.opType, static_cast<int64_t>(op.data.disp)};
+        case SigDatabase::SigOpType::RipRel:
+            return {op.opType, (static_cast<int64_t>(op.data.ripRel.offset) << 32) | op.data.ripRel.insLen};
+        default:
+            return {op.opType, 0};
+        }
+    }
+
+    void SigDatabase::sortEntries() {
+        std::sort(mSigEntries.begin(), mSigEntries.end(), [](const SigEntry &lhs, const SigEntry &rhs) {
+            auto lhsKey = std::tie(lhs.mSymbol, lhs.mType, lhs.mExtraSymbol, lhs.mSig);
+            auto rhsKey = std::tie(rhs.mSymbol, rhs.mType, rhs.mExtraSymbol, rhs.mSig);
+            if (lhsKey != rhsKey)
+                return lhsKey < rhsKey;
+            return std::lexicographical_compare(
+                lhs.mOperations.begin(),
+                lhs.mOperations.end(),
+                rhs.mOperations.begin(),
+                rhs.mOperations.end(),
+                [](const SigOp &l, const SigOp &r) { return sigOpKey(l) < sigOpKey(r); }
+            );
+        });
+    }
+
     std::string formatSig(const std::string &sig) {
         if (sig.empty()) return {};
         std::string result;
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <llvm/ADT/StringRef.h>
 #include <cstdint>
 #include <fstream>
+#include <string>
 #include <vector>
 
 namespace sapphire::codegen {
 
+    namespace fshelper {
+        class SpanReader;
+    }
+
     class SigDatabase {
     public:
         static constexpr uint32_t MAGIC_NUMBER = 0X3046FCDB; // crc32(".sig.db")
@@ -13,6 +19,8 @@ namespace sapphire::codegen {
         enum class FormatVersion : int32_t {
             v1_0_0,
             v1_1_0,
+            // Indexed layout that SigDatabaseView reads in place, see sigdb::FileHeader.
+            v2_0_0,
         };
 
         enum class SigOpType : int32_t {
@@ -70,16 +78,37 @@ namespace sapphire::codegen {
         SigDatabase(uint64_t supportVersion, FormatVersion fmtVer = FormatVersion::v1_1_0) :
             mFormatVersion(fmtVer), mSupportVersion(supportVersion) {}
 
-        bool load(std::ifstream &fs);
+        // Reads the rest of the file at once. A database without entries is rejected unless
+        // allowEmpty is set, and so is one whose lengths or counts exceed the file.
+        bool load(std::ifstream &fs, bool allowEmpty = false);
+
+        bool save(std::ofstream &fs) const { return save(fs, mFormatVersion); }
 
-        bool save(std::ofstream &fs) const;
+        // Saves in the given format instead of the one the database was created or loaded with.
+        // The file is serialized into memory and written at once.
+        bool save(std::ofstream &fs, FormatVersion fmtVer) const;
 
         void dump() const;
 
+        // Serializes a single entry in the layout used by load() and save().
+        static SigEntry readSigEntry(std::istream &fs);
+        static SigEntry readSigEntry(fshelper::SpanReader &reader);
+        static void     writeSigEntry(std::ostream &fs, const SigEntry &sigEntry);
+
+        // Bytes of a serialized entry with empty strings and no operations.
+        static constexpr size_t MIN_SIG_ENTRY_SIZE = sizeof(SigEntry::Type) + 3 * sizeof(uint64_t);
+
         void addSigEntry(SigEntry &&sig) {
-            mSigEntries.emplace_back(sig);
+            mSigEntries.emplace_back(std::move(sig));
         }
 
+        // Appends the entries of another database.
+        void merge(SigDatabase &&other);
+
+        // Orders the entries by symbol, type and content, so that the saved database does not
+        // depend on the order in which entries were added.
+        void sortEntries();
+
         size_t        size() const { return mSigEntries.size(); }
         FormatVersion formatVersion() const { return mFormatVersion; }
         uint64_t      supportVersion() const { return mSupportVersion; }
@@ -87,6 +116,8 @@ namespace sapphire::codegen {
         const std::vector<SigEntry> getSigEntries() const { return mSigEntries; }
 
     private:
+        bool loadIndexed(llvm::StringRef data, bool allowEmpty);
+
         FormatVersion         mFormatVersion;
         uint64_t              mSupportVersion;
         std::vector<SigEntry> mSigEntries;
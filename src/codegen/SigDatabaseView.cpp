@@ -0,0 +1,116 @@
+#include "SigDatabaseView.h"
+
+#include <llvm/Support/MathExtras.h>
+
+namespace sapphire::codegen {
+
+    SigDatabase::SigOp SigDatabaseView::Entry::operation(size_t index) const {
+        return sigdb::toSigOp(mView->mOps[mRecord->mFirstOp + index]);
+    }
+
+    SigDatabase::SigEntry SigDatabaseView::Entry::toSigEntry() const {
+        SigDatabase::SigEntry sigEntry;
+        sigEntry.mType = type();
+        sigEntry.mSymbol = symbol().str();
+        sigEntry.mExtraSymbol = extraSymbol().str();
+        sigEntry.mSig = sig().str();
+        sigEntry.mOperations.reserve(operationCount());
+        for (size_t i = 0; i < operationCount(); ++i)
+            sigEntry.mOperations.emplace_back(operation(i));
+        return sigEntry;
+    }
+
+    bool SigDatabaseView::open(const std::string &path) {
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText*/ false, /*RequiresNullTerminator*/ false, /*IsVolatile*/ false
+        );
+        if (!buffer || !attach((*buffer)->getBuffer()))
+            return false;
+        mBuffer = std::move(*buffer);
+        return true;
+    }
+
+    bool SigDatabaseView::attach(llvm::StringRef data) {
+        mBuffer.reset();
+        mHeader = nullptr;
+        if (reinterpret_cast<uintptr_t>(data.data()) % alignof(uint64_t) != 0
+            || data.size() < sizeof(sigdb::FileHeader))
+            return false;
+
+        auto header = reinterpret_cast<const sigdb::FileHeader *>(data.data());
+        if (header->mMagic != SigDatabase::MAGIC_NUMBER
+            || header->mFormatVersion != static_cast<int32_t>(SigDatabase::FormatVersion::v2_0_0))
+            return false;
+
+        // Sections must be aligned and lie within the data.
+        auto inBounds = [&](uint64_t offset, uint64_t count, uint64_t elementSize) {
+            return offset % alignof(uint64_t) == 0 && offset <= data.size()
+                && count <= (data.size() - offset) / elementSize;
+        };
+        if (!inBounds(header->mStringTableOffset, header->mStringTableSize, 1)
+            || !inBounds(header->mEntryOffset, header->mEntryCount, sizeof(sigdb::EntryRecord))
+            || !inBounds(header->mOpOffset, header->mOpCount, sizeof(sigdb::OpRecord))
+            || !inBounds(header->mBucketOffset, header->mBucketCount, sizeof(uint32_t))
+            || !llvm::isPowerOf2_32(header->mBucketCount) || header->mBucketCount <= header->mEntryCount)
+            return false;
+
+        auto strings = data.data() + header->mStringTableOffset;
+        auto entries = reinterpret_cast<const sigdb::EntryRecord *>(data.data() + header->mEntryOffset);
+        auto ops = reinterpret_cast<const sigdb::OpRecord *>(data.data() + header->mOpOffset);
+        auto buckets = reinterpret_cast<const uint32_t *>(data.data() + header->mBucketOffset);
+
+        // Checked once here, so that lookups need no checks.
+        auto isValidString = [&](const sigdb::StringRecord &record) {
+            return record.mOffset <= header->mStringTableSize
+                && record.mSize < header->mStringTableSize - record.mOffset
+                && strings[record.mOffset + record.mSize] == '\0';
+        };
+        for (uint32_t i = 0; i < header->mEntryCount; ++i) {
+            auto &entry = entries[i];
+            if (!isValidString(entry.mSymbol) || !isValidString(entry.mExtraSymbol) || !isValidString(entry.mSig)
+                || entry.mFirstOp > header->mOpCount || entry.mOpCount > header->mOpCount - entry.mFirstOp)
+                return false;
+        }
+        // A probe only ends at an empty bucket.
+        uint32_t emptyCount = 0;
+        for (uint32_t i = 0; i < header->mBucketCount; ++i) {
+            if (buckets[i] == sigdb::EMPTY_BUCKET)
+                ++emptyCount;
+            else if (buckets[i] >= header->mEntryCount)
+                return false;
+        }
+        if (!emptyCount)
+            return false;
+
+        mHeader = header;
+        mStrings = strings;
+        mEntries = entries;
+        mOps = ops;
+        mBuckets = buckets;
+        return true;
+    }
+
+    size_t SigDatabaseView::find(llvm::StringRef symbol) const {
+        if (!mHeader)
+            return npos;
+        const uint32_t mask = mHeader->mBucketCount - 1;
+        for (uint32_t bucket = sigdb::hashSymbol(symbol) & mask; mBuckets[bucket] != sigdb::EMPTY_BUCKET;
+             bucket = (bucket + 1) & mask) {
+            if (getString(mEntries[mBuckets[bucket]].mSymbol) == symbol)
+                return mBuckets[bucket];
+        }
+        return npos;
+    }
+
+    void SigDatabaseView::findAll(llvm::StringRef symbol, llvm::function_ref<void(size_t)> callback) const {
+        if (!mHeader)
+            return;
+        const uint32_t mask = mHeader->mBucketCount - 1;
+        for (uint32_t bucket = sigdb::hashSymbol(symbol) & mask; mBuckets[bucket] != sigdb::EMPTY_BUCKET;
+             bucket = (bucket + 1) & mask) {
+            if (getString(mEntries[mBuckets[bucket]].mSymbol) == symbol)
+                callback(mBuckets[bucket]);
+        }
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "SigDatabase.h"
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace sapphire::codegen {
+
+    // Layout of FormatVersion::v2_0_0, which is read in place instead of being deserialized. The
+    // fixed header is followed by the string table, the entries, the operations and the symbol
+    // index, each at an 8-byte aligned offset from the start of the file. Integers are
+    // little-endian. Strings are stored once and followed by a null byte that their size does
+    // not count.
+    namespace sigdb {
+
+        // Marks an empty bucket of the symbol index.
+        static constexpr uint32_t EMPTY_BUCKET = UINT32_MAX;
+
+        struct FileHeader {
+            uint32_t mMagic;
+            int32_t  mFormatVersion;
+            uint64_t mSupportVersion;
+            uint32_t mEntryCount;
+            uint32_t mOpCount;
+            // A power of two larger than the entry count, so that every probe ends.
+            uint32_t mBucketCount;
+            uint32_t mStringTableSize;
+            uint64_t mStringTableOffset;
+            uint64_t mEntryOffset;
+            uint64_t mOpOffset;
+            uint64_t mBucketOffset;
+        };
+
+        // A string in the string table.
+        struct StringRecord {
+            uint32_t mOffset;
+            uint32_t mSize;
+        };
+
+        struct EntryRecord {
+            StringRecord mSymbol;
+            StringRecord mExtraSymbol;
+            StringRecord mSig;
+            uint32_t     mFirstOp;
+            uint32_t     mOpCount;
+            int8_t       mType;
+            uint8_t      mReserved[7];
+        };
+
+        // mValue is the displacement of a Disp operation, and the offset in the low and the
+        // instruction length in the high 32 bits of a RipRel operation.
+        struct OpRecord {
+            int32_t  mType;
+            uint32_t mReserved;
+            int64_t  mValue;
+        };
+
+        static_assert(sizeof(FileHeader) == 64 && sizeof(EntryRecord) == 40 && sizeof(OpRecord) == 16);
+
+        inline OpRecord toOpRecord(const SigDatabase::SigOp &op) {
+            OpRecord record{static_cast<int32_t>(op.opType), 0, 0};
+            if (op.opType == SigDatabase::SigOpType::Disp)
+                record.mValue = op.data.disp;
+            else if (op.opType == SigDatabase::SigOpType::RipRel)
+                record.mValue = static_cast<int64_t>(
+                    op.data.ripRel.offset | (static_cast<uint64_t>(op.data.ripRel.insLen) << 32)
+                );
+            return record;
+        }
+
+        inline SigDatabase::SigOp toSigOp(const OpRecord &record) {
+            auto opType = static_cast<SigDatabase::SigOpType>(record.mType);
+            switch (opType) {
+            case SigDatabase::SigOpType::Disp:
+                return SigDatabase::SigOp(opType, static_cast<ptrdiff_t>(record.mValue));
+            case SigDatabase::SigOpType::RipRel:
+                return SigDatabase::SigOp(
+                    opType,
+                    static_cast<uint32_t>(record.mValue),
+                    static_cast<uint32_t>(static_cast<uint64_t>(record.mValue) >> 32)
+                );
+            default:
+                return SigDatabase::SigOp(opType);
+            }
+        }
+
+        // FNV-1a of the mangled symbol. The index is an open-addressing table with linear
+        // probing from the bucket of the hash modulo the bucket count. Entries are inserted in
+        // order, so entries with the same symbol are probed in order and before the first empty
+        // bucket.
+        inline uint64_t hashSymbol(llvm::StringRef symbol) {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (unsigned char c : symbol) {
+                hash ^= c;
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+    } // namespace sigdb
+
+    // Read-only access to a v2_0_0 database in a mapped file or in memory owned by the caller.
+    // Every offset is checked when the data is attached, after that entries and lookups are
+    // plain pointer arithmetic on the data and nothing is copied.
+    class SigDatabaseView {
+    public:
+        static constexpr size_t npos = SIZE_MAX;
+
+        // An entry of the database. Its strings point into the data of the view.
+        class Entry {
+        public:
+            SigDatabase::SigEntry::Type type() const {
+                return static_cast<SigDatabase::SigEntry::Type>(mRecord->mType);
+            }
+            llvm::StringRef symbol() const { return mView->getString(mRecord->mSymbol); }
+            llvm::StringRef extraSymbol() const { return mView->getString(mRecord->mExtraSymbol); }
+            llvm::StringRef sig() const { return mView->getString(mRecord->mSig); }
+            size_t          operationCount() const { return mRecord->mOpCount; }
+
+            SigDatabase::SigOp operation(size_t index) const;
+
+            // Copies the entry out of the view.
+            SigDatabase::SigEntry toSigEntry() const;
+
+        private:
+            friend class SigDatabaseView;
+
+            Entry(const SigDatabaseView *view, const sigdb::EntryRecord *record) : mView(view), mRecord(record) {}
+
+            const SigDatabaseView    *mView;
+            const sigdb::EntryRecord *mRecord;
+        };
+
+        // Maps a database file. Returns false if it cannot be read or is not a valid v2_0_0
+        // database.
+        bool open(const std::string &path);
+
+        // Uses data that stays alive and unchanged as long as the view. The data must be 8-byte
+        // aligned.
+        bool attach(llvm::StringRef data);
+
+        size_t   size() const { return mHeader ? mHeader->mEntryCount : 0; }
+        uint64_t supportVersion() const { return mHeader ? mHeader->mSupportVersion : 0; }
+
+        Entry entry(size_t index) const { return Entry(this, &mEntries[index]); }
+
+        // Index of the first entry with the mangled symbol, or npos.
+        size_t find(llvm::StringRef symbol) const;
+
+        // Calls callback with the index of every entry with the mangled symbol, in order.
+        void findAll(llvm::StringRef symbol, llvm::function_ref<void(size_t)> callback) const;
+
+    private:
+        llvm::StringRef getString(const sigdb::StringRecord &record) const {
+            return llvm::StringRef(mStrings + record.mOffset, record.mSize);
+        }
+
+        std::unique_ptr<llvm::MemoryBuffer> mBuffer;
+        const sigdb::FileHeader            *mHeader = nullptr;
+        const char                         *mStrings = nullptr;
+        const sigdb::EntryRecord           *mEntries = nullptr;
+        const sigdb::OpRecord              *mOps = nullptr;
+        const uint32_t                     *mBuckets = nullptr;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -4,34 +4,202 @@
 #include <llvm/Support/raw_ostream.h>
 #include <fstream>
 #include <filesystem>
+#include <map>
+#include <regex>
 
 namespace sapphire::codegen {
 
     namespace fs = std::filesystem;
 
-    void SignatureGenerator::generate(const ExportMap &exports, const std::string &outputDir) {
+    void SignatureGenerator::generate(
+        const ExportMap &exports, const std::string &outputDir, SigDatabase::FormatVersion format
+    ) {
+        for (auto &&[ver, sigDatabase] : exports)
+            generate(ver, sigDatabase, outputDir, format);
+    }
+
+    void SignatureGenerator::generate(
+        uint64_t                   version,
+        const SigDatabase         &sigDatabase,
+        const std::string         &outputDir,
+        SigDatabase::FormatVersion format
+    ) {
+        fs::path outputDirPath = fs::absolute(outputDir).lexically_normal();
+        fs::create_directories(outputDirPath);
+
+        auto outputPaths = getOutputPaths(outputDirPath.string(), version);
+        // Generate .sig.db file
+        std::ofstream sigFile(outputPaths[0], std::ios::binary);
+        if (sigFile.is_open()) {
+            sigDatabase.save(sigFile, format);
+        } else {
+            llvm::errs() << "Failed to open .sig.db file for writing.\n";
+        }
+
+        // Generate .def file
+        generateDefFile(outputPaths[1], sigDatabase.getSigEntries());
+    }
+
+    std::vector<std::string> SignatureGenerator::getOutputPaths(const std::string &outputDir, uint64_t version) {
+        fs::path outputDirPath = fs::absolute(outputDir).lexically_normal();
+        auto     verStr = util::mcVersionToString2(version);
+        return {
+            (outputDirPath / llvm::formatv("bedrock_sigs+mc{0}.sig.db", verStr).str()).string(),
+            (outputDirPath / llvm::formatv("bedrock_def+mc{0}.def", verStr).str()).string(),
+        };
+    }
+
+    bool SignatureGenerator::generateBundle(
+        const ExportMap &exports, const std::string &outputDir, SigBundle::Compression compression
+    ) {
+        fs::path outputDirPath = fs::absolute(outputDir).lexically_normal();
+        fs::create_directories(outputDirPath);
+
+        auto bundlePath = getBundlePath(outputDirPath.string());
+        if (!SigBundle::write(bundlePath, exports, compression))
+            return false;
+        std::error_code ec;
+        llvm::outs() << llvm::formatv(
+            "[Success] Generated bundle: {0} ({1} versions, {2} bytes)\n",
+            bundlePath,
+            exports.size(),
+            fs::file_size(bundlePath, ec)
+        );
+        return true;
+    }
+
+    std::string SignatureGenerator::getBundlePath(const std::string &outputDir) {
+        return (fs::absolute(outputDir).lexically_normal() / "bedrock_sigs.sig.bundle").string();
+    }
+
+    std::string SignatureGenerator::getPartialPath(
+        const std::string &outputDir, uint64_t version, unsigned shardIndex, unsigned shardCount
+    ) {
+        auto partialName = llvm::formatv(
+            "bedrock_sigs+mc{0}.part-{1}-of-{2}.sig.db", util::mcVersionToString2(version), shardIndex, shardCount
+        );
+        return (fs::absolute(outputDir).lexically_normal() / partialName.str()).string();
+    }
+
+    bool SignatureGenerator::generatePartial(
+        const ExportMap          &exports,
+        const std::set<uint64_t> &versions,
+        const std::string        &outputDir,
+        unsigned                  shardIndex,
+        unsigned                  shardCount
+    ) {
         fs::path outputDirPath = fs::absolute(outputDir).lexically_normal();
         fs::create_directories(outputDirPath);
 
-        for (auto &&[ver, sigDatabase] : exports) {
-            auto verStr = util::mcVersionToString2(ver);
-            // Generate .sig.db file
-            std::ofstream sigFile(
-                outputDirPath / llvm::formatv("bedrock_sigs+mc{0}.sig.db", verStr).str(),
-                std::ios::binary
+        bool success = true;
+        for (auto version : versions) {
+            auto          found = exports.find(version);
+            SigDatabase   empty(version);
+            auto         &sigDatabase = found != exports.end() ? found->second : empty;
+            auto          partialPath = getPartialPath(outputDirPath.string(), version, shardIndex, shardCount);
+            std::ofstream sigFile(partialPath, std::ios::binary);
+            if (!sigFile.is_open() || !sigDatabase.save(sigFile)) {
+                llvm::errs() << llvm::formatv("[Error] Cannot write to {0}\n", partialPath);
+                success = false;
+                continue;
+            }
+            llvm::outs() << llvm::formatv(
+                "[Success] Generated partial: {0} ({1} entries)\n", partialPath, sigDatabase.size()
             );
-            if (sigFile.is_open()) {
-                const_cast<SigDatabase &>(sigDatabase).save(sigFile);
-            } else {
-                llvm::errs() << "Failed to open .sig.db file for writing.\n";
+        }
+        return success;
+    }
+
+    bool SignatureGenerator::mergePartials(
+        const std::vector<std::string> &inputDirs,
+        const std::set<uint64_t>       &versions,
+        ExportMap                      &exports
+    ) {
+        static const std::regex partialPattern(R"(bedrock_sigs\+mc(.+)\.part-(\d+)-of-(\d+)\.sig\.db)");
+
+        // Partial paths of each version by shard index.
+        std::map<uint64_t, std::map<unsigned, fs::path>> partials;
+        unsigned                                         shardCount = 0;
+        for (auto &&inputDir : inputDirs) {
+            std::error_code ec;
+            for (auto &&file : fs::directory_iterator(inputDir, ec)) {
+                std::smatch match;
+                auto        fileName = file.path().filename().string();
+                if (!file.is_regular_file() || !std::regex_match(fileName, match, partialPattern))
+                    continue;
+                auto version = util::parseMCVersion(match[1].str());
+                if (!versions.count(version))
+                    continue;
+                unsigned index = 0, count = 0;
+                if (llvm::StringRef(match[2].str()).getAsInteger(10, index)
+                    || llvm::StringRef(match[3].str()).getAsInteger(10, count) || !count || index >= count) {
+                    llvm::errs() << llvm::formatv("[Error] Invalid shard in {0}.\n", file.path().string());
+                    return false;
+                }
+                if (shardCount && count != shardCount) {
+                    llvm::errs() << llvm::formatv(
+                        "[Error] {0} is one of {1} shards, but other partials are of {2}.\n",
+                        file.path().string(),
+                        count,
+                        shardCount
+                    );
+                    return false;
+                }
+                shardCount = count;
+                auto [existing, inserted] = partials[version].try_emplace(index, file.path());
+                if (!inserted) {
+                    llvm::errs() << llvm::formatv(
+                        "[Error] Shard {0} of {1} is present twice: {2}, {3}\n",
+                        index,
+                        util::mcVersionToString2(version),
+                        existing->second.string(),
+                        file.path().string()
+                    );
+                    return false;
+                }
             }
+            if (ec) {
+                llvm::errs() << llvm::formatv("[Error] Cannot read directory {0}: {1}\n", inputDir, ec.message());
+                return false;
+            }
+        }
 
-            // Generate .def file
-            generateDefFile(
-                (outputDirPath / llvm::formatv("bedrock_def+mc{0}.def", verStr).str()).string(),
-                sigDatabase.getSigEntries()
+        for (auto version : versions) {
+            auto &versionPartials = partials[version];
+            for (unsigned i = 0; i < std::max(shardCount, 1u); ++i) {
+                if (!versionPartials.count(i)) {
+                    llvm::errs() << llvm::formatv(
+                        "[Error] Missing shard {0} of {1} for {2}.\n",
+                        i,
+                        std::max(shardCount, 1u),
+                        util::mcVersionToString2(version)
+                    );
+                    return false;
+                }
+            }
+
+            SigDatabase merged(version);
+            for (auto &&[index, path] : versionPartials) {
+                std::ifstream sigFile(path, std::ios::binary);
+                SigDatabase   partial(version);
+                if (!sigFile.is_open() || !partial.load(sigFile, /*allowEmpty*/ true)) {
+                    llvm::errs() << llvm::formatv("[Error] Cannot load partial {0}\n", path.string());
+                    return false;
+                }
+                merged.merge(std::move(partial));
+            }
+            // Matches the order of a run that is not sharded.
+            merged.sortEntries();
+            llvm::outs() << llvm::formatv(
+                "[Merge] {0}: {1} entries from {2} shards.\n",
+                util::mcVersionToString2(version),
+                merged.size(),
+                versionPartials.size()
             );
+            if (merged.size())
+                exports.insert_or_assign(version, std::move(merged));
         }
+        return true;
     }
 
     void SignatureGenerator::generateDefFile(
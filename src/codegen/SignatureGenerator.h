@@ -1,7 +1,10 @@
 #pragma once
 
 #include "ASTParser.h" // For ExportMap
+#include "SigBundle.h"
+#include <set>
 #include <string>
+#include <vector>
 
 namespace sapphire::codegen {
 
@@ -9,8 +12,53 @@ namespace sapphire::codegen {
     public:
         // Generates .sig.db and .def files for each version in the export map.
         static void generate(
-            const ExportMap   &exports,
-            const std::string &outputDir
+            const ExportMap           &exports,
+            const std::string         &outputDir,
+            SigDatabase::FormatVersion format = SigDatabase::FormatVersion::v1_1_0
+        );
+
+        // Generates the .sig.db and .def file of a single version.
+        static void generate(
+            uint64_t                   version,
+            const SigDatabase         &sigDatabase,
+            const std::string         &outputDir,
+            SigDatabase::FormatVersion format = SigDatabase::FormatVersion::v1_1_0
+        );
+
+        // Writes the entries of every version in the export map into one bundle.
+        static bool generateBundle(
+            const ExportMap       &exports,
+            const std::string     &outputDir,
+            SigBundle::Compression compression
+        );
+
+        // Writes the entries of one shard as a partial .sig.db per version, including versions
+        // without entries, so that a merge can tell a missing shard from an empty one.
+        static bool generatePartial(
+            const ExportMap          &exports,
+            const std::set<uint64_t> &versions,
+            const std::string        &outputDir,
+            unsigned                  shardIndex,
+            unsigned                  shardCount
+        );
+
+        // Combines the partial databases found in inputDirs. Fails unless every shard of every
+        // version is present exactly once.
+        static bool mergePartials(
+            const std::vector<std::string> &inputDirs,
+            const std::set<uint64_t>       &versions,
+            ExportMap                      &exports
+        );
+
+        // Paths of the .sig.db and .def file that generate() writes for a version.
+        static std::vector<std::string> getOutputPaths(const std::string &outputDir, uint64_t version);
+
+        // Path of the bundle that generateBundle() writes.
+        static std::string getBundlePath(const std::string &outputDir);
+
+        // Path of the partial database that generatePartial() writes for a version.
+        static std::string getPartialPath(
+            const std::string &outputDir, uint64_t version, unsigned shardIndex, unsigned shardCount
         );
 
     private:
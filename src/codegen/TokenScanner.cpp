@@ -0,0 +1,170 @@
+#include "TokenScanner.h"
+
+#include <llvm/ADT/bit.h>
+#include <llvm/TargetParser/Host.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#    define SAPPHIRE_SCAN_X86 1
+#    include <immintrin.h>
+#    if defined(__GNUC__) || defined(__clang__)
+#        define SAPPHIRE_TARGET_AVX2 __attribute__((target("avx2")))
+#    else
+#        define SAPPHIRE_TARGET_AVX2
+#    endif
+#endif
+
+namespace sapphire::codegen {
+
+    namespace {
+
+        // Returns the first byte in [begin, end) that is one of the four in set, or end.
+        using FindFn = const char *(*)(const char *begin, const char *end, const char *set);
+
+        const char *findScalar(const char *begin, const char *end, const char *set) {
+            for (; begin < end; ++begin) {
+                char c = *begin;
+                if (c == set[0] || c == set[1] || c == set[2] || c == set[3])
+                    return begin;
+            }
+            return end;
+        }
+
+#ifdef SAPPHIRE_SCAN_X86
+
+        // SSE2 is part of x86-64, so this needs no check.
+        const char *findSSE2(const char *begin, const char *end, const char *set) {
+            const __m128i set0 = _mm_set1_epi8(set[0]);
+            const __m128i set1 = _mm_set1_epi8(set[1]);
+            const __m128i set2 = _mm_set1_epi8(set[2]);
+            const __m128i set3 = _mm_set1_epi8(set[3]);
+            for (; end - begin >= 16; begin += 16) {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+                __m128i found = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, set0), _mm_cmpeq_epi8(chunk, set1)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, set2), _mm_cmpeq_epi8(chunk, set3))
+                );
+                auto mask = static_cast<uint32_t>(_mm_movemask_epi8(found));
+                if (mask)
+                    return begin + llvm::countr_zero(mask);
+            }
+            return findScalar(begin, end, set);
+        }
+
+        SAPPHIRE_TARGET_AVX2 const char *findAVX2(const char *begin, const char *end, const char *set) {
+            const __m256i set0 = _mm256_set1_epi8(set[0]);
+            const __m256i set1 = _mm256_set1_epi8(set[1]);
+            const __m256i set2 = _mm256_set1_epi8(set[2]);
+            const __m256i set3 = _mm256_set1_epi8(set[3]);
+            for (; end - begin >= 32; begin += 32) {
+                __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+                __m256i found = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, set0), _mm256_cmpeq_epi8(chunk, set1)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, set2), _mm256_cmpeq_epi8(chunk, set3))
+                );
+                auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(found));
+                if (mask)
+                    return begin + llvm::countr_zero(mask);
+            }
+            return findSSE2(begin, end, set);
+        }
+
+#endif
+
+        struct FindImpl {
+            FindFn          mFind;
+            llvm::StringRef mName;
+        };
+
+        // Selected once from the features of the host CPU, which include the OS support for the
+        // wider registers.
+        const FindImpl &getFindImpl() {
+            static const FindImpl impl = []() -> FindImpl {
+#ifdef SAPPHIRE_SCAN_X86
+                if (llvm::sys::getHostCPUFeatures().lookup("avx2"))
+                    return {findAVX2, "AVX2"};
+                return {findSSE2, "SSE2"};
+#else
+                return {findScalar, "scalar"};
+#endif
+            }();
+            return impl;
+        }
+
+        inline bool isIdentChar(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        }
+
+    } // namespace
+
+    llvm::StringRef TokenScanner::getInstructionSet() {
+        return getFindImpl().mName;
+    }
+
+    bool TokenScanner::scan(llvm::StringRef content, llvm::StringRef token, std::vector<uint32_t> *offsets) {
+        if (content.empty() || token.empty()) return false;
+
+        auto        find = getFindImpl().mFind;
+        const char *begin = content.begin();
+        const char *end = content.end();
+        size_t      tLen = token.size();
+
+        // Bytes that end each state. A backslash in a literal escapes the next byte.
+        const char codeSet[4] = {'/', '"', '\'', token[0]};
+        const char stringSet[4] = {'"', '\\', '\\', '\\'};
+        const char charSet[4] = {'\'', '\\', '\\', '\\'};
+
+        // Skips a literal that starts before p, returns the byte after its closing quote.
+        auto skipLiteral = [&](const char *p, const char *set) {
+            while ((p = find(p, end, set)) != end) {
+                if (*p != '\\')
+                    return p + 1;
+                p = end - p > 2 ? p + 2 : end;
+            }
+            return end;
+        };
+
+        for (const char *p = begin; (p = find(p, end, codeSet)) != end;) {
+            char c = *p;
+            if (c == '/' && p + 1 < end) {
+                if (p[1] == '/') {
+                    auto *newline = static_cast<const char *>(std::memchr(p + 2, '\n', end - (p + 2)));
+                    if (!newline)
+                        break;
+                    p = newline + 1;
+                    continue;
+                }
+                if (p[1] == '*') {
+                    const char *star = p + 2;
+                    while ((star = static_cast<const char *>(std::memchr(star, '*', end - star)))
+                           && star + 1 < end && star[1] != '/')
+                        ++star;
+                    if (!star || star + 1 >= end)
+                        break;
+                    p = star + 2;
+                    continue;
+                }
+            }
+            if (c == '"' || c == '\'') {
+                p = skipLiteral(p + 1, c == '"' ? stringSet : charSet);
+                continue;
+            }
+
+            if (c == token[0] && static_cast<size_t>(end - p) >= tLen && llvm::StringRef(p, tLen) == token) {
+                bool prevOk = p == begin || !isIdentChar(p[-1]);
+                bool nextOk = static_cast<size_t>(end - p) == tLen || !isIdentChar(p[tLen]);
+                if (prevOk && nextOk) {
+                    if (!offsets)
+                        return true;
+                    offsets->push_back(static_cast<uint32_t>(p - begin));
+                    p += tLen;
+                    continue;
+                }
+            }
+            ++p;
+        }
+
+        return offsets && !offsets->empty();
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <cstdint>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // Finds an identifier token outside comments and string and character literals. Instead of
+    // stepping through every byte, the scan jumps between the bytes that can change its state or
+    // start the token, which it finds 16 or 32 bytes at a time with the widest SIMD instructions
+    // this CPU supports.
+    class TokenScanner {
+    public:
+        // Returns true if the content contains the token. Collects every occurrence into offsets
+        // if given, otherwise stops at the first one.
+        static bool scan(llvm::StringRef content, llvm::StringRef token, std::vector<uint32_t> *offsets = nullptr);
+
+        // Name of the instruction set the scan uses on this CPU.
+        static llvm::StringRef getInstructionSet();
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
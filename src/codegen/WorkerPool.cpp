@@ -0,0 +1,276 @@
+#include "WorkerPool.h"
+
+#include <llvm/Support/Program.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _WIN32
+#    define NOMINMAX
+#    define WIN32_LEAN_AND_MEAN
+#    include <windows.h>
+#else
+#    include <csignal>
+#    include <cerrno>
+#    include <fcntl.h>
+#    include <spawn.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+extern char **environ;
+#endif
+
+namespace sapphire::codegen {
+
+    // Larger frames mean a corrupted stream.
+    static constexpr uint64_t MAX_FRAME_SIZE = 1ull << 32;
+
+    // Spawning is serialized so that no child inherits pipe ends created for another one.
+    static std::mutex gSpawnMutex;
+
+#ifdef _WIN32
+
+    std::unique_ptr<WorkerProcess> WorkerProcess::spawn(const std::vector<std::string> &args) {
+        std::vector<llvm::StringRef> argRefs(args.begin(), args.end());
+        auto                         commandLine = llvm::sys::flattenWindowsCommandLine(argRefs);
+        if (!commandLine)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(gSpawnMutex);
+
+        SECURITY_ATTRIBUTES attributes{sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE};
+        HANDLE              childInput = nullptr, parentInput = nullptr;
+        HANDLE              parentOutput = nullptr, childOutput = nullptr;
+        if (!CreatePipe(&childInput, &parentInput, &attributes, 0))
+            return nullptr;
+        if (!CreatePipe(&parentOutput, &childOutput, &attributes, 0)) {
+            CloseHandle(childInput);
+            CloseHandle(parentInput);
+            return nullptr;
+        }
+        SetHandleInformation(parentInput, HANDLE_FLAG_INHERIT, 0);
+        SetHandleInformation(parentOutput, HANDLE_FLAG_INHERIT, 0);
+
+        STARTUPINFOW startupInfo{};
+        startupInfo.cb = sizeof(startupInfo);
+        startupInfo.dwFlags = STARTF_USESTDHANDLES;
+        startupInfo.hStdInput = childInput;
+        startupInfo.hStdOutput = childOutput;
+        startupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+        PROCESS_INFORMATION processInfo{};
+        BOOL                created = CreateProcessW(
+            nullptr, commandLine->data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startupInfo, &processInfo
+        );
+        CloseHandle(childInput);
+        CloseHandle(childOutput);
+        if (!created) {
+            CloseHandle(parentInput);
+            CloseHandle(parentOutput);
+            return nullptr;
+        }
+        CloseHandle(processInfo.hThread);
+
+        std::unique_ptr<WorkerProcess> worker(new WorkerProcess());
+        worker->mProcess = processInfo.hProcess;
+        worker->mInput = parentInput;
+        worker->mOutput = parentOutput;
+        return worker;
+    }
+
+    WorkerProcess::~WorkerProcess() {
+        CloseHandle(mInput);
+        CloseHandle(mOutput);
+        WaitForSingleObject(mProcess, INFINITE);
+        CloseHandle(mProcess);
+    }
+
+    void WorkerProcess::terminate() {
+        TerminateProcess(mProcess, 1);
+    }
+
+    bool WorkerProcess::writeAll(const char *data, size_t size) {
+        while (size) {
+            DWORD written = 0;
+            DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+            if (!WriteFile(mInput, data, chunk, &written, nullptr))
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool WorkerProcess::readAll(char *data, size_t size) {
+        while (size) {
+            DWORD read = 0;
+            DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+            if (!ReadFile(mOutput, data, chunk, &read, nullptr) || read == 0)
+                return false;
+            data += read;
+            size -= read;
+        }
+        return true;
+    }
+
+#else
+
+    std::unique_ptr<WorkerProcess> WorkerProcess::spawn(const std::vector<std::string> &args) {
+        // A worker that dies must fail the write, not kill the parent.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::lock_guard<std::mutex> lock(gSpawnMutex);
+
+        int toChild[2], fromChild[2];
+        if (pipe(toChild) != 0)
+            return nullptr;
+        if (pipe(fromChild) != 0) {
+            close(toChild[0]);
+            close(toChild[1]);
+            return nullptr;
+        }
+        for (int fd : {toChild[0], toChild[1], fromChild[0], fromChild[1]})
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, toChild[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fromChild[1], STDOUT_FILENO);
+
+        std::vector<char *> argv;
+        for (auto &&arg : args)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+
+        pid_t pid = -1;
+        int   error = posix_spawn(&pid, args[0].c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(toChild[0]);
+        close(fromChild[1]);
+        if (error) {
+            close(toChild[1]);
+            close(fromChild[0]);
+            return nullptr;
+        }
+
+        std::unique_ptr<WorkerProcess> worker(new WorkerProcess());
+        worker->mPid = pid;
+        worker->mInput = toChild[1];
+        worker->mOutput = fromChild[0];
+        return worker;
+    }
+
+    WorkerProcess::~WorkerProcess() {
+        close(mInput);
+        close(mOutput);
+        while (waitpid(mPid, nullptr, 0) < 0 && errno == EINTR) {}
+    }
+
+    void WorkerProcess::terminate() {
+        kill(mPid, SIGKILL);
+    }
+
+    bool WorkerProcess::writeAll(const char *data, size_t size) {
+        while (size) {
+            auto written = write(mInput, data, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool WorkerProcess::readAll(char *data, size_t size) {
+        while (size) {
+            auto bytesRead = read(mOutput, data, size);
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0)
+                return false;
+            data += bytesRead;
+            size -= bytesRead;
+        }
+        return true;
+    }
+
+#endif
+
+    bool WorkerProcess::send(llvm::StringRef frame) {
+        uint64_t size = frame.size();
+        return writeAll(reinterpret_cast<const char *>(&size), sizeof(size)) && writeAll(frame.data(), frame.size());
+    }
+
+    bool WorkerProcess::receive(std::string &frame) {
+        uint64_t size = 0;
+        if (!readAll(reinterpret_cast<char *>(&size), sizeof(size)) || size > MAX_FRAME_SIZE)
+            return false;
+        frame.resize(size);
+        return readAll(frame.data(), size);
+    }
+
+    namespace worker {
+
+        void setupStdio() {
+            llvm::sys::ChangeStdinToBinary();
+            llvm::sys::ChangeStdoutToBinary();
+        }
+
+        bool receiveFromParent(std::string &frame) {
+            uint64_t size = 0;
+            if (std::fread(&size, sizeof(size), 1, stdin) != 1 || size > MAX_FRAME_SIZE)
+                return false;
+            frame.resize(size);
+            return std::fread(frame.data(), 1, size, stdin) == size;
+        }
+
+        bool sendToParent(llvm::StringRef frame) {
+            uint64_t size = frame.size();
+            return std::fwrite(&size, sizeof(size), 1, stdout) == 1
+                && std::fwrite(frame.data(), 1, frame.size(), stdout) == frame.size() && std::fflush(stdout) == 0;
+        }
+
+    } // namespace worker
+
+    std::unique_ptr<WorkerProcess> WorkerPool::acquire() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [&] { return !mIdle.empty() || mLiveCount < mSize; });
+        if (!mIdle.empty()) {
+            auto worker = std::move(mIdle.back());
+            mIdle.pop_back();
+            return worker;
+        }
+        ++mLiveCount;
+        lock.unlock();
+        return WorkerProcess::spawn(mArgs);
+    }
+
+    void WorkerPool::release(std::unique_ptr<WorkerProcess> worker) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mIdle.emplace_back(std::move(worker));
+        }
+        mCondition.notify_one();
+    }
+
+    bool WorkerPool::call(llvm::StringRef request, std::string &reply) {
+        auto worker = acquire();
+        if (worker && worker->send(request) && worker->receive(reply)) {
+            release(std::move(worker));
+            return true;
+        }
+        if (worker) {
+            worker->terminate();
+            worker.reset();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            --mLiveCount;
+            ++mFailureCount;
+        }
+        mCondition.notify_one();
+        return false;
+    }
+
+} // namespace sapphire::codegen
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sapphire::codegen {
+
+    // A child process whose stdin and stdout are pipes to this process. Messages are exchanged
+    // as length-prefixed frames.
+    class WorkerProcess {
+    public:
+        // Starts args[0] with the given arguments. Returns null if the process cannot be started.
+        static std::unique_ptr<WorkerProcess> spawn(const std::vector<std::string> &args);
+
+        // Closes the pipes, which tells the worker to exit, and waits for it.
+        ~WorkerProcess();
+
+        WorkerProcess(const WorkerProcess &) = delete;
+        WorkerProcess &operator=(const WorkerProcess &) = delete;
+
+        bool send(llvm::StringRef frame);
+        bool receive(std::string &frame);
+
+        // Kills the worker without waiting for it to finish its current frame.
+        void terminate();
+
+    private:
+        WorkerProcess() = default;
+
+        bool writeAll(const char *data, size_t size);
+        bool readAll(char *data, size_t size);
+
+#ifdef _WIN32
+        void *mProcess = nullptr;
+        void *mInput = nullptr;
+        void *mOutput = nullptr;
+#else
+        int mPid = -1;
+        int mInput = -1;
+        int mOutput = -1;
+#endif
+    };
+
+    // Worker side of WorkerProcess: exchanges frames with the parent over stdin and stdout.
+    // Nothing else may write to stdout in a worker.
+    namespace worker {
+        void setupStdio();
+        bool receiveFromParent(std::string &frame);
+        bool sendToParent(llvm::StringRef frame);
+    } // namespace worker
+
+    // A fixed number of long-lived worker processes, started on first use. A worker that crashes
+    // or breaks the protocol is replaced by a fresh one for the next call.
+    class WorkerPool {
+    public:
+        WorkerPool(std::vector<std::string> args, unsigned size) : mArgs(std::move(args)), mSize(size) {}
+
+        // Sends a request to an idle worker and waits for its reply. Returns false if the worker
+        // died or could not be started.
+        bool call(llvm::StringRef request, std::string &reply);
+
+        unsigned size() const { return mSize; }
+        size_t   failureCount() const { return mFailureCount; }
+
+    private:
+        std::unique_ptr<WorkerProcess> acquire();
+        void                           release(std::unique_ptr<WorkerProcess> worker);
+
+        const std::vector<std::string>              mArgs;
+        const unsigned                              mSize;
+        std::mutex                                  mMutex;
+        std::condition_variable                     mCondition;
+        std::vector<std::unique_ptr<WorkerProcess>> mIdle;
+        unsigned                                    mLiveCount = 0;
+        size_t                                      mFailureCount = 0;
+    };
+
+} // namespace sapphire::codegen
\ No newline at end of file
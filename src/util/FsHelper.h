@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace sapphire::codegen::fshelper {
+
+    template <typename T, std::enable_if_t<std::is_scalar_v<T>, char> = 0>
+    auto read(std::istream &fs) {
+        T result;
+        fs.read(reinterpret_cast<char *>(&result), sizeof(T));
+        return result;
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_scalar_v<T>>>
+    void write(std::ostream &fs, T s) {
+        fs.write(reinterpret_cast<char *>(&s), sizeof(T));
+    }
+
+    template <typename T, std::enable_if_t<std::is_same_v<T, std::string>, char> = 0>
+    auto read(std::istream &fs) {
+        std::string    result;
+        const uint64_t length = fshelper::read<uint64_t>(fs);
+        result.resize(length);
+        fs.read(result.data(), length);
+        return result;
+    }
+
+    inline void write(std::ostream &fs, const std::string &s) {
+        write<uint64_t>(fs, s.size());
+        fs.write(s.data(), s.size());
+    }
+
+    // Serialized data in memory, read with the same read() overloads as a stream. Reading past
+    // the end throws, so a corrupted length can neither read out of bounds nor allocate memory
+    // for data that is not there.
+    class SpanReader {
+    public:
+        explicit SpanReader(std::string_view data) : mData(data) {}
+
+        size_t remaining() const { return mData.size(); }
+
+        std::string_view take(uint64_t size) {
+            if (size > mData.size())
+                throw std::runtime_error{"Unexpected end of data"};
+            auto result = mData.substr(0, size);
+            mData.remove_prefix(size);
+            return result;
+        }
+
+        // Throws unless count items of at least minSize bytes each fit in the rest of the data,
+        // so that reserving memory for them is safe.
+        void expect(uint64_t count, size_t minSize) const {
+            if (count > mData.size() / minSize)
+                throw std::runtime_error{"Count exceeds the remaining data"};
+        }
+
+    private:
+        std::string_view mData;
+    };
+
+    template <typename T, std::enable_if_t<std::is_scalar_v<T>, char> = 0>
+    auto read(SpanReader &reader) {
+        T result;
+        std::memcpy(&result, reader.take(sizeof(T)).data(), sizeof(T));
+        return result;
+    }
+
+    template <typename T, std::enable_if_t<std::is_same_v<T, std::string>, char> = 0>
+    auto read(SpanReader &reader) {
+        const uint64_t length = fshelper::read<uint64_t>(reader);
+        return std::string(reader.take(length));
+    }
+
+    // Appends the layout of the stream overloads to a buffer, so that it is written at once.
+    template <typename T, typename = std::enable_if_t<std::is_scalar_v<T>>>
+    void write(std::string &buffer, T s) {
+        buffer.append(reinterpret_cast<const char *>(&s), sizeof(T));
+    }
+
+    inline void write(std::string &buffer, const std::string &s) {
+        write<uint64_t>(buffer, s.size());
+        buffer.append(s);
+    }
+
+} // namespace sapphire::codegen::fshelper
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+#include <cstdint>
+#include <cstring>
+
+namespace sapphire::codegen::util {
+
+    // Order-sensitive hash that is stable across runs and machines, for persisted cache keys.
+    class StableHasher {
+    public:
+        StableHasher &add(llvm::StringRef str) {
+            add(static_cast<uint64_t>(str.size()));
+            mMD5.update(str);
+            return *this;
+        }
+
+        StableHasher &add(uint64_t value) {
+            uint8_t bytes[sizeof(value)];
+            std::memcpy(bytes, &value, sizeof(value));
+            mMD5.update(llvm::ArrayRef<uint8_t>(bytes));
+            return *this;
+        }
+
+        uint64_t finish() {
+            llvm::MD5::MD5Result result;
+            mMD5.final(result);
+            return result.low();
+        }
+
+    private:
+        llvm::MD5 mMD5;
+    };
+
+} // namespace sapphire::codegen::util
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <mutex>
+
+namespace sapphire::codegen::util {
+
+    // Serializes writes to the buffered llvm::outs() from worker threads.
+    inline std::mutex &logMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+} // namespace sapphire::codegen::util
\ No newline at end of file
@@ -38,6 +38,14 @@ namespace sapphire::codegen::util {
         return v1 + v2 * 1'000 + v3;
     }
 
+    // "i/N" -> index i of N shards, with i < N
+    inline bool parseShard(llvm::StringRef shardStr, unsigned &index, unsigned &count) {
+        auto [indexStr, countStr] = shardStr.trim(' ').split('/');
+        if (indexStr.trim(' ').getAsInteger(10, index) || countStr.trim(' ').getAsInteger(10, count))
+            return false;
+        return count > 0 && index < count;
+    }
+
     static bool parseMCVersions(std::set<uint64_t> &result, llvm::StringRef versStr) {
         llvm::SmallVector<llvm::StringRef> split;
         versStr.split(split, ',');
@@ -31,6 +31,14 @@
 #define SPHR_DECL_API(...) \
     [[clang::annotate("sapphire::bind", __VA_ARGS__)]]
 
+// Set by the generator for each target version.
+#ifndef MC_VERSION
+#    define MC_VERSION v1_21_60
+#endif
+#define v1_21_2  1210200
+#define v1_21_50 1215000
+#define v1_21_60 1216000
+
 #define SPHR_CTOR_ALIAS \
     [[clang::annotate("sapphire::alias", 0)]]
 #define SPHR_DTOR_ALIAS \
@@ -54,4 +62,29 @@ public:
 
     SPHR_DECL_API("1.21.2", "disp:+1,deref", "\xE8\x00\x00\x00\x00\x48")
     void tick(float a);
+};
+
+class Level {
+public:
+#if MC_VERSION >= v1_21_50
+    SPHR_DECL_API("v1_21_50,v1_21_60", "\x40\x53\x48\x83\xEC")
+    void tick();
+#endif
+
+#if MC_VERSION == v1_21_2
+    SPHR_DECL_API("1.21.2", "\x48\x8B\x81\x00\x00")
+    int getTime() const;
+#elif MC_VERSION < v1_21_60
+    SPHR_DECL_API("v1_21_50", "\x48\x8B\x82\x00\x00")
+    int getTime() const;
+#else
+    SPHR_DECL_API("v1_21_60", "\x48\x8B\x83\x00\x00")
+    int getTime() const;
+#endif
+
+    // Compound guards may be true for any version, so the annotation applies to 1.21.2 as well.
+#if MC_VERSION >= v1_21_50 || !defined(NDEBUG)
+    SPHR_DECL_API("1.21.2,v1_21_50", "\x40\x57\x48\x83\xEC")
+    void save();
+#endif
 };
\ No newline at end of file